@@ -113,6 +113,26 @@ int ffio_read_indirect(AVIOContext *s, unsigned char *buf, int size, const unsig
 
 void ffio_fill(AVIOContext *s, int b, int64_t count);
 
+/**
+ * Get contiguous space for writing size bytes directly into the write
+ * buffer, flushing it first if not enough space is left.
+ * The bytes must be filled and then committed with ffio_commit_write_buffer()
+ * before any other write to the context.
+ *
+ * Since the buffer is flushed only at reserved boundaries, on packetized
+ * protocols (max_packet_size set) data reserved together never straddles two
+ * packets.
+ *
+ * @return pointer to the space to fill, or NULL if the context writes
+ *         directly or its buffer is smaller than size; use avio_write() then
+ */
+uint8_t *ffio_reserve_write_buffer(AVIOContext *s, int size);
+
+/**
+ * Commit size bytes previously obtained with ffio_reserve_write_buffer().
+ */
+void ffio_commit_write_buffer(AVIOContext *s, int size);
+
 static av_always_inline void ffio_wfourcc(AVIOContext *pb, const uint8_t *s)
 {
     avio_wl32(pb, MKTAG(s[0], s[1], s[2], s[3]));
@@ -229,6 +229,24 @@ void ffio_fill(AVIOContext *s, int b, int64_t count)
     }
 }
 
+uint8_t *ffio_reserve_write_buffer(AVIOContext *s, int size)
+{
+    if (!s->write_flag || (s->direct && !s->update_checksum) ||
+        size > s->buf_end - s->buffer)
+        return NULL;
+    if (s->buf_end - s->buf_ptr < size)
+        flush_buffer(s);
+    return s->buf_ptr;
+}
+
+void ffio_commit_write_buffer(AVIOContext *s, int size)
+{
+    av_assert2(size <= s->buf_end - s->buf_ptr);
+    s->buf_ptr += size;
+    if (s->buf_ptr >= s->buf_end)
+        flush_buffer(s);
+}
+
 void avio_write(AVIOContext *s, const unsigned char *buf, int size)
 {
     if (s->direct && !s->update_checksum) {
@@ -165,6 +165,20 @@ struct MpegTSContext {
     int resync_size;
     int merge_pmt_versions;
     int max_packet_size;
+    int gather_pes;
+
+    /** programs (service ids) and PIDs to demux, everything else is dropped */
+    char *select_programs;
+    char *select_pids;
+    unsigned *selected_prg;
+    int nb_selected_prg;
+    /** set if select_programs or select_pids is used */
+    int pid_filter;
+    /** PIDs let through to handle_packet(), rebuilt on every PAT/PMT */
+    uint32_t pid_mask[NB_PID_MAX / 32];
+    /** PIDs given by select_pids */
+    uint32_t user_pid_mask[NB_PID_MAX / 32];
+    int nb_user_pids;
 
     /******************************************/
     /* private mpegts data */
@@ -203,6 +217,12 @@ static const AVOption options[] = {
      {.i64 = 0}, 0, 1, 0 },
     {"max_packet_size", "maximum size of emitted packet", offsetof(MpegTSContext, max_packet_size), AV_OPT_TYPE_INT,
      {.i64 = 204800}, 1, INT_MAX/2, AV_OPT_FLAG_DECODING_PARAM },
+    {"gather_pes", "append runs of PES continuation packets in one pass", offsetof(MpegTSContext, gather_pes), AV_OPT_TYPE_BOOL,
+     {.i64 = 1}, 0, 1, AV_OPT_FLAG_DECODING_PARAM },
+    {"select_programs", "only demux these programs (service ids separated by '+' or ',')", offsetof(MpegTSContext, select_programs), AV_OPT_TYPE_STRING,
+     {.str = NULL}, 0, 0, AV_OPT_FLAG_DECODING_PARAM },
+    {"select_pids", "only demux these elementary stream PIDs (separated by '+' or ',')", offsetof(MpegTSContext, select_pids), AV_OPT_TYPE_STRING,
+     {.str = NULL}, 0, 0, AV_OPT_FLAG_DECODING_PARAM },
     { NULL },
 };
 
@@ -346,6 +366,107 @@ static void add_pid_to_program(struct Program *p, unsigned int pid)
     p->pids[p->nb_pids++] = pid;
 }
 
+static inline int pid_selected(const MpegTSContext *ts, unsigned int pid)
+{
+    return !ts->pid_filter || (ts->pid_mask[pid >> 5] >> (pid & 31)) & 1;
+}
+
+static inline void select_pid(uint32_t *mask, unsigned int pid)
+{
+    mask[pid >> 5] |= 1U << (pid & 31);
+}
+
+static int program_selected(const MpegTSContext *ts, unsigned int programid)
+{
+    int i;
+    for (i = 0; i < ts->nb_selected_prg; i++)
+        if (ts->selected_prg[i] == programid)
+            return 1;
+    return 0;
+}
+
+/**
+ * Rebuild the PID mask from the current PAT/PMT state: the PAT and SDT,
+ * the PIDs given by the user, and the PMT, PCR and elementary stream PIDs
+ * of the selected programs. With a PID selection every PMT is let through,
+ * so that the selected streams can be found in whatever program they are.
+ */
+static void update_pid_filter(MpegTSContext *ts)
+{
+    int i, j;
+
+    if (!ts->pid_filter)
+        return;
+    memcpy(ts->pid_mask, ts->user_pid_mask, sizeof(ts->pid_mask));
+    select_pid(ts->pid_mask, PAT_PID);
+    select_pid(ts->pid_mask, SDT_PID);
+    for (i = 0; i < ts->nb_prg; i++) {
+        const struct Program *p = &ts->prg[i];
+        if (program_selected(ts, p->id)) {
+            for (j = 0; j < p->nb_pids; j++)
+                select_pid(ts->pid_mask, p->pids[j]);
+        } else if (ts->nb_user_pids && p->nb_pids) {
+            select_pid(ts->pid_mask, p->pids[0]);
+        }
+    }
+}
+
+/* parse a list of numbers separated by '+', ',' or spaces */
+static int parse_id_list(AVFormatContext *s, const char *name, const char *str,
+                         unsigned max, unsigned **ids, int *nb_ids)
+{
+    while (*str) {
+        unsigned long id;
+        char *end;
+
+        if (*str == '+' || *str == ',' || *str == ' ') {
+            str++;
+            continue;
+        }
+        id = strtoul(str, &end, 0);
+        if (end == str || id > max) {
+            av_log(s, AV_LOG_ERROR, "Invalid %s '%s'\n", name, str);
+            return AVERROR(EINVAL);
+        }
+        if (av_reallocp_array(ids, *nb_ids + 1, sizeof(**ids)) < 0) {
+            *nb_ids = 0;
+            return AVERROR(ENOMEM);
+        }
+        (*ids)[(*nb_ids)++] = id;
+        str = end;
+    }
+    return 0;
+}
+
+static int init_pid_filter(AVFormatContext *s)
+{
+    MpegTSContext *ts = s->priv_data;
+    unsigned *pids = NULL;
+    int i, ret;
+
+    if (ts->select_programs) {
+        ret = parse_id_list(s, "program", ts->select_programs, 0xffff,
+                            &ts->selected_prg, &ts->nb_selected_prg);
+        if (ret < 0)
+            return ret;
+    }
+    if (ts->select_pids) {
+        ret = parse_id_list(s, "PID", ts->select_pids, NB_PID_MAX - 1,
+                            &pids, &ts->nb_user_pids);
+        if (ret < 0)
+            return ret;
+        for (i = 0; i < ts->nb_user_pids; i++)
+            select_pid(ts->user_pid_mask, pids[i]);
+        av_free(pids);
+    }
+    ts->pid_filter = ts->nb_selected_prg || ts->nb_user_pids;
+    if (ts->pid_filter)
+        av_log(s, AV_LOG_VERBOSE, "demuxing %d programs and %d PIDs only\n",
+               ts->nb_selected_prg, ts->nb_user_pids);
+    update_pid_filter(ts);
+    return 0;
+}
+
 static void update_av_program_info(AVFormatContext *s, unsigned int programid,
                                    unsigned int pid, int version)
 {
@@ -2325,7 +2446,7 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
 
     int mp4_descr_count = 0;
     Mp4Descr mp4_descr[MAX_MP4_DESCR_COUNT] = { { 0 } };
-    int i;
+    int i, nb_kept = 0; /* PMT entries not skipped by the pid filter */
 
     av_log(ts->stream, AV_LOG_TRACE, "PMT: len %i\n", section_len);
     hex_dump_debug(ts->stream, section, section_len);
@@ -2357,6 +2478,9 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
         return;
     if (prg && prg->nb_pids && prg->pids[0] != ts->current_pid)
         return;
+    /* programs sharing a PMT PID with a selected one */
+    if (ts->pid_filter && !ts->nb_user_pids && !program_selected(ts, h->id))
+        return;
     if (!ts->skip_clear)
         clear_avprogram(ts, h->id);
     clear_program(prg);
@@ -2425,11 +2549,23 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
 
         stream_identifier = parse_stream_identifier_desc(p, p_end) + 1;
 
+        /* no filter and no stream for what was not asked for */
+        if (ts->pid_filter && !program_selected(ts, h->id) &&
+            !((ts->user_pid_mask[pid >> 5] >> (pid & 31)) & 1)) {
+            desc_list_len = get16(&p, p_end);
+            if (desc_list_len < 0)
+                goto out;
+            p += desc_list_len & 0xfff;
+            if (p > p_end)
+                goto out;
+            continue;
+        }
+
         /* now create stream */
         if (ts->pids[pid] && ts->pids[pid]->type == MPEGTS_PES) {       // watt:已存在pes filter
             pes = ts->pids[pid]->u.pes_filter.opaque;
             if (ts->merge_pmt_versions && !pes->st) {
-                st = find_matching_stream(ts, pid, h->id, stream_identifier, i, &old_program);
+                st = find_matching_stream(ts, pid, h->id, stream_identifier, nb_kept, &old_program);
                 if (st) {
                     pes->st = st;
                     pes->stream_type = stream_type;
@@ -2448,7 +2584,7 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
                 mpegts_close_filter(ts, ts->pids[pid]); // wrongly added sdt filter probably
             pes = add_pes_stream(ts, pid, pcr_pid);
             if (ts->merge_pmt_versions && pes && !pes->st) {
-                st = find_matching_stream(ts, pid, h->id, stream_identifier, i, &old_program);
+                st = find_matching_stream(ts, pid, h->id, stream_identifier, nb_kept, &old_program);
                 if (st) {
                     pes->st = st;
                     pes->stream_type = stream_type;
@@ -2467,7 +2603,7 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
                 st = ts->stream->streams[idx];
             }
             if (ts->merge_pmt_versions && !st) {
-                st = find_matching_stream(ts, pid, h->id, stream_identifier, i, &old_program);
+                st = find_matching_stream(ts, pid, h->id, stream_identifier, nb_kept, &old_program);
             }
             if (!st) {
                 st = avformat_new_stream(ts->stream, NULL);
@@ -2490,10 +2626,11 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
 
         add_pid_to_program(prg, pid);
         if (prg) {
-            prg->streams[i].idx = st->index;
-            prg->streams[i].stream_identifier = stream_identifier;
+            prg->streams[prg->nb_streams].idx = st->index;
+            prg->streams[prg->nb_streams].stream_identifier = stream_identifier;
             prg->nb_streams++;
         }
+        nb_kept++;
 
         av_program_add_stream_index(ts->stream, h->id, st->index);
 
@@ -2524,6 +2661,7 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
         mpegts_open_pcr_filter(ts, pcr_pid);
 
 out:
+    update_pid_filter(ts);
     for (i = 0; i < mp4_descr_count; i++)
         av_free(mp4_descr[i].dec_config_descr);
 }
@@ -2613,6 +2751,7 @@ static void pat_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
                 clear_avprogram(ts, ts->stream->programs[j]->id);
         }
     }
+    update_pid_filter(ts);
 }
 
 static void eit_cb(MpegTSFilter *filter, const uint8_t *section, int section_len)
@@ -2768,6 +2907,8 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet, int64_t pos)
     const uint8_t *p, *p_end;
     // 解析得到该ts包的pid
     pid = AV_RB16(packet + 1) & 0x1fff;     // watt:拿到该包的pid
+    if (!pid_selected(ts, pid))
+        return 0;
     is_start = packet[1] & 0x40;            // 判断是不是pes的开始
     tss = ts->pids[pid];                    // 根据pid寻找filter
     if (ts->auto_guess && !tss && is_start) {
@@ -2868,6 +3009,10 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet, int64_t pos)
         if (ts->stream->ctx_flags & AVFMTCTX_NOHEADER && ts->scan_all_pmts <= 0) {
             int i;
             for (i = 0; i < ts->nb_prg; i++) {
+                /* the PMTs of programs not selected are filtered out */
+                if (ts->pid_filter && !ts->nb_user_pids &&
+                    !program_selected(ts, ts->prg[i].id))
+                    continue;
                 if (!ts->prg[i].pmt_found)
                     break;
             }
@@ -2966,13 +3111,157 @@ static void finished_reading_packet(AVFormatContext *s, int raw_packet_size)
         avio_skip(pb, skip);
 }
 
+/* maximum number of packets taken from the AVIOContext buffer in one pass */
+#define MAX_PACKET_BATCH 64
+
+/**
+ * @return the number of consecutive packets in buf, spaced by stride, that
+ *         start with the sync byte
+ */
+static int count_synced_packets(const uint8_t *buf, int nb_packets, int stride)
+{
+    int i = 0;
+
+    for (; i + 4 <= nb_packets; i += 4, buf += 4 * stride) {
+        if ((buf[0]          ^ 0x47) | (buf[stride]     ^ 0x47) |
+            (buf[2 * stride] ^ 0x47) | (buf[3 * stride] ^ 0x47))
+            break;
+    }
+    for (; i < nb_packets && buf[0] == 0x47; i++, buf += stride)
+        ;
+    return i;
+}
+
+/**
+ * Append the payloads of a run of packets of one PES PID straight to the
+ * PES buffer. This is the copy mpegts_push_data() would do for each of
+ * them, done in one pass for the common case of continuation packets that
+ * carry nothing but payload. Stops at the first packet that needs the full
+ * path: a payload unit start, an adaptation field, TEI, a CC error, or a
+ * packet that would complete or split the PES packet.
+ *
+ * @return the number of packets consumed
+ */
+static int gather_pes_payloads(MpegTSContext *ts, MpegTSFilter *tss,
+                               const uint8_t *buf, int nb_packets, int stride,
+                               int64_t pos)
+{
+    const int payload_size = TS_PACKET_SIZE - 4;
+    PESContext *pes;
+    int max_packet_size = ts->max_packet_size;
+    int i;
+
+    if (!tss || tss->type != MPEGTS_PES || tss->discard || tss->last_cc < 0)
+        return 0;
+    pes = tss->u.pes_filter.opaque;
+    if (!ts->pkt || pes->state != MPEGTS_PAYLOAD || !pes->buffer)
+        return 0;
+    if (pes->PES_packet_length && pes->PES_packet_length + PES_START_SIZE > pes->pes_header_size)
+        max_packet_size = pes->PES_packet_length + PES_START_SIZE - pes->pes_header_size;
+
+    for (i = 0; i < nb_packets; i++, buf += stride) {
+        if ((buf[1] & 0xc0) || (buf[3] & 0x30) != 0x10 ||
+            (buf[3] & 0x0f) != ((tss->last_cc + 1) & 0x0f))
+            break;
+        if (pes->data_index + payload_size > max_packet_size ||
+            (pes->PES_packet_length && pes->data_index + payload_size == max_packet_size))
+            break;
+        memcpy(pes->buffer->data + pes->data_index, buf + 4, payload_size);
+        pes->data_index += payload_size;
+        tss->last_cc = buf[3] & 0x0f;
+    }
+    if (i) {
+        ts->current_pid = tss->pid;
+        ts->pos47_full  = pos + (int64_t)(i - 1) * stride;
+    }
+    return i;
+}
+
+/**
+ * Handle the complete packets already sitting in the AVIOContext buffer
+ * without a read_packet() round trip for each of them. Sync bytes and PIDs
+ * of the whole block are checked up front, and runs of packets of one PID
+ * that no filter wants are skipped as a unit. Stops after the packet that
+ * sets stop_parse, so the buffer position is the same as with per-packet
+ * reads.
+ *
+ * @param max_packets maximum number of packets to handle
+ * @param ret         set to the return value of the last handle_packet()
+ * @return the number of packets consumed, 0 if the caller has to fall back
+ *         to read_packet() (not enough buffered data or no sync byte)
+ */
+static int handle_packet_batch(MpegTSContext *ts, int64_t max_packets, int *ret)
+{
+    AVIOContext *pb = ts->stream->pb;
+    const int stride = ts->raw_packet_size;
+    const uint8_t *buf = pb->buf_ptr;
+    uint16_t pids[MAX_PACKET_BATCH];
+    int64_t pos;
+    int nb, i, j, consumed = 0;
+
+    *ret = 0;
+    if (stride < TS_PACKET_SIZE)
+        return 0;
+    nb = FFMIN3((pb->buf_end - pb->buf_ptr) / stride, max_packets, MAX_PACKET_BATCH);
+    if (nb < 2)
+        return 0;
+    nb = count_synced_packets(buf, nb, stride);
+    if (!nb)
+        return 0;
+    for (i = 0; i < nb; i++)
+        pids[i] = AV_RB16(buf + i * stride + 1) & 0x1fff;
+
+    pos = avio_tell(pb);
+    while (consumed < nb) {
+        const MpegTSFilter *tss = ts->pids[pids[consumed]];
+        int run = 1;
+
+        while (consumed + run < nb && pids[consumed + run] == pids[consumed])
+            run++;
+        if (!pid_selected(ts, pids[consumed])) {
+            consumed += run;
+            continue;
+        }
+        /* handle_packet() would return right away for all of them, unless
+         * a payload unit start may create a filter or change its discard */
+        if (!tss || tss->discard) {
+            int has_start = 0;
+            for (j = 0; j < run; j++)
+                has_start |= buf[(consumed + j) * stride + 1] & 0x40;
+            if (!has_start || (!tss && !ts->auto_guess)) {
+                consumed += run;
+                continue;
+            }
+        }
+        for (j = 0; j < run; j++) {
+            if (ts->gather_pes && run - j > 1) {
+                int n = gather_pes_payloads(ts, ts->pids[pids[consumed]],
+                                            buf + consumed * stride, run - j,
+                                            stride, pos + consumed * stride);
+                consumed += n;
+                j        += n;
+                if (j == run)
+                    break;
+            }
+            *ret = handle_packet(ts, buf + consumed * stride,
+                                 pos + consumed * stride + TS_PACKET_SIZE);
+            consumed++;
+            if (*ret != 0 || ts->stop_parse > 0)
+                goto end;
+        }
+    }
+end:
+    avio_skip(pb, (int64_t)consumed * stride);
+    return consumed;
+}
+
 static int handle_packets(MpegTSContext *ts, int64_t nb_packets)
 {
     AVFormatContext *s = ts->stream;
     uint8_t packet[TS_PACKET_SIZE + AV_INPUT_BUFFER_PADDING_SIZE];
     const uint8_t *data;        // watt:指向AVIOContext->buf_ptr
     int64_t packet_num;
-    int ret = 0;
+    int ret = 0, batch;
 
     if (avio_tell(s->pb) != ts->last_pos) {
         int i;
@@ -3007,6 +3296,13 @@ static int handle_packets(MpegTSContext *ts, int64_t nb_packets)
         if (ts->stop_parse > 0)
             break;
 
+        batch = handle_packet_batch(ts, nb_packets ? nb_packets - packet_num : MAX_PACKET_BATCH, &ret);
+        if (batch > 0) {
+            packet_num += batch - 1;
+            if (ret != 0)
+                break;
+            continue;
+        }
         ret = read_packet(s, packet, ts->raw_packet_size, &data);
         if (ret != 0)
             break;
@@ -3120,6 +3416,9 @@ static int mpegts_read_header(AVFormatContext *s)
 
     if (s->iformat == &ff_mpegts_demuxer) {
         /* normal demux */
+        int ret = init_pid_filter(s);
+        if (ret < 0)
+            return ret;
 
         /* first do a scan to get all the services */
         seek_back(s, pb, pos);
@@ -3282,6 +3581,7 @@ static void mpegts_free(MpegTSContext *ts)
     int i;
 
     clear_programs(ts);
+    av_freep(&ts->selected_prg);
 
     for (i = 0; i < FF_ARRAY_ELEMS(ts->pools); i++)
         av_buffer_pool_uninit(&ts->pools[i]);
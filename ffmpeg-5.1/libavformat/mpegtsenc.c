@@ -26,6 +26,7 @@
 #include "libavutil/intreadwrite.h"
 #include "libavutil/mathematics.h"
 #include "libavutil/opt.h"
+#include "libavutil/slicethread.h"
 
 #include "libavcodec/ac3_parser_internal.h"
 #include "libavcodec/avcodec.h"
@@ -74,6 +75,26 @@ enum {
     MPEGTS_SERVICE_TYPE_ADVANCED_CODEC_DIGITAL_HDTV  = 0x19,
     MPEGTS_SERVICE_TYPE_HEVC_DIGITAL_HDTV            = 0x1F,
 };
+
+/* a PES queued for packetization by the pes_threads workers */
+typedef struct MpegTSPESJob {
+    AVStream *st;
+    AVBufferRef *ref; /* holds the payload */
+    const uint8_t *payload;
+    int payload_size;
+    int64_t pts, dts;
+    int key;
+    int stream_id;
+    int next; /* next job of the same stream, -1 for none */
+
+    /* tables to send before the first TS packet, filled by the worker */
+    int force_pat, force_sdt, force_nit;
+
+    uint8_t *packets; /* nb_packets TS packets, sized for the worst case on submission */
+    unsigned int packets_size;
+    int nb_packets;
+} MpegTSPESJob;
+
 typedef struct MpegTSWrite {
     const AVClass *av_class;
     MpegTSSection pat; /* MPEG-2 PAT table */
@@ -125,6 +146,12 @@ typedef struct MpegTSWrite {
     uint8_t provider_name[256];
 
     int omit_video_pes_length;
+
+    int pes_threads;
+    AVSliceThread *slicethread;
+    MpegTSPESJob *pes_jobs;
+    int nb_pes_jobs;
+    int max_pes_jobs;
 } MpegTSWrite;
 
 /* a PES packet header is generated every DEFAULT_PES_HEADER_FREQ packets */
@@ -238,6 +265,10 @@ static int mpegts_write_section1(MpegTSSection *s, int tid, int id,
 #define PCR_RETRANS_TIME 20
 #define NIT_RETRANS_TIME 500
 
+/* PES jobs queued before they are packetized and written, at least per stream */
+#define PES_JOBS_PER_STREAM 2
+#define MIN_PES_JOBS 32
+
 typedef struct MpegTSWriteStream {
     int pid; /* stream associated pid */
     int cc;
@@ -260,6 +291,10 @@ typedef struct MpegTSWriteStream {
     int opus_pending_trim_start;
 
     DVBAC3Descriptor *dvb_ac3_desc;
+
+    /* queued PES jobs of this stream, -1 for none */
+    int first_pes_job;
+    int last_pes_job;
 } MpegTSWriteStream;
 
 static void mpegts_write_pat(AVFormatContext *s)
@@ -952,9 +987,39 @@ static int64_t get_pcr(const MpegTSWrite *ts)
            ts->first_pcr;
 }
 
+/* Return space for the next TS packet in the output buffer, after its m2ts
+ * header, or NULL if it has to be written with write_packet(). The packet
+ * is then built in place and committed with commit_packet(). */
+static uint8_t *reserve_packet(AVFormatContext *s)
+{
+    MpegTSWrite *ts = s->priv_data;
+    int header_size = ts->m2ts_mode ? 4 : 0;
+    uint8_t *p = ffio_reserve_write_buffer(s->pb, header_size + TS_PACKET_SIZE);
+
+    if (!p)
+        return NULL;
+    if (ts->m2ts_mode)
+        AV_WB32(p, get_pcr(ts) % 0x3fffffff);
+    return p + header_size;
+}
+
+static void commit_packet(AVFormatContext *s)
+{
+    MpegTSWrite *ts = s->priv_data;
+    ffio_commit_write_buffer(s->pb, (ts->m2ts_mode ? 4 : 0) + TS_PACKET_SIZE);
+    ts->total_size += TS_PACKET_SIZE;
+}
+
 static void write_packet(AVFormatContext *s, const uint8_t *packet)
 {
     MpegTSWrite *ts = s->priv_data;
+    uint8_t *p = reserve_packet(s);
+
+    if (p) {
+        memcpy(p, packet, TS_PACKET_SIZE);
+        commit_packet(s);
+        return;
+    }
     if (ts->m2ts_mode) {
         int64_t pcr = get_pcr(s->priv_data);
         uint32_t tp_extra_header = pcr % 0x3fffffff;
@@ -1077,6 +1142,8 @@ static void select_pcr_streams(AVFormatContext *s)
     }
 }
 
+static void packetize_pes_worker(void *priv, int jobnr, int threadnr, int nb_jobs, int nb_threads);
+
 static int mpegts_init(AVFormatContext *s)
 {
     MpegTSWrite *ts = s->priv_data;
@@ -1227,6 +1294,8 @@ static int mpegts_init(AVFormatContext *s)
         ts_st->payload_dts     = AV_NOPTS_VALUE;
         ts_st->cc              = 15;
         ts_st->discontinuity   = ts->flags & MPEGTS_FLAG_DISCONT;
+        ts_st->first_pes_job   = -1;
+        ts_st->last_pes_job    = -1;
         if (st->codecpar->codec_id == AV_CODEC_ID_AAC &&
             st->codecpar->extradata_size > 0) {
             AVStream *ast;
@@ -1276,6 +1345,26 @@ static int mpegts_init(AVFormatContext *s)
         return AVERROR(EINVAL);
     }
 
+    if (ts->pes_threads != 1) {
+        ret = avpriv_slicethread_create(&ts->slicethread, s, packetize_pes_worker,
+                                        NULL, ts->pes_threads);
+        if (ret == AVERROR(ENOSYS)) {
+            av_log(s, AV_LOG_WARNING, "Threading is not supported, packetizing PES serially\n");
+        } else if (ret < 0) {
+            return ret;
+        } else if (ret == 1) {
+            /* queuing only pays off when the jobs run in parallel */
+            avpriv_slicethread_free(&ts->slicethread);
+        } else {
+            ts->max_pes_jobs = FFMAX(MIN_PES_JOBS, PES_JOBS_PER_STREAM * s->nb_streams);
+            ts->pes_jobs     = av_calloc(ts->max_pes_jobs, sizeof(*ts->pes_jobs));
+            if (!ts->pes_jobs)
+                return AVERROR(ENOMEM);
+            av_log(s, AV_LOG_VERBOSE, "packetizing PES in %d threads, up to %d queued\n",
+                   ret, ts->max_pes_jobs);
+        }
+    }
+
     if (ts->mux_rate == 1)
         av_log(s, AV_LOG_VERBOSE, "muxrate VBR, ");
     else
@@ -1383,6 +1472,41 @@ static void mpegts_insert_pcr_only(AVFormatContext *s, AVStream *st)
     write_packet(s, buf);
 }
 
+/* In CBR mode, send PCR packets for all PCR streams if needed before the
+ * next TS packet of 'st'. *pcr is the current PCR and is updated when
+ * packets are inserted. Returns 1 if 'st' itself is due for a PCR, which is
+ * then put into that packet. */
+static int insert_pcr_packets(AVFormatContext *s, AVStream *st, int64_t *pcr)
+{
+    MpegTSWrite *ts = s->priv_data;
+    int write_pcr = 0;
+
+    if (*pcr >= ts->next_pcr) {
+        int64_t next_pcr = INT64_MAX;
+        for (int i = 0; i < s->nb_streams; i++) {
+            /* Make the current stream the last, because for that we
+             * can insert the pcr into the payload later */
+            int st2_index = i < st->index ? i : (i + 1 == s->nb_streams ? st->index : i + 1);
+            AVStream *st2 = s->streams[st2_index];
+            MpegTSWriteStream *ts_st2 = st2->priv_data;
+            if (ts_st2->pcr_period) {
+                if (*pcr - ts_st2->last_pcr >= ts_st2->pcr_period) {
+                    ts_st2->last_pcr = FFMAX(*pcr - ts_st2->pcr_period, ts_st2->last_pcr + ts_st2->pcr_period);
+                    if (st2 != st) {
+                        mpegts_insert_pcr_only(s, st2);
+                        *pcr = get_pcr(ts);
+                    } else {
+                        write_pcr = 1;
+                    }
+                }
+                next_pcr = FFMIN(next_pcr, ts_st2->last_pcr + ts_st2->pcr_period);
+            }
+        }
+        ts->next_pcr = next_pcr;
+    }
+    return write_pcr;
+}
+
 static void write_pts(uint8_t *q, int fourbits, int64_t pts)
 {
     int val;
@@ -1463,14 +1587,21 @@ static int get_pes_stream_id(AVFormatContext *s, AVStream *st, int stream_id, in
 /* Add a PES header to the front of the payload, and segment into an integer
  * number of TS packets. The final TS packet is padded using an oversized
  * adaptation header to exactly fill the last TS packet.
- * NOTE: 'payload' contains a complete PES payload. */
+ * NOTE: 'payload' contains a complete PES payload.
+ * If 'job' is set, the TS packets are stored in it instead of being written,
+ * together with the tables to retransmit before them; only the state of
+ * 'st' is touched then, so different streams can be packetized in parallel.
+ * In CBR mode this is used only for streams not carrying a PCR, whose TS
+ * packets do not depend on their position in the output. */
 static void mpegts_write_pes(AVFormatContext *s, AVStream *st,
                              const uint8_t *payload, int payload_size,
-                             int64_t pts, int64_t dts, int key, int stream_id)
+                             int64_t pts, int64_t dts, int key, int stream_id,
+                             MpegTSPESJob *job)
 {
     MpegTSWriteStream *ts_st = st->priv_data;
     MpegTSWrite *ts = s->priv_data;
-    uint8_t buf[TS_PACKET_SIZE];
+    uint8_t packet[TS_PACKET_SIZE];
+    uint8_t *buf = packet;
     uint8_t *q;
     int val, is_start, len, header_len, write_pcr, flags;
     int afc_len, stuffing_len;
@@ -1486,7 +1617,8 @@ static void mpegts_write_pes(AVFormatContext *s, AVStream *st,
         force_pat = 1;
     }
 
-    if (ts->flags & MPEGTS_FLAG_REEMIT_PAT_PMT) {
+    /* for jobs the flag is consumed on submission */
+    if (!job && ts->flags & MPEGTS_FLAG_REEMIT_PAT_PMT) {
         force_pat = 1;
         force_sdt = 1;
         force_nit = 1;
@@ -1496,43 +1628,30 @@ static void mpegts_write_pes(AVFormatContext *s, AVStream *st,
     is_start = 1;
     while (payload_size > 0) {
         int64_t pcr = AV_NOPTS_VALUE;
-        if (ts->mux_rate > 1)
-            pcr = get_pcr(ts);
-        else if (dts != AV_NOPTS_VALUE)
+        if (ts->mux_rate > 1) {
+            /* the position of a job in the output is not known yet */
+            if (!job)
+                pcr = get_pcr(ts);
+        } else if (dts != AV_NOPTS_VALUE)
             pcr = (dts - delay) * 300;
 
-        retransmit_si_info(s, force_pat, force_sdt, force_nit, pcr);
+        if (job) {
+            if (is_start) {
+                job->force_pat |= force_pat;
+                job->force_sdt |= force_sdt;
+                job->force_nit |= force_nit;
+            }
+        } else {
+            retransmit_si_info(s, force_pat, force_sdt, force_nit, pcr);
+        }
         force_pat = 0;
         force_sdt = 0;
         force_nit = 0;
 
         write_pcr = 0;
-        if (ts->mux_rate > 1) {
-            /* Send PCR packets for all PCR streams if needed */
+        if (ts->mux_rate > 1 && !job) {
             pcr = get_pcr(ts);
-            if (pcr >= ts->next_pcr) {
-                int64_t next_pcr = INT64_MAX;
-                for (int i = 0; i < s->nb_streams; i++) {
-                    /* Make the current stream the last, because for that we
-                     * can insert the pcr into the payload later */
-                    int st2_index = i < st->index ? i : (i + 1 == s->nb_streams ? st->index : i + 1);
-                    AVStream *st2 = s->streams[st2_index];
-                    MpegTSWriteStream *ts_st2 = st2->priv_data;
-                    if (ts_st2->pcr_period) {
-                        if (pcr - ts_st2->last_pcr >= ts_st2->pcr_period) {
-                            ts_st2->last_pcr = FFMAX(pcr - ts_st2->pcr_period, ts_st2->last_pcr + ts_st2->pcr_period);
-                            if (st2 != st) {
-                                mpegts_insert_pcr_only(s, st2);
-                                pcr = get_pcr(ts);
-                            } else {
-                                write_pcr = 1;
-                            }
-                        }
-                        next_pcr = FFMIN(next_pcr, ts_st2->last_pcr + ts_st2->pcr_period);
-                    }
-                }
-                ts->next_pcr = next_pcr;
-            }
+            write_pcr = insert_pcr_packets(s, st, &pcr);
             if (dts != AV_NOPTS_VALUE && (dts - pcr / 300) > delay) {
                 /* pcr insert gets priority over null packet insert */
                 if (write_pcr)
@@ -1549,7 +1668,11 @@ static void mpegts_write_pes(AVFormatContext *s, AVStream *st,
             }
         }
 
-        /* prepare packet header */
+        /* prepare packet header, built in place in the output if possible */
+        if (job)
+            buf = job->packets + job->nb_packets * TS_PACKET_SIZE;
+        else if (!(buf = reserve_packet(s)))
+            buf = packet;
         q    = buf;
         *q++ = 0x47;
         val  = ts_st->pid >> 8;
@@ -1744,11 +1867,182 @@ static void mpegts_write_pes(AVFormatContext *s, AVStream *st,
 
         payload      += len;
         payload_size -= len;
-        write_packet(s, buf);
+        if (job)
+            job->nb_packets++;
+        else if (buf != packet)
+            commit_packet(s);
+        else
+            write_packet(s, buf);
     }
     ts_st->prev_payload_key = key;
 }
 
+/* In CBR mode the PCR of a stream is placed by its position in the output,
+ * so the PES packets of PCR streams are packetized serially on output. */
+static int pes_job_is_serial(const MpegTSWrite *ts, const MpegTSWriteStream *ts_st)
+{
+    return ts->mux_rate > 1 && ts_st->pcr_period;
+}
+
+static void packetize_pes_worker(void *priv, int jobnr, int threadnr, int nb_jobs, int nb_threads)
+{
+    AVFormatContext *s = priv;
+    MpegTSWrite *ts = s->priv_data;
+    MpegTSWriteStream *ts_st = s->streams[jobnr]->priv_data;
+
+    if (pes_job_is_serial(ts, ts_st))
+        return;
+
+    /* the jobs of one stream are packetized in order, as they share its
+     * continuity counter and PCR state */
+    for (int i = ts_st->first_pes_job; i >= 0; i = ts->pes_jobs[i].next) {
+        MpegTSPESJob *job = &ts->pes_jobs[i];
+        mpegts_write_pes(s, job->st, job->payload, job->payload_size,
+                         job->pts, job->dts, job->key, job->stream_id, job);
+    }
+}
+
+/* Write the TS packets of a packetized job, with the tables and, in CBR
+ * mode, the PCR and null packets mpegts_write_pes() would put between them. */
+static void write_pes_job(AVFormatContext *s, MpegTSPESJob *job)
+{
+    MpegTSWrite *ts = s->priv_data;
+    int64_t delay = av_rescale(s->max_delay, 90000, AV_TIME_BASE);
+    int64_t dts = job->dts;
+    int force_pat = job->force_pat;
+    int force_sdt = job->force_sdt;
+    int force_nit = job->force_nit;
+    int async;
+
+    get_pes_stream_id(s, job->st, job->stream_id, &async);
+
+    for (int j = 0; j < job->nb_packets; j++) {
+        for (;;) {
+            int64_t pcr = AV_NOPTS_VALUE;
+            if (ts->mux_rate > 1)
+                pcr = get_pcr(ts);
+            else if (dts != AV_NOPTS_VALUE)
+                pcr = (dts - delay) * 300;
+            retransmit_si_info(s, force_pat, force_sdt, force_nit, pcr);
+            force_pat = force_sdt = force_nit = 0;
+
+            if (ts->mux_rate <= 1)
+                break;
+            pcr = get_pcr(ts);
+            insert_pcr_packets(s, job->st, &pcr);
+            if (dts == AV_NOPTS_VALUE || dts - pcr / 300 <= delay)
+                break;
+            mpegts_insert_null_packet(s);
+        }
+        write_packet(s, job->packets + j * TS_PACKET_SIZE);
+        /* only the first TS packet of an asynchronous PES has a timestamp */
+        if (async)
+            dts = AV_NOPTS_VALUE;
+    }
+}
+
+/* Packetize the queued PES jobs and write them out in submission order. */
+static void flush_pes_jobs(AVFormatContext *s)
+{
+    MpegTSWrite *ts = s->priv_data;
+
+    if (!ts->nb_pes_jobs)
+        return;
+
+    avpriv_slicethread_execute(ts->slicethread, s->nb_streams, 0);
+
+    for (int i = 0; i < ts->nb_pes_jobs; i++) {
+        MpegTSPESJob *job = &ts->pes_jobs[i];
+
+        if (pes_job_is_serial(ts, job->st->priv_data)) {
+            /* hand the tables requested on submission back */
+            if (job->force_pat)
+                ts->flags |= MPEGTS_FLAG_REEMIT_PAT_PMT;
+            mpegts_write_pes(s, job->st, job->payload, job->payload_size,
+                             job->pts, job->dts, job->key, job->stream_id, NULL);
+        } else {
+            write_pes_job(s, job);
+        }
+        av_buffer_unref(&job->ref);
+    }
+    ts->nb_pes_jobs = 0;
+
+    for (int i = 0; i < s->nb_streams; i++) {
+        MpegTSWriteStream *ts_st = s->streams[i]->priv_data;
+        ts_st->first_pes_job = ts_st->last_pes_job = -1;
+    }
+}
+
+/* Write a PES, or queue it when PES packetization is threaded. 'ref', if
+ * set, is a reference to a buffer containing the payload which is kept
+ * instead of copying it. If the job cannot be allocated, the queue is
+ * flushed and the PES written directly. */
+static void submit_pes(AVFormatContext *s, AVStream *st, AVBufferRef *ref,
+                      const uint8_t *payload, int payload_size,
+                      int64_t pts, int64_t dts, int key, int stream_id)
+{
+    MpegTSWrite *ts = s->priv_data;
+    MpegTSWriteStream *ts_st = st->priv_data;
+    MpegTSPESJob *job;
+    int max_packets;
+
+    if (!ts->slicethread)
+        goto write;
+
+    job = &ts->pes_jobs[ts->nb_pes_jobs];
+    if (ref && payload >= ref->data && payload + payload_size <= ref->data + ref->size) {
+        job->ref = av_buffer_ref(ref);
+        job->payload = payload;
+    } else {
+        job->ref = av_buffer_alloc(payload_size);
+        if (job->ref)
+            memcpy(job->ref->data, payload, payload_size);
+        job->payload = job->ref ? job->ref->data : NULL;
+    }
+
+    /* the first TS packet has room for at least 131 payload bytes after the
+     * adaptation field and the largest PES header, each following one for 184 */
+    max_packets = (payload_size + 1) / 184 + 2;
+    if (!pes_job_is_serial(ts, ts_st))
+        av_fast_malloc(&job->packets, &job->packets_size, max_packets * TS_PACKET_SIZE);
+    if (!job->ref || (!pes_job_is_serial(ts, ts_st) && !job->packets)) {
+        av_buffer_unref(&job->ref);
+        flush_pes_jobs(s);
+        goto write;
+    }
+
+    job->st           = st;
+    job->payload_size = payload_size;
+    job->pts          = pts;
+    job->dts          = dts;
+    job->key          = key;
+    job->stream_id    = stream_id;
+    job->next         = -1;
+    job->force_pat    = 0;
+    job->force_sdt    = 0;
+    job->force_nit    = 0;
+    job->nb_packets   = 0;
+    if (ts->flags & MPEGTS_FLAG_REEMIT_PAT_PMT) {
+        job->force_pat = 1;
+        job->force_sdt = 1;
+        job->force_nit = 1;
+        ts->flags &= ~MPEGTS_FLAG_REEMIT_PAT_PMT;
+    }
+
+    if (ts_st->last_pes_job >= 0)
+        ts->pes_jobs[ts_st->last_pes_job].next = ts->nb_pes_jobs;
+    else
+        ts_st->first_pes_job = ts->nb_pes_jobs;
+    ts_st->last_pes_job = ts->nb_pes_jobs++;
+
+    if (ts->nb_pes_jobs == ts->max_pes_jobs)
+        flush_pes_jobs(s);
+    return;
+
+write:
+    mpegts_write_pes(s, st, payload, payload_size, pts, dts, key, stream_id, NULL);
+}
+
 int ff_check_h264_startcode(AVFormatContext *s, const AVStream *st, const AVPacket *pkt)
 {
     if (pkt->size < 5 || AV_RB32(pkt->data) != 0x0000001 && AV_RB24(pkt->data) != 0x000001) {
@@ -2102,8 +2396,8 @@ static int mpegts_write_packet_internal(AVFormatContext *s, AVPacket *pkt)
         }
         av_free(hdr);
     } else if (st->codecpar->codec_id == AV_CODEC_ID_PCM_BLURAY && ts->m2ts_mode) {
-        mpegts_write_pes(s, st, buf, size, pts, dts,
-                         pkt->flags & AV_PKT_FLAG_KEY, stream_id);
+        submit_pes(s, st, pkt->buf, buf, size, pts, dts,
+                   pkt->flags & AV_PKT_FLAG_KEY, stream_id);
         return 0;
     }
 
@@ -2111,19 +2405,27 @@ static int mpegts_write_packet_internal(AVFormatContext *s, AVPacket *pkt)
         (dts != AV_NOPTS_VALUE && ts_st->payload_dts != AV_NOPTS_VALUE &&
          dts - ts_st->payload_dts >= max_audio_delay) ||
         ts_st->opus_queued_samples + opus_samples >= 5760 /* 120ms */)) {
-        mpegts_write_pes(s, st, ts_st->payload, ts_st->payload_size,
-                         ts_st->payload_pts, ts_st->payload_dts,
-                         ts_st->payload_flags & AV_PKT_FLAG_KEY, stream_id);
+        submit_pes(s, st, NULL, ts_st->payload, ts_st->payload_size,
+                   ts_st->payload_pts, ts_st->payload_dts,
+                   ts_st->payload_flags & AV_PKT_FLAG_KEY, stream_id);
         ts_st->payload_size = 0;
         ts_st->opus_queued_samples = 0;
     }
 
     if (st->codecpar->codec_type != AVMEDIA_TYPE_AUDIO || size > ts->pes_payload_size) {
+        AVBufferRef *ref = pkt->buf;
+
         av_assert0(!ts_st->payload_size);
+        /* let a queued job keep the rewritten packet instead of a copy */
+        if (data && ts->slicethread &&
+            (ref = av_buffer_create(data, size, NULL, NULL, 0)))
+            data = NULL;
         // for video and subtitle, write a single pes packet
-        mpegts_write_pes(s, st, buf, size, pts, dts,
-                         pkt->flags & AV_PKT_FLAG_KEY, stream_id);
+        submit_pes(s, st, ref, buf, size, pts, dts,
+                   pkt->flags & AV_PKT_FLAG_KEY, stream_id);
         ts_st->opus_queued_samples = 0;
+        if (ref != pkt->buf)
+            av_buffer_unref(&ref);
         av_free(data);
         return 0;
     }
@@ -2153,13 +2455,14 @@ static void mpegts_write_flush(AVFormatContext *s)
         AVStream *st = s->streams[i];
         MpegTSWriteStream *ts_st = st->priv_data;
         if (ts_st->payload_size > 0) {
-            mpegts_write_pes(s, st, ts_st->payload, ts_st->payload_size,
-                             ts_st->payload_pts, ts_st->payload_dts,
-                             ts_st->payload_flags & AV_PKT_FLAG_KEY, -1);
+            submit_pes(s, st, NULL, ts_st->payload, ts_st->payload_size,
+                       ts_st->payload_pts, ts_st->payload_dts,
+                       ts_st->payload_flags & AV_PKT_FLAG_KEY, -1);
             ts_st->payload_size = 0;
             ts_st->opus_queued_samples = 0;
         }
     }
+    flush_pes_jobs(s);
 
     if (ts->m2ts_mode) {
         int packets = (avio_tell(s->pb) / (TS_PACKET_SIZE + 4)) % 32;
@@ -2210,6 +2513,15 @@ static void mpegts_deinit(AVFormatContext *s)
         av_freep(&service);
     }
     av_freep(&ts->services);
+
+    avpriv_slicethread_free(&ts->slicethread);
+    if (ts->pes_jobs) {
+        for (i = 0; i < ts->max_pes_jobs; i++) {
+            av_buffer_unref(&ts->pes_jobs[i].ref);
+            av_freep(&ts->pes_jobs[i].packets);
+        }
+        av_freep(&ts->pes_jobs);
+    }
 }
 
 static int mpegts_check_bitstream(AVFormatContext *s, AVStream *st,
@@ -2294,6 +2606,8 @@ static const AVOption options[] = {
       OFFSET(sdt_period_us), AV_OPT_TYPE_DURATION, { .i64 = SDT_RETRANS_TIME * 1000LL }, 0, INT64_MAX, ENC },
     { "nit_period", "NIT retransmission time limit in seconds",
       OFFSET(nit_period_us), AV_OPT_TYPE_DURATION, { .i64 = NIT_RETRANS_TIME * 1000LL }, 0, INT64_MAX, ENC },
+    { "pes_threads", "Number of threads packetizing PES packets of different streams, 0 for automatic",
+      OFFSET(pes_threads), AV_OPT_TYPE_INT, { .i64 = 1 }, 0, INT_MAX, ENC },
     { NULL },
 };
 
@@ -15,11 +15,12 @@ FATE_LAVF_CONTAINER-$(call ENCDEC2, MPEG4,      MP2,       NUT)                +
 FATE_LAVF_CONTAINER-$(call ENCMUX,  RV10 AC3_FIXED,        RM)                 += rm
 FATE_LAVF_CONTAINER-$(call ENCDEC2, MJPEG,      PCM_S16LE, SMJPEG)             += smjpeg
 FATE_LAVF_CONTAINER-$(call ENCDEC,  FLV,                   SWF)                += swf
-FATE_LAVF_CONTAINER-$(call ENCDEC2, MPEG2VIDEO, MP2,       MPEGTS)             += ts
+FATE_LAVF_CONTAINER-$(call ENCDEC2, MPEG2VIDEO, MP2,       MPEGTS)             += ts ts_pes_threads ts_muxrate ts_muxrate_pes_threads
 FATE_LAVF_CONTAINER-$(call ENCDEC,  MP2,                   WTV)                += wtv
 
 FATE_LAVF_CONTAINER_RESAMPLE := asf avi dv_pal dv_ntsc gxf_pal gxf_ntsc  \
-                                mkv mkv_attachment mpg mxf nut rm ts wtv
+                                mkv mkv_attachment mpg mxf nut rm ts ts_pes_threads \
+                                ts_muxrate ts_muxrate_pes_threads wtv
 FATE_LAVF_CONTAINER-$(!CONFIG_ARESAMPLE_FILTER) := $(filter-out $(FATE_LAVF_CONTAINER_RESAMPLE),$(FATE_LAVF_CONTAINER-yes))
 
 FATE_LAVF_CONTAINER_SCALE := dv dv_pal dv_ntsc flm gxf gxf_pal gxf_ntsc \
@@ -61,6 +62,10 @@ fate-lavf-smjpeg:  CMD = lavf_container "" "-f smjpeg"
 # The RealMedia muxer is broken.
 fate-lavf-rm:  CMD = lavf_container "" "-c:a ac3_fixed" disable_crc
 fate-lavf-ts:  CMD = lavf_container "" "-mpegts_transport_stream_id 42 -ar 44100 -threads 1"
+# The output with pes_threads must be the same as the serial one.
+fate-lavf-ts_pes_threads: CMD = lavf_container "" "-mpegts_transport_stream_id 42 -ar 44100 -threads 1 -pes_threads 4 -f mpegts"
+fate-lavf-ts_muxrate: CMD = lavf_container "" "-mpegts_transport_stream_id 42 -ar 44100 -threads 1 -muxrate 5000000 -f mpegts"
+fate-lavf-ts_muxrate_pes_threads: CMD = lavf_container "" "-mpegts_transport_stream_id 42 -ar 44100 -threads 1 -muxrate 5000000 -pes_threads 4 -f mpegts"
 fate-lavf-wtv: CMD = lavf_container "" "-c:a mp2 -threads 1"
 
 FATE_AVCONV += $(FATE_LAVF_CONTAINER)
@@ -22,4 +22,27 @@ fate-mpegts-probe-pmt-merge: CMD = run $(PROBE_CODEC_NAME_COMMAND) -merge_pmt_ve
 
 FATE_SAMPLES_FFPROBE += $(FATE_MPEGTS_PROBE-yes)
 
-fate-mpegts: $(FATE_MPEGTS_PROBE-yes)
+#
+# Test demuxing a subset of a multi program TS
+#
+tests/data/mpegts-3prog.ts: TAG = GEN
+tests/data/mpegts-3prog.ts: ffmpeg$(PROGSSUF)$(EXESUF) | tests/data
+	$(M)$(TARGET_EXEC) $(TARGET_PATH)/$< -nostdin \
+        -f lavfi -i "sine=440:d=1" -f lavfi -i "sine=880:d=1" -f lavfi -i "sine=1320:d=1" \
+        -map 0 -map 1 -map 2 -c:a mp2 -fflags +bitexact -flags +bitexact \
+        -program program_num=1:st=0 -program program_num=2:st=1 -program program_num=3:st=2 \
+        -f mpegts -y $(TARGET_PATH)/$(@) 2>/dev/null
+
+PROBE_SELECT_COMMAND = \
+    ffprobe$(PROGSSUF)$(EXESUF) -show_entries program=program_id:stream=id \
+    -print_format compact -bitexact -v 0 -scan_all_pmts 0
+
+FATE_MPEGTS_SELECT-$(call ALLYES, MPEGTS_DEMUXER MPEGTS_MUXER MP2_ENCODER LAVFI_INDEV SINE_FILTER ARESAMPLE_FILTER FILE_PROTOCOL) += \
+    fate-mpegts-select-programs fate-mpegts-select-pids
+fate-mpegts-select-programs fate-mpegts-select-pids: tests/data/mpegts-3prog.ts
+fate-mpegts-select-programs: CMD = run $(PROBE_SELECT_COMMAND) -select_programs 2 -i $(TARGET_PATH)/tests/data/mpegts-3prog.ts
+fate-mpegts-select-pids: CMD = run $(PROBE_SELECT_COMMAND) -select_pids 0x100+0x102 -i $(TARGET_PATH)/tests/data/mpegts-3prog.ts
+
+FATE_FFPROBE += $(FATE_MPEGTS_SELECT-yes)
+
+fate-mpegts: $(FATE_MPEGTS_PROBE-yes) $(FATE_MPEGTS_SELECT-yes)
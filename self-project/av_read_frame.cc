@@ -12,6 +12,7 @@ extern "C"
 #ifdef __cplusplus
 }
 #endif
+#include "stream_cache.h"
 
 static void logging(const char *fmt, ...)
 {
@@ -30,22 +31,21 @@ char av_error[AV_ERROR_MAX_STRING_SIZE] = { 0 };
 int main(int argc, char** argv)
 {
     if(argc < 2){
-        logging("please specify a file name:\n ./av_read_frame [filename]");
+        logging("please specify a file name:\n ./av_read_frame [filename] [stream_cache]");
         return -1;
     }
     const char *filename = argv[1];
+    std::string stream_cache = argc > 2 ? argv[2] : "";
     AVFormatContext *in_fmtctx = avformat_alloc_context();
     // AVDictionary *opts = nullptr;
     // av_dict_set(&opts, "merge_pmt_versions", "1", 0);
-    if(0 != avformat_open_input(&in_fmtctx, filename, nullptr, nullptr)){
-        logging("avformat_open_input failed!");
-        return -1;
-    }
-    logging("Format %s, duration %lld us", in_fmtctx->iformat->long_name, in_fmtctx->duration);
-    if(0 != avformat_find_stream_info(in_fmtctx, NULL)){
-        logging("avformat_find_stream_info failed!");
+    bool fast = false;
+    if(0 != OpenInputWithCache(&in_fmtctx, filename, stream_cache, &fast)){
+        logging("open input failed!");
         return -1;
     }
+    logging("Format %s, duration %lld us, %s", in_fmtctx->iformat->long_name, in_fmtctx->duration,
+            fast ? "stream info from cache" : "probed");
     av_dump_format(in_fmtctx, 0, filename, 0);
 
     AVFrame *frame = av_frame_alloc();
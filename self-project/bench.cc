@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include "libavdevice/avdevice.h"
+#ifdef __cplusplus
+}
+#endif
+#include "codec_layer.h"
+#include "pipeline/codec_plugin.h"
+#include "pipeline/pipeline_manager.h"
+
+/*
+    lavfi testsrc/sine --> 编码生成测试文件 --> pipeline(remux/transcode) --> transcode --> remuxer
+    结果以JSON输出，用来对比队列、调度器和编码参数改动前后的性能
+*/
+
+static constexpr char usage_string[] = "usage:\n"
+                                       "    ./bench [-d seconds] [-s WxH] [-r fps] [-v encoder] [-n copies] [-t threads] [-b bindir] [-w workdir] [-o result.json]\n"
+                                       "-d duration of the synthetic input, default 10\n"
+                                       "-s video size, default 1280x720\n"
+                                       "-r video frame rate, default 25\n"
+                                       "-v video encoder used for the input and for transcoding, default mpeg4\n"
+                                       "-n pipelines running at the same time, default 2\n"
+                                       "-t worker threads of the pipeline scheduler, default number of cores\n"
+                                       "-b directory of the transcode and remuxer programs, default .\n"
+                                       "-w directory for temporary files, default /tmp\n"
+                                       "-o write json to this file instead of stdout\n";
+
+struct BenchOptions
+{
+    int seconds{10};
+    std::string size{"1280x720"};
+    int fps{25};
+    std::string encoder{"mpeg4"};
+    int copies{2};
+    int threads{static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))};
+    std::string bindir{"."};
+    std::string workdir{"/tmp"};
+    std::string output;
+};
+
+struct InputInfo
+{
+    std::string path;
+    uint64_t video_frames{0};
+    uint64_t audio_frames{0};
+    uint64_t packets{0};
+    double seconds{0};
+};
+
+static double Seconds(int64_t ns)
+{
+    return ns / 1e9;
+}
+
+// 最简单的JSON拼接，只支持这里用到的对象、数值和字符串
+class JsonWriter
+{
+public:
+    JsonWriter &Begin(const std::string &key = "")
+    {
+        Key(key);
+        out_ << "{";
+        first_ = true;
+        return *this;
+    }
+
+    JsonWriter &End()
+    {
+        out_ << "}";
+        first_ = false;
+        return *this;
+    }
+
+    JsonWriter &Field(const std::string &key, double value)
+    {
+        Key(key);
+        out_ << value;
+        return *this;
+    }
+
+    JsonWriter &Field(const std::string &key, const std::string &value)
+    {
+        Key(key);
+        out_ << "\"" << value << "\"";
+        return *this;
+    }
+
+    JsonWriter &Field(const std::string &key, bool value)
+    {
+        Key(key);
+        out_ << (value ? "true" : "false");
+        return *this;
+    }
+
+    std::string str() const
+    {
+        return out_.str();
+    }
+
+private:
+    void Key(const std::string &key)
+    {
+        if (!first_)
+            out_ << ",";
+        first_ = false;
+        if (!key.empty())
+            out_ << "\"" << key << "\":";
+    }
+
+    std::ostringstream out_;
+    bool first_{true};
+};
+
+// 返回微秒，p取0~1
+static double Percentile(std::vector<int64_t> &samples, double p)
+{
+    if (samples.empty())
+        return 0;
+    size_t index = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index] / 1000.0;
+}
+
+static void WriteLatency(JsonWriter &json, const std::string &key, std::vector<int64_t> samples)
+{
+    json.Begin(key)
+        .Field("count", static_cast<double>(samples.size()))
+        .Field("p50_us", Percentile(samples, 0.5))
+        .Field("p90_us", Percentile(samples, 0.9))
+        .Field("p99_us", Percentile(samples, 0.99))
+        .Field("max_us", Percentile(samples, 1.0))
+        .End();
+}
+
+static long PeakRssKb(int who)
+{
+    struct rusage usage;
+    if (getrusage(who, &usage) != 0)
+        return 0;
+    return usage.ru_maxrss;
+}
+
+// 用lavfi生成一段测试图和正弦音，视频用待测编码器，音频用mp2(接受lavfi输出的s16交错格式)
+static bool GenerateInput(const BenchOptions &opt, InputInfo &info)
+{
+    std::string graph = "testsrc=size=" + opt.size + ":rate=" + std::to_string(opt.fps) +
+                        ":duration=" + std::to_string(opt.seconds) + ",format=yuv420p[out0];" +
+                        "sine=frequency=1000:sample_rate=48000:samples_per_frame=1152:duration=" +
+                        std::to_string(opt.seconds) + ",aformat=sample_fmts=s16:channel_layouts=stereo[out1]";
+    info.path = opt.workdir + "/bench_input.mp4";
+
+    const int64_t begin = NowNs();
+    AVFormatContext *in = nullptr;
+    AVFormatContext *out = nullptr;
+    if (avformat_open_input(&in, graph.c_str(), av_find_input_format("lavfi"), nullptr) < 0)
+    {
+        logging("failed to open lavfi graph %s", graph.c_str());
+        return false;
+    }
+    avformat_alloc_output_context2(&out, nullptr, nullptr, info.path.c_str());
+    if (!out || avio_open(&out->pb, info.path.c_str(), AVIO_FLAG_WRITE) < 0)
+    {
+        logging("failed to create %s", info.path.c_str());
+        avformat_close_input(&in);
+        avformat_free_context(out);
+        return false;
+    }
+
+    bool ok = true;
+    std::vector<CodecLayer> decoders(in->nb_streams);
+    std::vector<CodecLayer> encoders(in->nb_streams);
+    for (uint32_t i = 0; i < in->nb_streams && ok; i++)
+    {
+        AVStream *st = in->streams[i];
+        CodecLayer &dec = decoders[i];
+        CodecLayer &enc = encoders[i];
+        ok = dec.FillDecoder(st) && dec.OpenCodec();
+        enc.stream = avformat_new_stream(out, nullptr);
+        enc.index = enc.stream->index;
+        if (ok && st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            ok = enc.FillVideoEncoder(dec.codec_ctx, opt.encoder, AVRational{opt.fps, 1});
+        else if (ok)
+        {
+            ok = enc.FillAudioEncoder(dec.codec_ctx, "mp2");
+            if (ok)
+                enc.codec_ctx->bit_rate = 192000;
+        }
+        if (ok && (out->oformat->flags & AVFMT_GLOBALHEADER))
+            enc.codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        ok = ok && enc.OpenCodec() && avcodec_parameters_from_context(enc.stream->codecpar, enc.codec_ctx) >= 0;
+    }
+    ok = ok && avformat_write_header(out, nullptr) >= 0;
+
+    AVPacket *pkt = av_packet_alloc();
+    AVPacket *enc_pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    auto encode = [&](uint32_t i, AVFrame *f) {
+        CodecLayer &enc = encoders[i];
+        if (f)
+        {
+            f->pts = av_rescale_q(f->best_effort_timestamp, in->streams[i]->time_base, enc.codec_ctx->time_base);
+            f->pict_type = AV_PICTURE_TYPE_NONE;
+        }
+        return enc.Encode(f, enc_pkt, [&](AVPacket *p) {
+            p->stream_index = enc.stream->index;
+            av_packet_rescale_ts(p, enc.codec_ctx->time_base, enc.stream->time_base);
+            info.packets++;
+            return av_interleaved_write_frame(out, p) >= 0;
+        });
+    };
+    while (ok && av_read_frame(in, pkt) >= 0)
+    {
+        uint32_t i = pkt->stream_index;
+        const bool video = in->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+        ok = decoders[i].Decode(pkt, frame, [&](AVFrame *f) {
+            (video ? info.video_frames : info.audio_frames)++;
+            return encode(i, f);
+        });
+        av_packet_unref(pkt);
+    }
+    for (uint32_t i = 0; i < in->nb_streams && ok; i++)
+    {
+        decoders[i].Decode(nullptr, frame, [&](AVFrame *f) { return encode(i, f); });
+        encode(i, nullptr);
+    }
+    if (ok)
+        av_write_trailer(out);
+
+    av_packet_free(&pkt);
+    av_packet_free(&enc_pkt);
+    av_frame_free(&frame);
+    for (auto &&layer : decoders)
+        avcodec_free_context(&layer.codec_ctx);
+    for (auto &&layer : encoders)
+        avcodec_free_context(&layer.codec_ctx);
+    avformat_close_input(&in);
+    avio_closep(&out->pb);
+    avformat_free_context(out);
+    info.seconds = Seconds(NowNs() - begin);
+    return ok;
+}
+
+struct StageSamples
+{
+    StageStats stats;
+    uint64_t depth_sum{0};
+    uint64_t depth_samples{0};
+    size_t depth_max{0};
+};
+
+// 在调度器上同时跑copies条pipeline，transcode为false时只做解封装/封装
+static void BenchPipeline(const BenchOptions &opt, const InputInfo &input, bool transcode, JsonWriter &json)
+{
+    PipelineManager manager(ThreadPoll::Instance());
+    std::vector<PipelinePtr> pipelines;
+    std::vector<std::pair<std::string, Plugin *>> stages;
+    for (int n = 0; n < opt.copies; ++n)
+    {
+        PipelinePtr pipeline = manager.Create(std::to_string(n));
+        pipelines.push_back(pipeline);
+        DemuxPlugin *demux = pipeline->Emplace<DemuxPlugin>();
+        MuxPlugin *mux = pipeline->Emplace<MuxPlugin>();
+        WritePlugin *writer = pipeline->Emplace<WritePlugin>();
+        bool ok = mux->Init(writer, "mpegts") && writer->Init(nullptr, "");
+        if (transcode)
+        {
+            DecodePlugin *decode = pipeline->Emplace<DecodePlugin>();
+            EncodePlugin *encode = pipeline->Emplace<EncodePlugin>();
+            ok = ok && encode->Init(mux, opt.encoder) && decode->Init(encode) && demux->Init(decode, input.path);
+            stages.emplace_back("decode", decode);
+            stages.emplace_back("encode", encode);
+        }
+        else
+        {
+            ok = ok && demux->Init(mux, input.path);
+        }
+        stages.emplace_back("demux", demux);
+        stages.emplace_back("mux", mux);
+        stages.emplace_back("write", writer);
+        if (!ok)
+        {
+            logging("failed to build pipeline");
+            return;
+        }
+    }
+
+    std::map<std::string, StageSamples> samples;
+    for (auto &&stage : stages)
+    {
+        stage.second->EnableStats(true);
+        samples[stage.first];
+    }
+
+    // 采样线程定期记录各插件的队列深度
+    std::atomic<bool> sampling{true};
+    std::thread sampler([&]() {
+        while (sampling.load())
+        {
+            for (auto &&stage : stages)
+            {
+                StageSamples &s = samples[stage.first];
+                size_t depth = stage.second->QueueSize();
+                s.depth_sum += depth;
+                s.depth_samples++;
+                s.depth_max = std::max(s.depth_max, depth);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    const int64_t begin = NowNs();
+    for (auto &&pipeline : pipelines)
+        pipeline->Start();
+    bool finished = manager.WaitAllFinished(std::chrono::minutes(30));
+    const double wall = Seconds(NowNs() - begin);
+    sampling.store(false);
+    sampler.join();
+    // 先从调度器摘下，插件不再运行后才能读统计，pipelines持有插件直到函数返回
+    manager.DestroyAll();
+
+    for (auto &&stage : stages)
+    {
+        StageStats &merged = samples[stage.first].stats;
+        const StageStats &stats = stage.second->Stats();
+        merged.wait_ns.insert(merged.wait_ns.end(), stats.wait_ns.begin(), stats.wait_ns.end());
+        merged.run_ns.insert(merged.run_ns.end(), stats.run_ns.begin(), stats.run_ns.end());
+        merged.packets += stats.packets;
+        merged.frames += stats.frames;
+        merged.bytes += stats.bytes;
+    }
+    // mux收到的包数即整条链路处理的包数，encode收到的帧数即处理的帧数
+    const StageStats &mux = samples["mux"].stats;
+    const uint64_t frames = transcode ? samples["encode"].stats.frames : input.video_frames * opt.copies;
+
+    json.Begin(transcode ? "pipeline_transcode" : "pipeline_remux")
+        .Field("finished", finished)
+        .Field("pipelines", static_cast<double>(opt.copies))
+        .Field("wall_seconds", wall)
+        .Field("packets_per_second", mux.packets / wall)
+        .Field("frames_per_second", frames / wall)
+        .Field("megabytes_per_second", mux.bytes / wall / 1e6);
+    json.Begin("stages");
+    for (auto &&it : samples)
+    {
+        StageSamples &s = it.second;
+        json.Begin(it.first)
+            .Field("packets", static_cast<double>(s.stats.packets))
+            .Field("frames", static_cast<double>(s.stats.frames));
+        WriteLatency(json, "queue_wait", s.stats.wait_ns);
+        WriteLatency(json, "run", s.stats.run_ns);
+        json.Begin("queue_depth")
+            .Field("mean", s.depth_samples ? static_cast<double>(s.depth_sum) / s.depth_samples : 0.0)
+            .Field("max", static_cast<double>(s.depth_max))
+            .End();
+        json.End();
+    }
+    json.End();
+    json.End();
+}
+
+// 以子进程运行，等待结束并取得子进程的峰值内存
+static void BenchProcess(const std::string &key, const std::vector<std::string> &args,
+                         const InputInfo &input, JsonWriter &json)
+{
+    json.Begin(key);
+    if (access(args[0].c_str(), X_OK) != 0)
+    {
+        json.Field("skipped", std::string("not found: ") + args[0]).End();
+        return;
+    }
+    const int64_t begin = NowNs();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        std::vector<char *> argv;
+        for (auto &&arg : args)
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage = {};
+    if (pid < 0 || wait4(pid, &status, 0, &usage) < 0)
+    {
+        json.Field("skipped", std::string("failed to start")).End();
+        return;
+    }
+    const double wall = Seconds(NowNs() - begin);
+    json.Field("exit_code", static_cast<double>(WIFEXITED(status) ? WEXITSTATUS(status) : -1))
+        .Field("wall_seconds", wall)
+        .Field("packets_per_second", input.packets / wall)
+        .Field("frames_per_second", input.video_frames / wall)
+        .Field("cpu_seconds", usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                                  (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6)
+        .Field("peak_rss_kb", static_cast<double>(usage.ru_maxrss))
+        .End();
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions opt;
+    int ret;
+    while ((ret = getopt(argc, argv, "d:s:r:v:n:t:b:w:o:h")) != -1)
+    {
+        switch (ret)
+        {
+        case 'd':
+            opt.seconds = atoi(optarg);
+            break;
+        case 's':
+            opt.size = optarg;
+            break;
+        case 'r':
+            opt.fps = atoi(optarg);
+            break;
+        case 'v':
+            opt.encoder = optarg;
+            break;
+        case 'n':
+            opt.copies = std::max(1, atoi(optarg));
+            break;
+        case 't':
+            opt.threads = std::max(1, atoi(optarg));
+            break;
+        case 'b':
+            opt.bindir = optarg;
+            break;
+        case 'w':
+            opt.workdir = optarg;
+            break;
+        case 'o':
+            opt.output = optarg;
+            break;
+        case 'h':
+        default:
+            printf(usage_string);
+            return 0;
+        }
+    }
+    av_log_set_level(AV_LOG_ERROR);
+    avdevice_register_all();
+
+    InputInfo input;
+    if (!GenerateInput(opt, input))
+    {
+        logging("failed to generate input");
+        return -1;
+    }
+
+    JsonWriter json;
+    json.Begin();
+    json.Begin("config")
+        .Field("seconds", static_cast<double>(opt.seconds))
+        .Field("size", opt.size)
+        .Field("fps", static_cast<double>(opt.fps))
+        .Field("encoder", opt.encoder)
+        .Field("threads", static_cast<double>(opt.threads))
+        .End();
+    json.Begin("input")
+        .Field("video_frames", static_cast<double>(input.video_frames))
+        .Field("audio_frames", static_cast<double>(input.audio_frames))
+        .Field("packets", static_cast<double>(input.packets))
+        .Field("generate_seconds", input.seconds)
+        .End();
+
+    ThreadPoll::Instance().Start(opt.threads);
+    BenchPipeline(opt, input, false, json);
+    BenchPipeline(opt, input, true, json);
+    ThreadPoll::Instance().Stop();
+    json.Field("peak_rss_kb", static_cast<double>(PeakRssKb(RUSAGE_SELF)));
+
+    BenchProcess("transcode",
+                 {opt.bindir + "/transcode", "-i", input.path, "-o", opt.workdir + "/bench_transcode.mp4",
+                  "--vcodec", opt.encoder},
+                 input, json);
+    BenchProcess("remuxer", {opt.bindir + "/remuxer", "-i", input.path, "-o", opt.workdir + "/bench_remux.ts"},
+                 input, json);
+    json.End();
+
+    if (opt.output.empty())
+    {
+        std::cout << json.str() << std::endl;
+    }
+    else
+    {
+        std::ofstream file(opt.output);
+        file << json.str() << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,255 @@
+#pragma once
+#include <stdio.h>
+#include <string>
+#include <functional>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#include "libavutil/frame.h"
+#include "libavutil/rational.h"
+#include <libavutil/opt.h>
+#ifdef __cplusplus
+}
+#endif
+
+#ifndef logging
+#define logging(fmt, ...) fprintf(stderr, "[%s %d]" fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__);
+#endif
+
+inline std::string AvErrorString(int errnum)
+{
+    char buf[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+    av_make_error_string(buf, AV_ERROR_MAX_STRING_SIZE, errnum);
+    return buf;
+}
+#define err2str(errnum) AvErrorString(errnum).c_str()
+
+// 解码出一帧/编码出一个包时回调，返回false表示下游出错，停止继续取
+using FrameSink = std::function<bool(AVFrame *)>;
+using PacketSink = std::function<bool(AVPacket *)>;
+
+// 把codec部分从avformat中提取出来自己掌控
+struct CodecLayer
+{
+    bool FillDecoder(AVStream *);
+    bool FillDecoder(const AVCodecParameters *, int);
+    bool FillEncoderCopyFrom(AVCodecParameters *);
+    bool FillVideoEncoder(AVCodecContext *, const std::string &, AVRational);
+    bool FillAudioEncoder(AVCodecContext *, const std::string &);
+    void SetThreads(int, bool frame_thread = true);
+    bool OpenCodec();
+    bool CodecExist() const;
+
+    // 送入一个包/帧后把编解码器里已经就绪的输出全部取出，nullptr表示冲刷
+    // 帧线程解码和x264的lookahead都会缓存多帧，只取一次会丢帧
+    bool Decode(const AVPacket *, AVFrame *, const FrameSink &);
+    bool Encode(const AVFrame *, AVPacket *, const PacketSink &);
+
+    int index{-1};
+    AVStream *stream{nullptr};
+    const AVCodec *codec{nullptr};
+    AVCodecContext *codec_ctx{nullptr};
+};
+
+inline bool CodecLayer::FillDecoder(AVStream *in_stream)
+{
+    stream = in_stream;
+    return FillDecoder(in_stream->codecpar, in_stream->index);
+}
+
+inline bool CodecLayer::FillDecoder(const AVCodecParameters *in_codecpar, int stream_index)
+{
+    index = stream_index;
+    codec = avcodec_find_decoder(in_codecpar->codec_id);
+    if (!codec)
+    {
+        logging("failed to find video decoder!");
+        return false;
+    }
+    if(codec_ctx){
+        avcodec_free_context(&codec_ctx);
+    }
+    codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx)
+    {
+        logging("failed to alloc memory for codec context!");
+        return false;
+    }
+    if (avcodec_parameters_to_context(codec_ctx, in_codecpar) < 0)
+    {
+        logging("failed to fill codec context!");
+        return false;
+    }
+
+    return true;
+}
+
+inline bool CodecLayer::FillEncoderCopyFrom(AVCodecParameters *in_codecpar)
+{
+    if(avcodec_parameters_copy(stream->codecpar, in_codecpar) < 0)
+    {
+        return false;
+    }
+    return true;
+}
+
+inline bool CodecLayer::FillVideoEncoder(AVCodecContext *dec_ctx, const std::string& id, AVRational frame_rate)
+{
+    codec = avcodec_find_encoder_by_name(id.c_str());
+    if(!codec) {
+        logging("failed to find video encoder codec");
+        return false;
+    }
+    codec_ctx = avcodec_alloc_context3(codec);
+    if(!codec_ctx){
+        logging("failed to alloc context");
+        return false;
+    }
+
+    codec_ctx->height = dec_ctx->height;
+    codec_ctx->width = dec_ctx->width;
+    codec_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+    if(codec->pix_fmts){
+        codec_ctx->pix_fmt = codec->pix_fmts[0];
+    }
+    else{
+        codec_ctx->pix_fmt = dec_ctx->pix_fmt;
+    }
+
+    codec_ctx->bit_rate = 2 * 1000 * 1000;
+    codec_ctx->rc_buffer_size = 4 * 1000 * 1000;
+    codec_ctx->rc_max_rate = 2 * 1000 * 1000;
+
+    codec_ctx->time_base = av_inv_q(frame_rate);
+
+    // 没有输出流时(比如pipeline中的编码插件)只配置编码器
+    if(stream){
+        stream->time_base = codec_ctx->time_base;
+        avcodec_parameters_from_context(stream->codecpar, codec_ctx);
+    }
+
+    return true;
+}
+
+
+inline bool CodecLayer::FillAudioEncoder(AVCodecContext *dec_ctx, const std::string& id)
+{
+    codec = avcodec_find_encoder_by_name(id.c_str());
+    if(!codec) {
+        logging("failed to find audio encoder codec");
+        return false;
+    }
+    codec_ctx = avcodec_alloc_context3(codec);
+    if(!codec_ctx){
+        logging("failed to alloc context");
+        return false;
+    }
+
+    codec_ctx->channels = 2;
+    codec_ctx->channel_layout = av_get_default_channel_layout(2);
+    codec_ctx->sample_rate = dec_ctx->sample_rate;
+    codec_ctx->sample_fmt = codec->sample_fmts[0];
+    codec_ctx->bit_rate = dec_ctx->bit_rate;
+
+    codec_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+    codec_ctx->time_base = (AVRational){1, dec_ctx->sample_rate};
+
+    if(stream){
+        stream->time_base = codec_ctx->time_base;
+        avcodec_parameters_from_context(stream->codecpar, codec_ctx);
+    }
+
+    return true;
+}
+
+// count为0时由编解码器自己按核数决定，libx264的线程数也取自这里
+inline void CodecLayer::SetThreads(int count, bool frame_thread)
+{
+    if (!codec_ctx)
+    {
+        return;
+    }
+    codec_ctx->thread_count = count;
+    if (av_codec_is_decoder(codec))
+    {
+        codec_ctx->thread_type = frame_thread ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+    }
+}
+
+inline bool CodecLayer::OpenCodec()
+{
+    if (index != -1 && codec && codec_ctx && (avcodec_open2(codec_ctx, codec, NULL) >= 0))
+    {
+        return true;
+    }
+    else
+    {
+        logging("failed to open codec!");
+        return false;
+    }
+}
+
+inline bool CodecLayer::CodecExist() const
+{
+    if (index != -1 && stream && codec && codec_ctx)
+    {
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+inline bool CodecLayer::Decode(const AVPacket *in_pkt, AVFrame *out_frame, const FrameSink &sink)
+{
+    if(!codec_ctx || !out_frame){
+        return false;
+    }
+    int res = avcodec_send_packet(codec_ctx, in_pkt);
+    if(res < 0 && res != AVERROR_EOF){
+        logging("error while sending packet to decoder: [%s]", err2str(res));
+        return false;
+    }
+    while((res = avcodec_receive_frame(codec_ctx, out_frame)) >= 0){
+        bool more = sink(out_frame);
+        av_frame_unref(out_frame);
+        if(!more){
+            return false;
+        }
+    }
+    if(res != AVERROR(EAGAIN) && res != AVERROR_EOF){
+        logging("error while receive frame from decoder: [%s]", err2str(res));
+        return false;
+    }
+    return true;
+}
+
+inline bool CodecLayer::Encode(const AVFrame *in_frame, AVPacket *out_pkt, const PacketSink &sink)
+{
+    if(!codec_ctx || !out_pkt){
+        return false;
+    }
+    int res = avcodec_send_frame(codec_ctx, in_frame);
+    if(res < 0 && res != AVERROR_EOF){
+        logging("error while sending frame to encoder: [%s]", err2str(res));
+        return false;
+    }
+    while((res = avcodec_receive_packet(codec_ctx, out_pkt)) >= 0){
+        bool more = sink(out_pkt);
+        av_packet_unref(out_pkt);
+        if(!more){
+            return false;
+        }
+    }
+    if(res != AVERROR(EAGAIN) && res != AVERROR_EOF){
+        logging("error while receive packet from encoder: [%s]", err2str(res));
+        return false;
+    }
+    return true;
+}
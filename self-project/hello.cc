@@ -12,6 +12,7 @@ extern "C"
 #ifdef __cplusplus
 }
 #endif
+#include "stream_cache.h"
 
 static void logging(const char *fmt, ...)
 {
@@ -32,22 +33,22 @@ char av_error[AV_ERROR_MAX_STRING_SIZE] = { 0 };
 int main(int argc, char** argv)
 {
     if(argc < 2){
-        logging("please specify a file name:\n ./hello [filename]");
+        logging("please specify a file name:\n ./hello [filename] [stream_cache]");
         return -1;
     }
     const char *filename = argv[1];
+    // 给了缓存文件时，缓存和输入对得上就跳过avformat_find_stream_info
+    std::string stream_cache = argc > 2 ? argv[2] : "";
     AVFormatContext *av_fmt_ctx = avformat_alloc_context();
     // AVDictionary *opts = nullptr;
     // av_dict_set(&opts, "merge_pmt_versions", "1", 0);
-    if(0 != avformat_open_input(&av_fmt_ctx, filename, nullptr, nullptr)){
-        logging("avformat_open_input failed!");
-        return -1;
-    }
-    logging("Format %s, duration %lld us", av_fmt_ctx->iformat->long_name, av_fmt_ctx->duration);
-    if(0 != avformat_find_stream_info(av_fmt_ctx, NULL)){
-        logging("avformat_find_stream_info failed!");
+    bool fast = false;
+    if(0 != OpenInputWithCache(&av_fmt_ctx, filename, stream_cache, &fast)){
+        logging("open input failed!");
         return -1;
     }
+    logging("Format %s, duration %lld us, %s", av_fmt_ctx->iformat->long_name, av_fmt_ctx->duration,
+            fast ? "stream info from cache" : "probed");
     const AVCodecParameters *video_codec_par = nullptr;
     const AVCodec *video_codec = nullptr;
     int video_index = -1;
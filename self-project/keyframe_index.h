@@ -0,0 +1,380 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#ifdef __cplusplus
+}
+#endif
+#include "ts_scanner.h"
+
+/*
+    关键帧索引：每个流的关键帧在文件中的字节偏移和pts，建一次存成旁路文件
+    之后-ss定位只需要在内存里查表再做一次seek，不用在文件里二分和重新同步
+    音频等每个包都是关键帧的流只保留大约每秒一条
+*/
+
+static const char kKeyframeIndexMagic[8] = {'K', 'F', 'I', 'N', 'D', 'E', 'X', '1'};
+
+struct KeyframeEntry
+{
+    int64_t pos;    // 包在文件中的字节偏移，-1表示未知
+    int64_t pts;    // 流的时间基
+};
+
+struct IndexedStream
+{
+    int index{0};
+    int id{0};
+    int codec_type{AVMEDIA_TYPE_UNKNOWN};
+    AVRational time_base{0, 1};
+    std::vector<KeyframeEntry> keyframes;    // 按pts升序
+};
+
+struct KeyframeIndex
+{
+    std::string format;
+    int64_t file_size{-1};              // 建索引时的文件大小，用来发现文件已经变了
+    int64_t start_time{AV_NOPTS_VALUE};  // AV_TIME_BASE，-ss从这里算起
+    int64_t duration{AV_NOPTS_VALUE};    // AV_TIME_BASE
+    std::vector<IndexedStream> streams;
+
+    // 完整读一遍文件建立索引，本地的TS文件直接按包头扫描，不经过解复用
+    bool Build(const std::string &url);
+    bool Save(const std::string &path) const;
+    bool Load(const std::string &path);
+
+    // 定位用的流：第一个有关键帧的视频流，没有视频时取第一个有关键帧的流
+    const IndexedStream *Primary() const;
+    // 主流上pts不大于target(AV_TIME_BASE，从start_time算起)的最后一个关键帧
+    const KeyframeEntry *Find(int64_t target) const;
+    // 按时长把文件均分成chunks段，返回每段起点的关键帧，第一段从第一个关键帧开始
+    std::vector<KeyframeEntry> Split(int chunks) const;
+
+private:
+    bool BuildFromPackets(AVFormatContext *fmt_ctx);
+    bool BuildFromTs(AVFormatContext *fmt_ctx, const std::string &path);
+    void Append(IndexedStream &st, int64_t pos, int64_t pts, bool sparse);
+};
+
+inline void KeyframeIndex::Append(IndexedStream &st, int64_t pos, int64_t pts, bool sparse)
+{
+    // 每个包都是关键帧的流，距上一条不到一秒的不记
+    if (sparse && !st.keyframes.empty() &&
+        av_compare_ts(pts - st.keyframes.back().pts, st.time_base, 1, AVRational{1, 1}) < 0)
+        return;
+    st.keyframes.push_back(KeyframeEntry{pos, pts});
+}
+
+inline bool KeyframeIndex::BuildFromPackets(AVFormatContext *fmt_ctx)
+{
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt)
+        return false;
+    while (av_read_frame(fmt_ctx, pkt) >= 0)
+    {
+        if ((pkt->flags & AV_PKT_FLAG_KEY) && pkt->stream_index < static_cast<int>(streams.size()))
+        {
+            IndexedStream &st = streams[pkt->stream_index];
+            int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+            if (pts != AV_NOPTS_VALUE)
+                Append(st, pkt->pos, pts, st.codec_type != AVMEDIA_TYPE_VIDEO);
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    return true;
+}
+
+// 关键帧以PES包头所在TS包的random_access_indicator为准，复用器没有设置时返回false回到解复用的办法
+inline bool KeyframeIndex::BuildFromTs(AVFormatContext *fmt_ctx, const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    void *addr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return false;
+    madvise(addr, sb.st_size, MADV_SEQUENTIAL);
+    TsScanner scanner;
+    scanner.Scan(static_cast<const uint8_t *>(addr), sb.st_size);
+    munmap(addr, sb.st_size);
+
+    std::vector<int> pid_map(TS_MAX_PID, -1);
+    for (uint32_t i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        if (fmt_ctx->streams[i]->id >= 0 && fmt_ctx->streams[i]->id < TS_MAX_PID)
+            pid_map[fmt_ctx->streams[i]->id] = i;
+    }
+    bool video_found = false;
+    for (auto &&entry : scanner.Index())
+    {
+        if (entry.type != TsIndexEntry::kPes || !(entry.flags & TsIndexEntry::kRandomAccess) ||
+            entry.value == TS_NOPTS_VALUE || pid_map[entry.pid] < 0)
+            continue;
+        IndexedStream &st = streams[pid_map[entry.pid]];
+        Append(st, entry.offset, entry.value, st.codec_type != AVMEDIA_TYPE_VIDEO);
+        video_found |= st.codec_type == AVMEDIA_TYPE_VIDEO;
+    }
+    return video_found;
+}
+
+inline bool KeyframeIndex::Build(const std::string &url)
+{
+    AVFormatContext *fmt_ctx = nullptr;
+    if (avformat_open_input(&fmt_ctx, url.c_str(), nullptr, nullptr) < 0)
+        return false;
+    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0)
+    {
+        avformat_close_input(&fmt_ctx);
+        return false;
+    }
+    format = fmt_ctx->iformat->name;
+    file_size = fmt_ctx->pb ? avio_size(fmt_ctx->pb) : -1;
+    start_time = fmt_ctx->start_time;
+    duration = fmt_ctx->duration;
+    streams.clear();
+    for (uint32_t i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        IndexedStream st;
+        st.index = i;
+        st.id = fmt_ctx->streams[i]->id;
+        st.codec_type = fmt_ctx->streams[i]->codecpar->codec_type;
+        st.time_base = fmt_ctx->streams[i]->time_base;
+        streams.push_back(st);
+    }
+
+    bool ok = false;
+    // 本地TS文件，按188字节跨步只看包头，比解复用快一个数量级以上
+    if (format == "mpegts" && avio_find_protocol_name(url.c_str()) && !strcmp(avio_find_protocol_name(url.c_str()), "file"))
+    {
+        const std::string path = url.compare(0, 5, "file:") ? url : url.substr(5);
+        ok = BuildFromTs(fmt_ctx, path);
+        if (!ok)
+        {
+            for (auto &&st : streams)
+                st.keyframes.clear();
+        }
+    }
+    if (!ok)
+        ok = BuildFromPackets(fmt_ctx);
+    avformat_close_input(&fmt_ctx);
+    for (auto &&st : streams)
+    {
+        std::sort(st.keyframes.begin(), st.keyframes.end(),
+                  [](const KeyframeEntry &a, const KeyframeEntry &b) { return a.pts < b.pts; });
+    }
+    return ok && Primary();
+}
+
+inline bool KeyframeIndex::Save(const std::string &path) const
+{
+    std::string tmp = path + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(kKeyframeIndexMagic, sizeof(kKeyframeIndexMagic), 1, file) == 1;
+    const uint32_t format_len = format.size();
+    const uint32_t nb_streams = streams.size();
+    ok = ok && fwrite(&file_size, sizeof(file_size), 1, file) == 1;
+    ok = ok && fwrite(&start_time, sizeof(start_time), 1, file) == 1;
+    ok = ok && fwrite(&duration, sizeof(duration), 1, file) == 1;
+    ok = ok && fwrite(&format_len, sizeof(format_len), 1, file) == 1;
+    ok = ok && fwrite(format.data(), 1, format_len, file) == format_len;
+    ok = ok && fwrite(&nb_streams, sizeof(nb_streams), 1, file) == 1;
+    for (auto &&st : streams)
+    {
+        const int32_t header[5] = {st.index, st.id, st.codec_type, st.time_base.num, st.time_base.den};
+        const uint32_t count = st.keyframes.size();
+        ok = ok && fwrite(header, sizeof(header), 1, file) == 1;
+        ok = ok && fwrite(&count, sizeof(count), 1, file) == 1;
+        ok = ok && (count == 0 || fwrite(st.keyframes.data(), sizeof(KeyframeEntry), count, file) == count);
+    }
+    ok = fclose(file) == 0 && ok;
+    // 先写临时文件再改名，不会留下半个索引
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+inline bool KeyframeIndex::Load(const std::string &path)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    // 关键帧个数不能超过文件剩下的字节，损坏的索引不会申请一大块内存
+    struct stat index_stat;
+    if (fstat(fileno(file), &index_stat) < 0)
+    {
+        fclose(file);
+        return false;
+    }
+    char magic[sizeof(kKeyframeIndexMagic)];
+    uint32_t format_len = 0, nb_streams = 0;
+    bool ok = fread(magic, sizeof(magic), 1, file) == 1 && !memcmp(magic, kKeyframeIndexMagic, sizeof(kKeyframeIndexMagic));
+    ok = ok && fread(&file_size, sizeof(file_size), 1, file) == 1;
+    ok = ok && fread(&start_time, sizeof(start_time), 1, file) == 1;
+    ok = ok && fread(&duration, sizeof(duration), 1, file) == 1;
+    ok = ok && fread(&format_len, sizeof(format_len), 1, file) == 1 && format_len < 256;
+    if (ok)
+    {
+        format.resize(format_len);
+        ok = fread(&format[0], 1, format_len, file) == format_len;
+    }
+    ok = ok && fread(&nb_streams, sizeof(nb_streams), 1, file) == 1 && nb_streams < 1024;
+    streams.clear();
+    for (uint32_t i = 0; ok && i < nb_streams; i++)
+    {
+        int32_t header[5];
+        uint32_t count = 0;
+        ok = fread(header, sizeof(header), 1, file) == 1 && fread(&count, sizeof(count), 1, file) == 1;
+        if (!ok)
+            break;
+        IndexedStream st;
+        st.index = header[0];
+        st.id = header[1];
+        st.codec_type = header[2];
+        st.time_base = AVRational{header[3], header[4]};
+        const long pos = ftell(file);
+        if (pos < 0 || count > static_cast<uint64_t>(index_stat.st_size - pos) / sizeof(KeyframeEntry))
+        {
+            ok = false;
+            break;
+        }
+        st.keyframes.resize(count);
+        ok = count == 0 || fread(st.keyframes.data(), sizeof(KeyframeEntry), count, file) == count;
+        streams.push_back(std::move(st));
+    }
+    fclose(file);
+    return ok && Primary();
+}
+
+inline const IndexedStream *KeyframeIndex::Primary() const
+{
+    const IndexedStream *first = nullptr;
+    for (auto &&st : streams)
+    {
+        if (st.keyframes.empty())
+            continue;
+        if (st.codec_type == AVMEDIA_TYPE_VIDEO)
+            return &st;
+        if (!first)
+            first = &st;
+    }
+    return first;
+}
+
+inline const KeyframeEntry *KeyframeIndex::Find(int64_t target) const
+{
+    const IndexedStream *st = Primary();
+    if (!st)
+        return nullptr;
+    const int64_t origin = start_time == AV_NOPTS_VALUE ? 0 : start_time;
+    const int64_t pts = av_rescale_q(origin + target, AV_TIME_BASE_Q, st->time_base);
+    auto it = std::upper_bound(st->keyframes.begin(), st->keyframes.end(), pts,
+                               [](int64_t value, const KeyframeEntry &entry) { return value < entry.pts; });
+    return it == st->keyframes.begin() ? &st->keyframes.front() : &*(it - 1);
+}
+
+inline std::vector<KeyframeEntry> KeyframeIndex::Split(int chunks) const
+{
+    std::vector<KeyframeEntry> points;
+    const IndexedStream *st = Primary();
+    if (!st || chunks <= 0)
+        return points;
+    points.push_back(st->keyframes.front());
+    const int64_t first = st->keyframes.front().pts;
+    const int64_t span = st->keyframes.back().pts - first;
+    for (int i = 1; i < chunks; i++)
+    {
+        const int64_t target = first + span * i / chunks;
+        auto it = std::upper_bound(st->keyframes.begin(), st->keyframes.end(), target,
+                                   [](int64_t value, const KeyframeEntry &entry) { return value < entry.pts; });
+        const KeyframeEntry &entry = *(it - 1);
+        // 关键帧太稀时几段会落到同一个关键帧上，合并掉
+        if (entry.pts > points.back().pts)
+            points.push_back(entry);
+    }
+    return points;
+}
+
+// 定位到一个关键帧：能按字节seek的格式(TS/FLV)直接跳到偏移，MP4这类按pts跳到那个关键帧
+// 之后av_read_frame从这个关键帧开始读
+inline bool SeekToEntry(AVFormatContext *fmt_ctx, int stream_index, const KeyframeEntry &entry)
+{
+    if (!(fmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK) && entry.pos >= 0)
+        return avformat_seek_file(fmt_ctx, -1, entry.pos, entry.pos, entry.pos, AVSEEK_FLAG_BYTE) >= 0;
+    return av_seek_frame(fmt_ctx, stream_index, entry.pts, AVSEEK_FLAG_BACKWARD) >= 0;
+}
+
+// 按索引定位到target(AV_TIME_BASE，从start_time算起)之前最近的关键帧，成功时返回关键帧
+inline const KeyframeEntry *SeekKeyframe(AVFormatContext *fmt_ctx, const KeyframeIndex &index, int64_t target)
+{
+    const IndexedStream *st = index.Primary();
+    const KeyframeEntry *entry = index.Find(target);
+    if (!entry || st->index >= static_cast<int>(fmt_ctx->nb_streams))
+        return nullptr;
+    return SeekToEntry(fmt_ctx, st->index, *entry) ? entry : nullptr;
+}
+
+// 索引是否还对应这个输入：格式、流的个数和类型、文件大小都一致
+inline bool IndexMatches(const KeyframeIndex &index, const AVFormatContext *fmt_ctx)
+{
+    if (index.format != fmt_ctx->iformat->name || index.streams.size() != fmt_ctx->nb_streams)
+        return false;
+    if (index.file_size >= 0 && fmt_ctx->pb && avio_size(fmt_ctx->pb) != index.file_size)
+        return false;
+    for (uint32_t i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        if (index.streams[i].codec_type != fmt_ctx->streams[i]->codecpar->codec_type ||
+            av_cmp_q(index.streams[i].time_base, fmt_ctx->streams[i]->time_base))
+            return false;
+    }
+    return true;
+}
+
+// 定位到start(AV_TIME_BASE，从输入开头算起)之前最近的关键帧
+// index_path给出并且和输入对得上时查索引直接跳过去，否则交给解复用器自己找(TS要在文件里二分)
+// 返回定位到的绝对时间(AV_TIME_BASE)，失败返回AV_NOPTS_VALUE
+inline int64_t SeekInput(AVFormatContext *fmt_ctx, int64_t start, const std::string &index_path, bool *indexed = nullptr)
+{
+    const int64_t origin = fmt_ctx->start_time == AV_NOPTS_VALUE ? 0 : fmt_ctx->start_time;
+    if (indexed)
+        *indexed = false;
+    KeyframeIndex index;
+    if (!index_path.empty())
+    {
+        if (!index.Load(index_path))
+            fprintf(stderr, "Could not load keyframe index '%s'\n", index_path.c_str());
+        else if (!IndexMatches(index, fmt_ctx))
+            fprintf(stderr, "keyframe index '%s' does not match the input, ignored\n", index_path.c_str());
+        else if (const KeyframeEntry *entry = SeekKeyframe(fmt_ctx, index, start))
+        {
+            if (indexed)
+                *indexed = true;
+            return av_rescale_q(entry->pts, index.Primary()->time_base, AV_TIME_BASE_Q);
+        }
+    }
+    const int64_t target = origin + start;
+    if (avformat_seek_file(fmt_ctx, -1, INT64_MIN, target, target, 0) < 0)
+        return AV_NOPTS_VALUE;
+    return target;
+}
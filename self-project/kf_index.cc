@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <chrono>
+#include "keyframe_index.h"
+
+static constexpr char usage_string[] = "usage:\n"
+                                       "    kf_index -i [input] [-o index] [-n chunks]\n"
+                                       "-o where to save the index, default input.kfidx\n"
+                                       "-n also print the keyframes splitting the input into this many chunks of equal duration\n";
+
+int main(int argc, char **argv)
+{
+    int ret;
+    const char *optstring = "i:o:n:h";
+    std::string in_filename;
+    std::string index_filename;
+    int chunks = 0;
+    while ((ret = getopt(argc, argv, optstring)) != -1)
+    {
+        switch (ret)
+        {
+        case 'i':
+            in_filename = optarg;
+            break;
+        case 'o':
+            index_filename = optarg;
+            break;
+        case 'n':
+            chunks = atoi(optarg);
+            break;
+        case 'h':
+            printf(usage_string);
+            return 0;
+        case '?':
+            printf("error optopt: %c\n", optopt);
+            printf("error opterr: %d\n", opterr);
+            break;
+        default:
+            break;
+        }
+    }
+    if (in_filename.empty())
+    {
+        printf(usage_string);
+        return -1;
+    }
+    if (index_filename.empty())
+        index_filename = in_filename + ".kfidx";
+
+    KeyframeIndex index;
+    auto begin = std::chrono::steady_clock::now();
+    if (!index.Build(in_filename))
+    {
+        fprintf(stderr, "Could not build keyframe index for '%s'\n", in_filename.c_str());
+        return -1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    if (!index.Save(index_filename))
+    {
+        fprintf(stderr, "Could not save keyframe index to '%s'\n", index_filename.c_str());
+        return -1;
+    }
+
+    printf("%s: format %s, %.3f s, indexed in %.1f ms\n", in_filename.c_str(), index.format.c_str(),
+           index.duration == AV_NOPTS_VALUE ? 0.0 : index.duration / 1e6, seconds * 1e3);
+    for (auto &&st : index.streams)
+    {
+        printf("stream %d (id %d, %s): %zu entries\n", st.index, st.id,
+               av_get_media_type_string(static_cast<AVMediaType>(st.codec_type)) ?: "unknown", st.keyframes.size());
+    }
+    if (chunks > 0)
+    {
+        const IndexedStream *primary = index.Primary();
+        for (auto &&point : index.Split(chunks))
+        {
+            printf("chunk at pos %ld pts %ld (%.3f s)\n", static_cast<long>(point.pos), static_cast<long>(point.pts),
+                   point.pts * av_q2d(primary->time_base));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,263 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include "libavcodec/avcodec.h"
+#include "libavutil/buffer.h"
+#include "libavutil/frame.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+#ifdef __cplusplus
+}
+#endif
+
+/*
+    热路径上的对象池：
+    AVPacket/AVFrame结构体用完后unref放回空闲表，下次直接取，不再每个包/每帧alloc/free一次
+    视频帧的像素按流的分辨率和像素格式分平面建AVBufferPool，挂到解码器的get_buffer2上，
+    解码出的帧经过滤镜、编码器一路引用同一块内存，最后一个引用释放时回到池里
+    跑稳之后一帧都不需要再向系统分配内存，多路并发时不会在malloc上互相争锁
+*/
+
+struct PacketPoolTraits
+{
+    static AVPacket *Alloc() { return av_packet_alloc(); }
+    static void Unref(AVPacket *pkt) { av_packet_unref(pkt); }
+    static void Free(AVPacket **pkt) { av_packet_free(pkt); }
+};
+
+struct FramePoolTraits
+{
+    static AVFrame *Alloc() { return av_frame_alloc(); }
+    static void Unref(AVFrame *frame) { av_frame_unref(frame); }
+    static void Free(AVFrame **frame) { av_frame_free(frame); }
+};
+
+// 线程安全，取和还可以在不同线程，空闲表满了之后多还回来的直接释放
+template <typename T, typename Traits>
+class ObjectPool
+{
+public:
+    explicit ObjectPool(size_t capacity) : capacity_(capacity)
+    {
+        free_.reserve(capacity_);
+    }
+
+    ~ObjectPool()
+    {
+        for (auto &&obj : free_)
+            Traits::Free(&obj);
+    }
+
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    // 预先分配，启动时调用，之后的Get不再分配
+    void Reserve(size_t count)
+    {
+        std::lock_guard<std::mutex> lkg(mutex_);
+        while (free_.size() < std::min(count, capacity_))
+        {
+            T *obj = Traits::Alloc();
+            if (!obj)
+                break;
+            free_.push_back(obj);
+        }
+    }
+
+    // 取出的对象是空的，池空时才分配
+    T *Get()
+    {
+        {
+            std::lock_guard<std::mutex> lkg(mutex_);
+            if (!free_.empty())
+            {
+                T *obj = free_.back();
+                free_.pop_back();
+                return obj;
+            }
+        }
+        return Traits::Alloc();
+    }
+
+    // 负载的引用在锁外释放
+    void Put(T *obj)
+    {
+        if (!obj)
+            return;
+        Traits::Unref(obj);
+        {
+            std::lock_guard<std::mutex> lkg(mutex_);
+            if (free_.size() < capacity_)
+            {
+                free_.push_back(obj);
+                return;
+            }
+        }
+        Traits::Free(&obj);
+    }
+
+    size_t Idle() const
+    {
+        std::lock_guard<std::mutex> lkg(mutex_);
+        return free_.size();
+    }
+
+private:
+    const size_t capacity_;
+    mutable std::mutex mutex_;
+    std::vector<T *> free_;
+};
+
+using PacketPool = ObjectPool<AVPacket, PacketPoolTraits>;
+using FramePool = ObjectPool<AVFrame, FramePoolTraits>;
+
+// 进程内共享的池，空闲表的容量按几十路并发、每路队列里几百个包估算
+inline PacketPool &SharedPacketPool()
+{
+    static PacketPool pool(16384);
+    return pool;
+}
+
+inline FramePool &SharedFramePool()
+{
+    static FramePool pool(1024);
+    return pool;
+}
+
+// 一个视频流的帧数据池，分辨率或者像素格式变化时重建，旧池里的缓冲等引用释放后自行回收
+// 池的生命周期要长于挂上它的解码器，帧可以比池活得久
+class FrameBufferPool
+{
+public:
+    FrameBufferPool() = default;
+    ~FrameBufferPool()
+    {
+        Reset();
+    }
+
+    FrameBufferPool(const FrameBufferPool &) = delete;
+    FrameBufferPool &operator=(const FrameBufferPool &) = delete;
+
+    // 在avcodec_open2之前调用，不支持自定义缓冲(没有DR1)的解码器保持默认分配
+    void Attach(AVCodecContext *ctx)
+    {
+        if (!ctx || !ctx->codec || ctx->codec_type != AVMEDIA_TYPE_VIDEO ||
+            !(ctx->codec->capabilities & AV_CODEC_CAP_DR1))
+            return;
+        ctx->opaque = this;
+        ctx->get_buffer2 = &FrameBufferPool::GetBuffer2;
+    }
+
+    void Reset()
+    {
+        std::lock_guard<std::mutex> lkg(mutex_);
+        for (auto &&pool : pools_)
+            av_buffer_pool_uninit(&pool);
+        planes_ = 0;
+        format_ = AV_PIX_FMT_NONE;
+        width_ = height_ = 0;
+    }
+
+private:
+    // 帧线程解码时会在多个解码线程里同时调用
+    static int GetBuffer2(AVCodecContext *ctx, AVFrame *frame, int flags)
+    {
+        FrameBufferPool *self = static_cast<FrameBufferPool *>(ctx->opaque);
+        if (!self || ctx->hw_frames_ctx || !self->Get(ctx, frame))
+            return avcodec_default_get_buffer2(ctx, frame, flags);
+        return 0;
+    }
+
+    bool Get(AVCodecContext *ctx, AVFrame *frame)
+    {
+        const AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+        if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+            return false;
+
+        std::lock_guard<std::mutex> lkg(mutex_);
+        if ((format != format_ || frame->width != width_ || frame->height != height_) &&
+            !Configure(ctx, format, frame->width, frame->height))
+            return false;
+        for (int i = 0; i < planes_; ++i)
+        {
+            frame->buf[i] = av_buffer_pool_get(pools_[i]);
+            if (!frame->buf[i])
+            {
+                for (int j = 0; j < i; ++j)
+                    av_buffer_unref(&frame->buf[j]);
+                return false;
+            }
+            frame->data[i] = frame->buf[i]->data;
+            frame->linesize[i] = linesize_[i];
+        }
+        frame->extended_data = frame->data;
+        return true;
+    }
+
+    // 对齐规则与avcodec_default_get_buffer2相同：宽高按解码器要求对齐，行宽满足每个平面的SIMD对齐
+    bool Configure(AVCodecContext *ctx, AVPixelFormat format, int width, int height)
+    {
+        for (auto &&pool : pools_)
+            av_buffer_pool_uninit(&pool);
+        planes_ = 0;
+        format_ = AV_PIX_FMT_NONE;
+
+        int w = width;
+        int h = height;
+        int align[AV_NUM_DATA_POINTERS];
+        avcodec_align_dimensions2(ctx, &w, &h, align);
+        bool unaligned;
+        do
+        {
+            if (av_image_fill_linesizes(linesize_, format, w) < 0)
+                return false;
+            w += w & ~(w - 1);
+            unaligned = false;
+            for (int i = 0; i < 4; ++i)
+                unaligned |= (linesize_[i] % align[i]) != 0;
+        } while (unaligned);
+
+        ptrdiff_t linesizes[4];
+        size_t sizes[4];
+        for (int i = 0; i < 4; ++i)
+            linesizes[i] = linesize_[i];
+        if (av_image_fill_plane_sizes(sizes, format, h, linesizes) < 0)
+            return false;
+        const int planes = av_pix_fmt_count_planes(format);
+        for (int i = 0; i < planes; ++i)
+        {
+            // 部分解码器的SIMD会读过平面末尾
+            pools_[i] = av_buffer_pool_init(sizes[i] + 16 + kStrideAlign - 1, nullptr);
+            if (!pools_[i])
+            {
+                for (auto &&pool : pools_)
+                    av_buffer_pool_uninit(&pool);
+                return false;
+            }
+        }
+        planes_ = planes;
+        format_ = format;
+        width_ = width;
+        height_ = height;
+        return true;
+    }
+
+    static constexpr int kStrideAlign = 64;
+
+    std::mutex mutex_;
+    AVBufferPool *pools_[4]{};
+    int linesize_[4]{};
+    int planes_{0};
+    AVPixelFormat format_{AV_PIX_FMT_NONE};
+    int width_{0};
+    int height_{0};
+};
@@ -0,0 +1,442 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+
+/*
+    运行时指标：每个阶段(解封装、解码、编码、封装、写出...)一组计数器和两个延迟直方图
+    每组指标只由一个线程写(插件的Run由调度器串行执行，转码循环只有一个线程)，写入是relaxed的读加写，
+    不加锁也不用原子RMW，导出线程随时读，读到的值最多落后一次写入
+    导出线程定期把所有阶段写成JSON，或者文件名以.prom结尾时写成Prometheus文本格式，
+    先写临时文件再rename，node_exporter的textfile收集器或者运维脚本随时读到的都是完整的文件
+*/
+
+inline int64_t MetricsNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 单写者计数，多个线程同时写同一个计数会丢增量
+inline void MetricsAdd(std::atomic<uint64_t> &counter, uint64_t delta = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+// 对数分桶的延迟直方图，和HdrHistogram一样每个2的幂区间再等分kSubBuckets份，
+// 相对误差不超过1/kSubBuckets，覆盖整个uint64范围，记录一次只是数组下标加一
+class LatencyHistogram
+{
+public:
+    static constexpr int kSubBits = 4;
+    static constexpr int kSubBuckets = 1 << kSubBits;
+    static constexpr int kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+    LatencyHistogram()
+    {
+        for (auto &&count : counts_)
+            count.store(0, std::memory_order_relaxed);
+    }
+
+    LatencyHistogram(const LatencyHistogram &) = delete;
+    LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+    void Record(int64_t value)
+    {
+        const uint64_t v = value > 0 ? static_cast<uint64_t>(value) : 0;
+        MetricsAdd(counts_[Index(v)]);
+        MetricsAdd(count_);
+        MetricsAdd(sum_, v);
+        if (v > max_.load(std::memory_order_relaxed))
+            max_.store(v, std::memory_order_relaxed);
+    }
+
+    uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+
+    // 取所在桶的上界，q在0到1之间
+    uint64_t Quantile(double q) const
+    {
+        uint64_t counts[kBuckets];
+        uint64_t total = 0;
+        for (int i = 0; i < kBuckets; ++i)
+            total += counts[i] = counts_[i].load(std::memory_order_relaxed);
+        if (total == 0)
+            return 0;
+        const uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(q * total + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; ++i)
+        {
+            seen += counts[i];
+            if (seen >= target)
+                return std::min(UpperBound(i), Max());
+        }
+        return Max();
+    }
+
+private:
+    static int Index(uint64_t v)
+    {
+        if (v < kSubBuckets)
+            return static_cast<int>(v);
+        const int msb = 63 - __builtin_clzll(v);
+        const int group = msb - kSubBits + 1;
+        return group * kSubBuckets + static_cast<int>((v >> (msb - kSubBits)) & (kSubBuckets - 1));
+    }
+
+    static uint64_t UpperBound(int index)
+    {
+        const int group = index / kSubBuckets;
+        const uint64_t sub = index % kSubBuckets;
+        if (group == 0)
+            return sub;
+        const uint64_t lower = (kSubBuckets + sub) << (group - 1);
+        return lower + (UINT64_C(1) << (group - 1)) - 1;
+    }
+
+    std::atomic<uint64_t> counts_[kBuckets];
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+// 一个阶段的指标，pipeline为所属的通道名
+struct StageMetrics
+{
+    std::string pipeline;
+    std::string stage;
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> errors{0};
+    LatencyHistogram run_ns;    // 每次处理的耗时，嵌套的下游阶段不计入
+    LatencyHistogram wait_ns;   // 数据单元在本阶段队列里等待的时长，没有队列的阶段为空
+    std::function<size_t()> queue_depth;    // 导出时采样，没有队列的阶段为空
+};
+
+// 给一段处理计时，记到StageMetrics::run_ns
+// 可以嵌套，比如解码回调里编码、编码回调里封装，内层的耗时从外层扣掉，各阶段只记自己的时间
+// metrics为nullptr时什么都不做，不取时间
+class StageTimer
+{
+public:
+    explicit StageTimer(StageMetrics *metrics) : metrics_(metrics)
+    {
+        if (!metrics_)
+            return;
+        start_ = MetricsNowNs();
+        parent_ = Current();
+        if (parent_)
+            parent_->elapsed_ += start_ - parent_->start_;
+        Current() = this;
+    }
+
+    ~StageTimer()
+    {
+        if (!metrics_)
+            return;
+        const int64_t now = MetricsNowNs();
+        metrics_->run_ns.Record(elapsed_ + now - start_);
+        Current() = parent_;
+        if (parent_)
+            parent_->start_ = now;
+    }
+
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+    static StageTimer *&Current()
+    {
+        static thread_local StageTimer *current = nullptr;
+        return current;
+    }
+
+    StageMetrics *metrics_;
+    StageTimer *parent_{nullptr};
+    int64_t start_{0};
+    int64_t elapsed_{0};
+};
+
+class MetricsRegistry
+{
+public:
+    // 同一个pipeline里重名的阶段加上序号，比如ABR各档的encode、encode1...
+    StageMetrics *Stage(const std::string &pipeline, const std::string &stage,
+                        std::function<size_t()> queue_depth = nullptr)
+    {
+        std::lock_guard<std::mutex> lkg(mutex_);
+        std::string name = stage;
+        for (int n = 1; Find(pipeline, name); ++n)
+            name = stage + std::to_string(n);
+        stages_.emplace_back(new StageMetrics);
+        StageMetrics *metrics = stages_.back().get();
+        metrics->pipeline = pipeline;
+        metrics->stage = name;
+        metrics->queue_depth = std::move(queue_depth);
+        return metrics;
+    }
+
+    std::string ToJson() const
+    {
+        std::lock_guard<std::mutex> lkg(mutex_);
+        std::string out;
+        Append(out, "{\"time_ms\":%lld,\"stages\":[", static_cast<long long>(WallMs()));
+        for (size_t i = 0; i < stages_.size(); ++i)
+        {
+            const StageMetrics &m = *stages_[i];
+            out += i ? ",\n{\"pipeline\":\"" : "\n{\"pipeline\":\"";
+            out += JsonEscape(m.pipeline);
+            out += "\",\"stage\":\"";
+            out += JsonEscape(m.stage);
+            Append(out, "\",\"packets\":%llu,\"frames\":%llu,\"bytes\":%llu,\"errors\":%llu",
+                   Value(m.packets), Value(m.frames), Value(m.bytes), Value(m.errors));
+            if (m.queue_depth)
+                Append(out, ",\"queue_depth\":%zu", m.queue_depth());
+            AppendJson(out, "run_ns", m.run_ns);
+            AppendJson(out, "wait_ns", m.wait_ns);
+            out += "}";
+        }
+        out += "\n]}\n";
+        return out;
+    }
+
+    std::string ToPrometheus() const
+    {
+        std::lock_guard<std::mutex> lkg(mutex_);
+        std::string out;
+        static const struct
+        {
+            const char *name;
+            std::atomic<uint64_t> StageMetrics::*field;
+        } counters[] = {
+            {"media_stage_packets_total", &StageMetrics::packets},
+            {"media_stage_frames_total", &StageMetrics::frames},
+            {"media_stage_bytes_total", &StageMetrics::bytes},
+            {"media_stage_errors_total", &StageMetrics::errors},
+        };
+        for (auto &&counter : counters)
+        {
+            Append(out, "# TYPE %s counter\n", counter.name);
+            for (auto &&m : stages_)
+                Append(out, "%s{%s} %llu\n", counter.name, PromLabels(*m).c_str(), Value((*m).*counter.field));
+        }
+        out += "# TYPE media_stage_queue_depth gauge\n";
+        for (auto &&m : stages_)
+        {
+            if (m->queue_depth)
+                Append(out, "media_stage_queue_depth{%s} %zu\n", PromLabels(*m).c_str(), m->queue_depth());
+        }
+        AppendSummary(out, "media_stage_run_seconds", &StageMetrics::run_ns);
+        AppendSummary(out, "media_stage_wait_seconds", &StageMetrics::wait_ns);
+        return out;
+    }
+
+    // 格式按文件名决定，写完整之后rename，读的一方不会看到写了一半的文件
+    bool WriteFile(const std::string &path) const
+    {
+        const bool prom = path.size() >= 5 && path.compare(path.size() - 5, 5, ".prom") == 0;
+        const std::string text = prom ? ToPrometheus() : ToJson();
+        const std::string tmp = path + ".tmp";
+        FILE *fp = fopen(tmp.c_str(), "w");
+        if (!fp)
+            return false;
+        const bool ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+        if (fclose(fp) != 0 || !ok)
+        {
+            remove(tmp.c_str());
+            return false;
+        }
+        return rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    bool Find(const std::string &pipeline, const std::string &stage) const
+    {
+        for (auto &&m : stages_)
+        {
+            if (m->pipeline == pipeline && m->stage == stage)
+                return true;
+        }
+        return false;
+    }
+
+    static unsigned long long Value(const std::atomic<uint64_t> &counter)
+    {
+        return counter.load(std::memory_order_relaxed);
+    }
+
+    static long long WallMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // 超过缓冲的部分按实际长度再格式化一次，标签是很长的URL时也不会截断
+    __attribute__((format(printf, 2, 3))) static void Append(std::string &out, const char *fmt, ...)
+    {
+        char buf[1024];
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        if (n <= 0)
+            return;
+        if (static_cast<size_t>(n) < sizeof(buf))
+        {
+            out.append(buf, n);
+            return;
+        }
+        std::vector<char> big(n + 1);
+        va_start(ap, fmt);
+        vsnprintf(big.data(), big.size(), fmt, ap);
+        va_end(ap);
+        out.append(big.data(), n);
+    }
+
+    // 标签是输入输出的URL或者路径，可能带引号、反斜杠，写进字符串之前要转义
+    static std::string JsonEscape(const std::string &in)
+    {
+        std::string out;
+        for (unsigned char c : in)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (c < 0x20)
+            {
+                char hex[8];
+                snprintf(hex, sizeof(hex), "\\u%04x", c);
+                out += hex;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    // Prometheus的标签值只需要转义反斜杠、引号和换行
+    static std::string PromEscape(const std::string &in)
+    {
+        std::string out;
+        for (char c : in)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (c == '\n')
+            {
+                out += "\\n";
+            }
+            else
+            {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    static std::string PromLabels(const StageMetrics &m)
+    {
+        return "pipeline=\"" + PromEscape(m.pipeline) + "\",stage=\"" + PromEscape(m.stage) + "\"";
+    }
+
+    static void AppendJson(std::string &out, const char *name, const LatencyHistogram &h)
+    {
+        const uint64_t count = h.Count();
+        Append(out, ",\"%s\":{\"count\":%llu,\"mean\":%.0f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+               name, static_cast<unsigned long long>(count), count ? static_cast<double>(h.Sum()) / count : 0.0,
+               static_cast<unsigned long long>(h.Quantile(0.5)), static_cast<unsigned long long>(h.Quantile(0.9)),
+               static_cast<unsigned long long>(h.Quantile(0.99)), static_cast<unsigned long long>(h.Quantile(0.999)),
+               static_cast<unsigned long long>(h.Max()));
+    }
+
+    void AppendSummary(std::string &out, const char *name, LatencyHistogram StageMetrics::*field) const
+    {
+        static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+        Append(out, "# TYPE %s summary\n", name);
+        for (auto &&m : stages_)
+        {
+            const LatencyHistogram &h = (*m).*field;
+            if (!h.Count())
+                continue;
+            const std::string labels = PromLabels(*m);
+            for (double q : quantiles)
+                Append(out, "%s{%s,quantile=\"%g\"} %.9f\n", name, labels.c_str(), q, h.Quantile(q) / 1e9);
+            Append(out, "%s_sum{%s} %.9f\n", name, labels.c_str(), h.Sum() / 1e9);
+            Append(out, "%s_count{%s} %llu\n", name, labels.c_str(), static_cast<unsigned long long>(h.Count()));
+        }
+    }
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<StageMetrics>> stages_;
+};
+
+// 后台线程按周期写文件，Stop时再写最后一次
+// queue_depth会回调到插件，要在插件销毁之前Stop
+class MetricsExporter
+{
+public:
+    ~MetricsExporter()
+    {
+        Stop();
+    }
+
+    bool Start(const MetricsRegistry &registry, const std::string &path, int interval_ms = 1000)
+    {
+        if (thread_.joinable() || path.empty())
+            return false;
+        registry_ = &registry;
+        path_ = path;
+        stop_ = false;
+        const std::chrono::milliseconds interval(interval_ms > 0 ? interval_ms : 1000);
+        thread_ = std::thread([this, interval]() {
+            std::unique_lock<std::mutex> ulk(mutex_);
+            while (!cv_.wait_for(ulk, interval, [this]() { return stop_; }))
+            {
+                if (!registry_->WriteFile(path_))
+                    fprintf(stderr, "failed to write metrics to %s\n", path_.c_str());
+            }
+        });
+        return true;
+    }
+
+    void Stop()
+    {
+        if (!thread_.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lkg(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+        registry_->WriteFile(path_);
+    }
+
+private:
+    const MetricsRegistry *registry_{nullptr};
+    std::string path_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_{false};
+    std::thread thread_;
+};
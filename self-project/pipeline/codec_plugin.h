@@ -0,0 +1,497 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <iostream>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include "libavfilter/avfilter.h"
+#include "libavfilter/buffersink.h"
+#include "libavfilter/buffersrc.h"
+#include "libavutil/pixdesc.h"
+#ifdef __cplusplus
+}
+#endif
+#include "plugin.h"
+#include "../codec_layer.h"
+
+/*
+    demux --packet--> decode --frame--> filter --frame--> encode --packet--> mux --> write
+    每个插件只处理选中的一个流，其余流的包原样透传，比如视频转码时音频直接copy
+*/
+
+// 选出第一个指定类型的流
+inline int FindStream(const StreamInfoList &streams, AVMediaType type)
+{
+    for (size_t i = 0; i < streams.size(); ++i)
+    {
+        if (streams[i]->codecpar->codec_type == type)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+class DecodePlugin : public Plugin
+{
+public:
+    ~DecodePlugin() override
+    {
+        Deinit();
+    }
+
+    const char *StageName() const override
+    {
+        return "decode";
+    }
+
+    // threads为0时由libavcodec决定线程数
+    bool Init(Plugin *next, AVMediaType type = AVMEDIA_TYPE_VIDEO, int threads = 0)
+    {
+        type_ = type;
+        threads_ = threads;
+        eof_seen_ = false;
+        if (!frame_ && !(frame_ = av_frame_alloc()))
+            return false;
+        return Plugin::Init(next);
+    }
+
+    void Deinit() override
+    {
+        if (layer_.codec_ctx)
+            avcodec_free_context(&layer_.codec_ctx);
+        layer_.index = -1;
+        if (frame_)
+            av_frame_free(&frame_);
+        Plugin::Deinit();
+    }
+
+    ExecutionState Run() override
+    {
+        if (!FlushPending())
+            return Backoff();
+        if (eof_seen_)
+        {
+            if (!Finished())
+                Finish();
+            return kIdle;
+        }
+        if (next_ && next_->Congested())
+            return kBlocked;
+        MediaBuffer buf;
+        if (!Dequeue(buf))
+            return kIdle;
+
+        if (buf.IsStreams())
+        {
+            OpenDecoder(*buf.streams());
+            Deliver(std::move(buf));
+        }
+        else if (buf.IsPacket())
+        {
+            if (buf.packet()->stream_index == layer_.index && layer_.codec_ctx)
+                DecodePacket(buf.packet());
+            else
+                Deliver(std::move(buf));
+        }
+        else if (buf.IsEof())
+        {
+            if (layer_.codec_ctx)
+                DecodePacket(nullptr);
+            Deliver(std::move(buf));
+            eof_seen_ = true;
+        }
+        return kBusying;
+    }
+
+private:
+    bool OpenDecoder(const StreamInfoList &streams)
+    {
+        if (layer_.codec_ctx)
+            avcodec_free_context(&layer_.codec_ctx);
+        int index = FindStream(streams, type_);
+        if (index < 0 || !layer_.FillDecoder(streams[index]->codecpar, index))
+        {
+            layer_.index = -1;
+            return false;
+        }
+        time_base_ = streams[index]->time_base;
+        layer_.codec_ctx->pkt_timebase = time_base_;
+        layer_.SetThreads(threads_);
+        buffers_.Reset();
+        buffers_.Attach(layer_.codec_ctx);
+        if (!layer_.OpenCodec())
+        {
+            avcodec_free_context(&layer_.codec_ctx);
+            layer_.index = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // pkt为nullptr时冲刷解码器
+    void DecodePacket(const AVPacket *pkt)
+    {
+        layer_.Decode(pkt, frame_, [this](AVFrame *frame) {
+            frame->pts = frame->best_effort_timestamp;
+            frame->time_base = time_base_;
+            Deliver(MediaBuffer::MoveFrame(frame));
+            return true;
+        });
+    }
+
+private:
+    AVMediaType type_{AVMEDIA_TYPE_VIDEO};
+    int threads_{0};
+    CodecLayer layer_;
+    FrameBufferPool buffers_;   // 解码出的帧经滤镜、编码一路引用这里的缓冲
+    AVRational time_base_{0, 1};
+    AVFrame *frame_{nullptr};
+    bool eof_seen_{false};
+};
+
+// 视频滤镜，比如"scale=1280:720"，filter graph在收到第一帧时按帧参数建立
+class FilterPlugin : public Plugin
+{
+public:
+    ~FilterPlugin() override
+    {
+        Deinit();
+    }
+
+    const char *StageName() const override
+    {
+        return "filter";
+    }
+
+    bool Init(Plugin *next, const std::string &filter_desc)
+    {
+        filter_desc_ = filter_desc;
+        eof_seen_ = false;
+        failed_ = false;
+        if (!frame_ && !(frame_ = av_frame_alloc()))
+            return false;
+        return Plugin::Init(next);
+    }
+
+    void Deinit() override
+    {
+        CloseGraph();
+        if (frame_)
+            av_frame_free(&frame_);
+        Plugin::Deinit();
+    }
+
+    ExecutionState Run() override
+    {
+        if (!FlushPending())
+            return Backoff();
+        if (eof_seen_)
+        {
+            if (!Finished())
+                Finish();
+            return kIdle;
+        }
+        if (next_ && next_->Congested())
+            return kBlocked;
+        MediaBuffer buf;
+        if (!Dequeue(buf))
+            return kIdle;
+
+        if (buf.IsFrame())
+        {
+            // 滤镜建不起来时丢掉视频帧，不把没处理过的帧交给编码
+            if (failed_)
+                return kBusying;
+            if (!graph_ && !OpenGraph(buf.frame()))
+            {
+                logging("failed to init filter graph [%s], dropping video frames", filter_desc_.c_str());
+                failed_ = true;
+                return kBusying;
+            }
+            int ret = av_buffersrc_add_frame_flags(src_ctx_, buf.frame(), 0);
+            if (ret < 0)
+                logging("error while feeding the filter graph: [%s]", err2str(ret));
+            Drain();
+        }
+        else if (buf.IsEof())
+        {
+            if (graph_)
+            {
+                int ret = av_buffersrc_add_frame_flags(src_ctx_, nullptr, 0);
+                if (ret < 0)
+                    logging("error while flushing the filter graph: [%s]", err2str(ret));
+                Drain();
+            }
+            Deliver(std::move(buf));
+            eof_seen_ = true;
+        }
+        else
+        {
+            Deliver(std::move(buf));
+        }
+        return kBusying;
+    }
+
+private:
+    bool OpenGraph(const AVFrame *frame)
+    {
+        char args[512];
+        AVRational tb = frame->time_base.num ? frame->time_base : AVRational{1, 90000};
+        AVRational sar = frame->sample_aspect_ratio.num ? frame->sample_aspect_ratio : AVRational{0, 1};
+        snprintf(args, sizeof(args),
+                 "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+                 frame->width, frame->height, frame->format, tb.num, tb.den, sar.num, sar.den);
+
+        AVFilterInOut *outputs = avfilter_inout_alloc();
+        AVFilterInOut *inputs = avfilter_inout_alloc();
+        graph_ = avfilter_graph_alloc();
+        bool ok = outputs && inputs && graph_ &&
+                  avfilter_graph_create_filter(&src_ctx_, avfilter_get_by_name("buffer"), "in", args, nullptr, graph_) >= 0 &&
+                  avfilter_graph_create_filter(&sink_ctx_, avfilter_get_by_name("buffersink"), "out", nullptr, nullptr, graph_) >= 0;
+        if (ok)
+        {
+            outputs->name = av_strdup("in");
+            outputs->filter_ctx = src_ctx_;
+            outputs->pad_idx = 0;
+            outputs->next = nullptr;
+            inputs->name = av_strdup("out");
+            inputs->filter_ctx = sink_ctx_;
+            inputs->pad_idx = 0;
+            inputs->next = nullptr;
+            ok = avfilter_graph_parse_ptr(graph_, filter_desc_.c_str(), &inputs, &outputs, nullptr) >= 0 &&
+                 avfilter_graph_config(graph_, nullptr) >= 0;
+        }
+        avfilter_inout_free(&inputs);
+        avfilter_inout_free(&outputs);
+        if (!ok)
+            CloseGraph();
+        return ok;
+    }
+
+    void CloseGraph()
+    {
+        avfilter_graph_free(&graph_);
+        src_ctx_ = nullptr;
+        sink_ctx_ = nullptr;
+    }
+
+    void Drain()
+    {
+        while (av_buffersink_get_frame(sink_ctx_, frame_) >= 0)
+        {
+            frame_->time_base = av_buffersink_get_time_base(sink_ctx_);
+            Deliver(MediaBuffer::MoveFrame(frame_));
+        }
+    }
+
+private:
+    std::string filter_desc_;
+    AVFilterGraph *graph_{nullptr};
+    AVFilterContext *src_ctx_{nullptr};
+    AVFilterContext *sink_ctx_{nullptr};
+    AVFrame *frame_{nullptr};
+    bool failed_{false};        // 滤镜建立失败过，不再重试
+    bool eof_seen_{false};
+};
+
+// 视频编码，编码器在收到第一帧时按帧的分辨率打开，
+// 打开之后先向下游发出替换了编码参数的流描述，再发出之前暂存的透传包
+class EncodePlugin : public Plugin
+{
+public:
+    static constexpr size_t kHeldLimit = 512;   // 等第一帧时最多暂存的透传包数
+    ~EncodePlugin() override
+    {
+        Deinit();
+    }
+
+    const char *StageName() const override
+    {
+        return "encode";
+    }
+
+    // global_header: 输出格式需要全局头时(mp4/flv)置为true
+    bool Init(Plugin *next, const std::string &encoder, bool global_header = false, int threads = 0)
+    {
+        encoder_ = encoder;
+        global_header_ = global_header;
+        threads_ = threads;
+        eof_seen_ = false;
+        opened_ = false;
+        if (!pkt_ && !(pkt_ = av_packet_alloc()))
+            return false;
+        return Plugin::Init(next);
+    }
+
+    void Deinit() override
+    {
+        if (layer_.codec_ctx)
+            avcodec_free_context(&layer_.codec_ctx);
+        layer_.index = -1;
+        if (pkt_)
+            av_packet_free(&pkt_);
+        held_.clear();
+        streams_.reset();
+        Plugin::Deinit();
+    }
+
+    ExecutionState Run() override
+    {
+        if (!FlushPending())
+            return Backoff();
+        if (eof_seen_)
+        {
+            if (!Finished())
+                Finish();
+            return kIdle;
+        }
+        if (next_ && next_->Congested())
+            return kBlocked;
+        MediaBuffer buf;
+        if (!Dequeue(buf))
+            return kIdle;
+
+        if (buf.IsStreams())
+        {
+            streams_ = buf.streams();
+            layer_.index = FindStream(*streams_, AVMEDIA_TYPE_VIDEO);
+            Hold(std::move(buf));
+            // 没有视频流就等不到帧，不再暂存
+            if (layer_.index < 0)
+                ReleaseHeld();
+        }
+        else if (buf.IsFrame())
+        {
+            if (!opened_ && !OpenEncoder(buf.frame()))
+            {
+                // 打不开就丢掉视频帧，其余流照常透传
+                logging("failed to open video encoder %s", encoder_.c_str());
+                ReleaseHeld();
+            }
+            if (layer_.codec_ctx)
+                EncodeFrame(buf.frame());
+        }
+        else if (buf.IsEof())
+        {
+            if (layer_.codec_ctx)
+                EncodeFrame(nullptr);
+            ReleaseHeld();
+            Deliver(std::move(buf));
+            eof_seen_ = true;
+        }
+        else
+        {
+            // 视频包原样过来说明解码器没打开，不会再有帧
+            if (!opened_ && buf.IsPacket() && buf.packet()->stream_index == layer_.index)
+            {
+                logging("video stream is not decoded, passing it through");
+                ReleaseHeld();
+            }
+            Hold(std::move(buf));
+        }
+        return kBusying;
+    }
+
+private:
+    void Hold(MediaBuffer &&buf)
+    {
+        if (opened_)
+        {
+            Deliver(std::move(buf));
+            return;
+        }
+        held_.emplace_back(std::move(buf));
+        // 暂存满了还没有帧，按打不开编码器处理，之后的视频帧丢掉
+        if (held_.size() >= kHeldLimit)
+        {
+            logging("no video frame after %zu packets, giving up video encoding", held_.size());
+            ReleaseHeld();
+        }
+    }
+
+    void ReleaseHeld()
+    {
+        opened_ = true;
+        while (!held_.empty())
+        {
+            Deliver(std::move(held_.front()));
+            held_.pop_front();
+        }
+    }
+
+    bool OpenEncoder(const AVFrame *frame)
+    {
+        if (!streams_ || layer_.index < 0)
+            return false;
+        const StreamInfo &in = *(*streams_)[layer_.index];
+        AVRational frame_rate = in.frame_rate.num ? in.frame_rate : AVRational{25, 1};
+
+        // FillVideoEncoder按解码器上下文取参数，这里用帧参数构造一个
+        AVCodecContext *ref = avcodec_alloc_context3(nullptr);
+        if (!ref)
+            return false;
+        ref->width = frame->width;
+        ref->height = frame->height;
+        ref->pix_fmt = static_cast<AVPixelFormat>(frame->format);
+        ref->sample_aspect_ratio = frame->sample_aspect_ratio;
+        bool ok = layer_.FillVideoEncoder(ref, encoder_, frame_rate);
+        avcodec_free_context(&ref);
+        if (!ok)
+            return false;
+        if (global_header_)
+            layer_.codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        layer_.SetThreads(threads_);
+        if (!layer_.OpenCodec())
+        {
+            avcodec_free_context(&layer_.codec_ctx);
+            return false;
+        }
+
+        // 用编码参数替换原视频流的描述
+        std::shared_ptr<StreamInfoList> streams = std::make_shared<StreamInfoList>(*streams_);
+        StreamInfoPtr out = std::make_shared<StreamInfo>();
+        avcodec_parameters_from_context(out->codecpar, layer_.codec_ctx);
+        out->time_base = layer_.codec_ctx->time_base;
+        out->frame_rate = frame_rate;
+        (*streams)[layer_.index] = out;
+        for (auto &&held : held_)
+        {
+            if (held.IsStreams())
+                held = MediaBuffer::Streams(streams);
+        }
+        ReleaseHeld();
+        return true;
+    }
+
+    // frame为nullptr时冲刷编码器
+    void EncodeFrame(AVFrame *frame)
+    {
+        if (frame)
+        {
+            if (frame->pts != AV_NOPTS_VALUE)
+                frame->pts = av_rescale_q(frame->pts, frame->time_base, layer_.codec_ctx->time_base);
+            frame->time_base = layer_.codec_ctx->time_base;
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+        }
+        layer_.Encode(frame, pkt_, [this](AVPacket *pkt) {
+            pkt->stream_index = layer_.index;
+            pkt->time_base = layer_.codec_ctx->time_base;
+            Deliver(MediaBuffer::MovePacket(pkt));
+            return true;
+        });
+    }
+
+private:
+    std::string encoder_;
+    bool global_header_{false};
+    int threads_{0};
+    CodecLayer layer_;
+    StreamInfoListPtr streams_;
+    std::deque<MediaBuffer> held_;
+    AVPacket *pkt_{nullptr};
+    bool opened_{false};
+    bool eof_seen_{false};
+};
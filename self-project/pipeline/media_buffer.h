@@ -0,0 +1,187 @@
+#pragma once
+#include <memory>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include "libavcodec/avcodec.h"
+#include "libavutil/frame.h"
+#ifdef __cplusplus
+}
+#endif
+#include "../media_pool.h"
+
+// 释放时回到共享池，下一个MediaBuffer直接复用
+struct AVPacketDeleter
+{
+    void operator()(AVPacket *pkt) const
+    {
+        SharedPacketPool().Put(pkt);
+    }
+};
+
+struct AVFrameDeleter
+{
+    void operator()(AVFrame *frame) const
+    {
+        SharedFramePool().Put(frame);
+    }
+};
+
+using PacketPtr = std::unique_ptr<AVPacket, AVPacketDeleter>;
+using FramePtr = std::unique_ptr<AVFrame, AVFrameDeleter>;
+
+// 单个流的参数，源插件在第一个包之前发出，下游据此创建解码器或者输出流
+struct StreamInfo
+{
+    StreamInfo() : codecpar(avcodec_parameters_alloc()) {}
+    ~StreamInfo()
+    {
+        avcodec_parameters_free(&codecpar);
+    }
+    StreamInfo(const StreamInfo &) = delete;
+    StreamInfo &operator=(const StreamInfo &) = delete;
+
+    AVCodecParameters *codecpar;
+    AVRational time_base{0, 1};
+    AVRational frame_rate{0, 1};
+};
+using StreamInfoPtr = std::shared_ptr<StreamInfo>;
+// 下标与AVPacket.stream_index对应
+using StreamInfoList = std::vector<StreamInfoPtr>;
+using StreamInfoListPtr = std::shared_ptr<const StreamInfoList>;
+
+// 插件之间流转的数据单元，只持有AVPacket/AVFrame的引用计数句柄，负载本身不拷贝
+class MediaBuffer
+{
+public:
+    MediaBuffer() = default;
+    explicit MediaBuffer(PacketPtr pkt) : pkt_(std::move(pkt)) {}
+    explicit MediaBuffer(FramePtr frame) : frame_(std::move(frame)) {}
+
+    MediaBuffer(MediaBuffer &&other)
+        : pkt_(std::move(other.pkt_)), frame_(std::move(other.frame_)),
+          streams_(std::move(other.streams_)), eof_(other.eof_), enqueue_ns_(other.enqueue_ns_)
+    {
+        other.eof_ = false;
+    }
+    MediaBuffer &operator=(MediaBuffer &&other)
+    {
+        pkt_ = std::move(other.pkt_);
+        frame_ = std::move(other.frame_);
+        streams_ = std::move(other.streams_);
+        eof_ = other.eof_;
+        enqueue_ns_ = other.enqueue_ns_;
+        other.eof_ = false;
+        return *this;
+    }
+    MediaBuffer(const MediaBuffer &) = delete;
+    MediaBuffer &operator=(const MediaBuffer &) = delete;
+
+    // 接管src中的引用，src被重置为空包
+    static MediaBuffer MovePacket(AVPacket *src)
+    {
+        PacketPtr pkt(SharedPacketPool().Get());
+        if (!pkt)
+            return MediaBuffer();
+        av_packet_move_ref(pkt.get(), src);
+        return MediaBuffer(std::move(pkt));
+    }
+
+    static MediaBuffer MoveFrame(AVFrame *src)
+    {
+        FramePtr frame(SharedFramePool().Get());
+        if (!frame)
+            return MediaBuffer();
+        av_frame_move_ref(frame.get(), src);
+        return MediaBuffer(std::move(frame));
+    }
+
+    // 流结束标记，不带数据
+    static MediaBuffer Eof()
+    {
+        MediaBuffer buf;
+        buf.eof_ = true;
+        return buf;
+    }
+
+    // 流参数描述
+    static MediaBuffer Streams(StreamInfoListPtr streams)
+    {
+        MediaBuffer buf;
+        buf.streams_ = std::move(streams);
+        return buf;
+    }
+
+    // 新建一个共享同一块负载的引用，用于一份数据交给多个下游
+    MediaBuffer Ref() const
+    {
+        if (pkt_)
+        {
+            PacketPtr pkt(SharedPacketPool().Get());
+            if (!pkt || av_packet_ref(pkt.get(), pkt_.get()) < 0)
+                return MediaBuffer();
+            return MediaBuffer(std::move(pkt));
+        }
+        if (frame_)
+        {
+            FramePtr frame(SharedFramePool().Get());
+            if (!frame || av_frame_ref(frame.get(), frame_.get()) < 0)
+                return MediaBuffer();
+            return MediaBuffer(std::move(frame));
+        }
+        if (streams_)
+            return Streams(streams_);
+        return eof_ ? Eof() : MediaBuffer();
+    }
+
+    bool IsPacket() const { return pkt_ != nullptr; }
+    bool IsFrame() const { return frame_ != nullptr; }
+    bool IsEof() const { return eof_; }
+    bool IsStreams() const { return streams_ != nullptr; }
+    bool Empty() const { return !pkt_ && !frame_ && !streams_ && !eof_; }
+
+    AVPacket *packet() const { return pkt_.get(); }
+    AVFrame *frame() const { return frame_.get(); }
+    const StreamInfoListPtr &streams() const { return streams_; }
+
+    // 负载字节数，用于队列统计
+    size_t Size() const
+    {
+        if (pkt_)
+            return pkt_->size > 0 ? static_cast<size_t>(pkt_->size) : 0;
+        if (frame_)
+        {
+            size_t size = 0;
+            for (int i = 0; i < AV_NUM_DATA_POINTERS && frame_->buf[i]; ++i)
+                size += frame_->buf[i]->size;
+            return size;
+        }
+        return 0;
+    }
+
+    // 入队时间，只在打开插件统计时填写
+    int64_t EnqueueTime() const { return enqueue_ns_; }
+    void SetEnqueueTime(int64_t ns) { enqueue_ns_ = ns; }
+
+    void Reset()
+    {
+        pkt_.reset();
+        frame_.reset();
+        streams_.reset();
+        eof_ = false;
+        enqueue_ns_ = 0;
+    }
+
+private:
+    PacketPtr pkt_;
+    FramePtr frame_;
+    StreamInfoListPtr streams_;
+    bool eof_{false};
+    int64_t enqueue_ns_{0};
+};
@@ -1,26 +1,255 @@
 #include <unistd.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
 #include "thread_poll.h"
 #include "plugin.h"
+#include "codec_plugin.h"
+#include "tee_plugin.h"
+#include "ts_analyzer_plugin.h"
+#include "pipeline_manager.h"
+
+static constexpr char usage_string[] = "usage:\n"
+                                       "    ./pipeline [-t threads] [-c cpu_budget] [-n copies] [-f format] [-o output_dir] [-v encoder [-s filter | -l ladder]] [-m metrics_file [-p period_ms]] input...\n"
+                                       "    ./pipeline [-t threads] [-o output_dir] [-m metrics_file [-p period_ms]] -a window_ms input...\n"
+                                       "-t worker thread count shared by all pipelines\n"
+                                       "-c cores each pipeline may use, 0 means unlimited\n"
+                                       "-n how many pipelines to create for every input\n"
+                                       "-f output format, mpegts/flv/mp4, default mpegts\n"
+                                       "-o directory for outputs, outputs are dropped if not set\n"
+                                       "-v transcode video with this encoder(libx264...), copy if not set\n"
+                                       "-s video filter applied before encoding, e.g. scale=1280:720\n"
+                                       "-l ABR ladder decoded once and encoded per rendition, e.g. 1280x720,854x480,640x360\n"
+                                       "-a analyze live TS inputs (PCR interval/accuracy, bitrate, CC errors) over this window,\n"
+                                       "   inputs are recorded unchanged to output_dir if set, results are printed every window\n"
+                                       "-m write per-stage counters, queue depths and latency histograms to this file every period,\n"
+                                       "   Prometheus text format if it ends with .prom, JSON otherwise\n"
+                                       "-p metrics period in ms, default 1000\n"
+                                       "\n";
+
+struct Options
+{
+    std::string format{"mpegts"};
+    std::string output_dir;
+    std::string encoder;
+    std::string filter;
+    std::vector<std::string> ladder;
+    int analyze_window_ms{0};
+    std::string metrics_file;
+    int metrics_period_ms{1000};
+};
+
+static std::vector<std::string> Split(const std::string &str, char sep)
+{
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (begin <= str.size())
+    {
+        size_t end = str.find(sep, begin);
+        if (end == std::string::npos)
+            end = str.size();
+        if (end > begin)
+            items.push_back(str.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return items;
+}
+
+// 建立 [filter ->] [encode ->] mux -> write 这一段，返回这一段的第一个插件
+static Plugin *BuildOutput(Pipeline &pipeline, const Options &opt, const std::string &filter, const std::string &name)
+{
+    MuxPlugin *mux = pipeline.Emplace<MuxPlugin>();
+    WritePlugin *writer = pipeline.Emplace<WritePlugin>();
+    std::string output;
+    if (!opt.output_dir.empty())
+        output = opt.output_dir + "/" + name + "." + (opt.format == "mpegts" ? "ts" : opt.format);
+    if (!mux->Init(writer, opt.format) || !writer->Init(nullptr, output))
+        return nullptr;
+    if (opt.encoder.empty())
+        return mux;
+
+    EncodePlugin *encode = pipeline.Emplace<EncodePlugin>();
+    if (!encode->Init(mux, opt.encoder, opt.format != "mpegts"))
+        return nullptr;
+    if (filter.empty())
+        return encode;
+    FilterPlugin *scale = pipeline.Emplace<FilterPlugin>();
+    return scale->Init(encode, filter) ? scale : nullptr;
+}
+
+// read -> analyze -> write，数据只经过一次，分析插件只读不改
+static TsAnalyzerPlugin *BuildAnalyzer(Pipeline &pipeline, const Options &opt, const std::string &input)
+{
+    ReadPlugin *reader = pipeline.Emplace<ReadPlugin>();
+    TsAnalyzerPlugin *analyzer = pipeline.Emplace<TsAnalyzerPlugin>();
+    WritePlugin *writer = pipeline.Emplace<WritePlugin>();
+    std::string output;
+    if (!opt.output_dir.empty())
+        output = opt.output_dir + "/" + pipeline.name() + ".ts";
+    if (!writer->Init(nullptr, output) || !analyzer->Init(writer, opt.analyze_window_ms) || !reader->Init(analyzer, input))
+        return nullptr;
+    return analyzer;
+}
+
+static void PrintAnalysis(const std::string &name, const TsAnalyzerPlugin &analyzer)
+{
+    TsAnalyzerSnapshot snap;
+    if (!analyzer.Snapshot(&snap))
+        return;
+    printf("[%s] t=%.3fs window=%ums pcr_pid=%d total=%.1fkbit/s packets=%lu sync_loss=%lu cc_err=%lu\n",
+           name.c_str(), snap.stream_time_ms / 1000.0, snap.window_ms, snap.pcr_pid, snap.total_bitrate / 1000.0,
+           static_cast<unsigned long>(snap.packets), static_cast<unsigned long>(snap.sync_losses),
+           static_cast<unsigned long>(snap.cc_errors));
+    for (uint32_t i = 0; i < snap.pid_count; ++i)
+    {
+        const TsPidWindow &pid = snap.pids[i];
+        printf("    pid %5u %10.1fkbit/s cc_err %u/%lu", pid.pid, pid.bitrate / 1000.0, pid.cc_errors,
+               static_cast<unsigned long>(pid.cc_errors_total));
+        if (pid.has_pcr)
+            printf(" pcr_interval_max %.3fms pcr_ac_max %dns", pid.max_pcr_interval_us / 1000.0, pid.max_pcr_accuracy_ns);
+        printf("\n");
+    }
+}
+
+static bool BuildPipeline(Pipeline &pipeline, const Options &opt, const std::string &input)
+{
+    DemuxPlugin *demux = pipeline.Emplace<DemuxPlugin>();
+    if (opt.encoder.empty())
+    {
+        Plugin *head = BuildOutput(pipeline, opt, "", pipeline.name());
+        return head && demux->Init(head, input);
+    }
+
+    // 解码、滤镜、编码各自是独立调度的任务，可以跑在不同的核上
+    DecodePlugin *decode = pipeline.Emplace<DecodePlugin>();
+    if (opt.ladder.empty())
+    {
+        Plugin *head = BuildOutput(pipeline, opt, opt.filter, pipeline.name());
+        return head && decode->Init(head) && demux->Init(decode, input);
+    }
+
+    // 只解码一次，每一档各自缩放编码
+    std::vector<Plugin *> branches;
+    for (auto &&size : opt.ladder)
+    {
+        std::string filter = "scale=" + size.substr(0, size.find('x')) + ":" + size.substr(size.find('x') + 1);
+        Plugin *head = BuildOutput(pipeline, opt, filter, pipeline.name() + "_" + size);
+        if (!head)
+            return false;
+        branches.push_back(head);
+    }
+    TeePlugin *tee = pipeline.Emplace<TeePlugin>();
+    return tee->Init(branches) && decode->Init(tee) && demux->Init(decode, input);
+}
 
 int 
-main()
+main(int argc, char **argv)
 {
-    ThreadPoll::Instance().Start(4);
-    DemuxPlugin demux;
-    MuxPlugin mux;
+    int threads = 4;
+    int copies = 1;
+    double cpu_budget = 0;
+    Options opt;
+    int ret;
+    while ((ret = getopt(argc, argv, "t:c:n:f:o:v:s:l:a:m:p:h")) != -1)
+    {
+        switch (ret)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            cpu_budget = atof(optarg);
+            break;
+        case 'n':
+            copies = atoi(optarg);
+            break;
+        case 'f':
+            opt.format = optarg;
+            break;
+        case 'o':
+            opt.output_dir = optarg;
+            break;
+        case 'v':
+            opt.encoder = optarg;
+            break;
+        case 's':
+            opt.filter = optarg;
+            break;
+        case 'l':
+            opt.ladder = Split(optarg, ',');
+            break;
+        case 'a':
+            opt.analyze_window_ms = atoi(optarg);
+            break;
+        case 'm':
+            opt.metrics_file = optarg;
+            break;
+        case 'p':
+            opt.metrics_period_ms = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            printf(usage_string);
+            return 0;
+        }
+    }
+    std::vector<std::string> inputs(argv + optind, argv + argc);
+    if (inputs.empty())
+        inputs.push_back("./data/avc_720p_aac_4m_bmw.mp4");
 
-    demux.Init(&mux, "./data/avc_720p_aac_4m_bmw.mp4");
-    mux.Init(nullptr, "");
+    ThreadPoll::Instance().Start(threads);
+    PipelineManager manager(ThreadPoll::Instance());
+    std::vector<std::pair<std::string, TsAnalyzerPlugin *>> analyzers;
+    MetricsRegistry metrics;
+    MetricsExporter exporter;
 
-    ThreadPoll::Instance().AddTask([&demux]() -> bool{
-        return demux.Run();
-    });
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        for (int n = 0; n < copies; ++n)
+        {
+            std::string name = std::to_string(i) + "-" + std::to_string(n);
+            PipelinePtr pipeline = manager.Create(name, cpu_budget);
+            bool ok;
+            if (opt.analyze_window_ms > 0)
+            {
+                TsAnalyzerPlugin *analyzer = BuildAnalyzer(*pipeline, opt, inputs[i]);
+                if ((ok = analyzer != nullptr))
+                    analyzers.emplace_back(name, analyzer);
+            }
+            else
+                ok = BuildPipeline(*pipeline, opt, inputs[i]);
+            if (!ok)
+            {
+                manager.Destroy(name);
+                continue;
+            }
+            if (!opt.metrics_file.empty())
+                pipeline->EnableMetrics(metrics);
+            pipeline->Start();
+        }
+    }
 
-    ThreadPoll::Instance().AddTask([&mux]() -> bool{
-        return mux.Run();
-    });
+    if (!opt.metrics_file.empty())
+        exporter.Start(metrics, opt.metrics_file, opt.metrics_period_ms);
 
-    std::this_thread::sleep_for(std::chrono::seconds(5));
+    if (analyzers.empty())
+        manager.WaitAllFinished(std::chrono::hours(24));
+    else
+    {
+        // 快照随时可读，打印不会拖慢分析
+        const std::chrono::milliseconds interval(opt.analyze_window_ms);
+        while (!manager.WaitAllFinished(interval))
+        {
+            for (auto &&it : analyzers)
+                PrintAnalysis(it.first, *it.second);
+        }
+        for (auto &&it : analyzers)
+            PrintAnalysis(it.first, *it.second);
+    }
+    analyzers.clear();
+    // 先停导出器，最后一次写出的是跑完时的数据
+    exporter.Stop();
+    manager.DestroyAll();
 
     ThreadPoll::Instance().Stop();
-}
\ No newline at end of file
+}
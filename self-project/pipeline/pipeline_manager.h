@@ -0,0 +1,235 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include "thread_poll.h"
+#include "plugin.h"
+
+// 一条独立的插件链，所有插件由Pipeline持有，调度任务属于同一个TaskGroup
+class Pipeline
+{
+public:
+    // cpu_budget为可占用的核数，比如0.5表示每个调度周期最多占半个worker，<=0不限制
+    Pipeline(ThreadPoll &pool, const std::string &name, double cpu_budget = 0)
+        : pool_(pool), name_(name)
+    {
+        const int64_t period = TaskGroup::kDefaultPeriodNs;
+        group_ = std::make_shared<TaskGroup>(static_cast<int64_t>(cpu_budget * period), period);
+    }
+
+    ~Pipeline()
+    {
+        Stop();
+    }
+
+    Pipeline(const Pipeline &) = delete;
+    Pipeline &operator=(const Pipeline &) = delete;
+
+    // 插件由调用者Init，Start之前加入
+    template <typename T>
+    T *Emplace()
+    {
+        T *plugin = new T;
+        plugins_.emplace_back(plugin);
+        return plugin;
+    }
+
+    bool Start()
+    {
+        if (running_ || plugins_.empty())
+            return false;
+        for (auto &&plugin : plugins_)
+        {
+            plugin->SetFinishedCallback([this]() {
+                std::lock_guard<std::mutex> lkg(mu_);
+                cv_.notify_all();
+            });
+            tasks_.push_back(BindTask(pool_, plugin.get(), group_));
+        }
+        running_ = true;
+        for (auto &&task : tasks_)
+            pool_.Wake(task);
+        return true;
+    }
+
+    // 源插件停止读取，已经排队的数据继续流到末端，全部结束或超时后返回
+    bool Drain(std::chrono::milliseconds timeout)
+    {
+        for (auto &&plugin : plugins_)
+        {
+            if (plugin->IsSource())
+                plugin->RequestStop();
+        }
+        return WaitFinished(timeout);
+    }
+
+    // 等待所有插件处理完流结束标记
+    bool WaitFinished(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> ulk(mu_);
+        return cv_.wait_for(ulk, timeout, [this]() { return Finished(); });
+    }
+
+    bool Finished() const
+    {
+        for (auto &&plugin : plugins_)
+        {
+            if (!plugin->Finished())
+                return false;
+        }
+        return true;
+    }
+
+    // 各插件的阶段指标登记到registry，插件Init之后、Start之前调用
+    // 队列深度是导出时回调插件取的，导出器要在pipeline销毁之前停止
+    void EnableMetrics(MetricsRegistry &registry)
+    {
+        for (auto &&plugin : plugins_)
+        {
+            Plugin *p = plugin.get();
+            std::function<size_t()> depth;
+            if (!p->IsSource())
+                depth = [p]() { return p->QueueSize(); };
+            p->SetMetrics(registry.Stage(name_, p->StageName(), std::move(depth)));
+        }
+    }
+
+    // 从调度器上摘下，返回后插件不会再被运行，可以安全销毁
+    void Stop()
+    {
+        for (auto &&task : tasks_)
+            pool_.RemoveTask(task);
+        tasks_.clear();
+        running_ = false;
+    }
+
+    const std::string &name() const
+    {
+        return name_;
+    }
+
+    // 累计在worker上运行的时长
+    std::chrono::nanoseconds CpuTime() const
+    {
+        return std::chrono::nanoseconds(group_->total_ns.load());
+    }
+
+private:
+    ThreadPoll &pool_;
+    std::string name_;
+    TaskGroupPtr group_;
+    std::vector<std::unique_ptr<Plugin>> plugins_;
+    std::vector<TaskPtr> tasks_;
+    bool running_{false};
+    std::mutex mu_;
+    std::condition_variable cv_;
+};
+using PipelinePtr = std::shared_ptr<Pipeline>;
+
+// 多条pipeline共享一个worker池
+class PipelineManager
+{
+public:
+    explicit PipelineManager(ThreadPoll &pool = ThreadPoll::Instance()) : pool_(pool) {}
+
+    ~PipelineManager()
+    {
+        DestroyAll();
+    }
+
+    PipelinePtr Create(const std::string &name, double cpu_budget = 0)
+    {
+        std::lock_guard<std::mutex> lkg(mu_);
+        if (pipelines_.count(name))
+            return nullptr;
+        PipelinePtr pipeline = std::make_shared<Pipeline>(pool_, name, cpu_budget);
+        pipelines_[name] = pipeline;
+        return pipeline;
+    }
+
+    PipelinePtr Get(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lkg(mu_);
+        auto it = pipelines_.find(name);
+        return it == pipelines_.end() ? nullptr : it->second;
+    }
+
+    bool Destroy(const std::string &name)
+    {
+        PipelinePtr pipeline;
+        {
+            std::lock_guard<std::mutex> lkg(mu_);
+            auto it = pipelines_.find(name);
+            if (it == pipelines_.end())
+                return false;
+            pipeline = it->second;
+            pipelines_.erase(it);
+        }
+        pipeline->Stop();
+        return true;
+    }
+
+    // 所有pipeline同时开始排空，超时以所有pipeline共用的截止时间计算
+    bool DrainAll(std::chrono::milliseconds timeout)
+    {
+        std::vector<PipelinePtr> all = Snapshot();
+        for (auto &&pipeline : all)
+        {
+            pipeline->Drain(std::chrono::milliseconds(0));
+        }
+        return WaitAll(all, timeout);
+    }
+
+    bool WaitAllFinished(std::chrono::milliseconds timeout)
+    {
+        return WaitAll(Snapshot(), timeout);
+    }
+
+    void DestroyAll()
+    {
+        std::map<std::string, PipelinePtr> all;
+        {
+            std::lock_guard<std::mutex> lkg(mu_);
+            all.swap(pipelines_);
+        }
+        for (auto &&it : all)
+            it.second->Stop();
+    }
+
+    size_t Size()
+    {
+        std::lock_guard<std::mutex> lkg(mu_);
+        return pipelines_.size();
+    }
+
+private:
+    std::vector<PipelinePtr> Snapshot()
+    {
+        std::vector<PipelinePtr> all;
+        std::lock_guard<std::mutex> lkg(mu_);
+        for (auto &&it : pipelines_)
+            all.push_back(it.second);
+        return all;
+    }
+
+    static bool WaitAll(const std::vector<PipelinePtr> &all, std::chrono::milliseconds timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (auto &&pipeline : all)
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (!pipeline->WaitFinished(std::max(left, std::chrono::milliseconds(0))))
+                return false;
+        }
+        return true;
+    }
+
+    ThreadPoll &pool_;
+    std::map<std::string, PipelinePtr> pipelines_;
+    std::mutex mu_;
+};
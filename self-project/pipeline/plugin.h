@@ -1,12 +1,18 @@
 #pragma once
-#include <vector>
 #include <memory>
-#include <mutex>
-#include <deque>
-#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
 #include <iostream>
-#include <unistd.h>
+#include <string>
+#include <vector>
+#include <deque>
 #include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -17,19 +23,45 @@ extern "C"
 #ifdef __cplusplus
 }
 #endif
-
-using ByteBuffer = std::vector<uint8_t>;
+#include "media_buffer.h"
+#include "spsc_queue.h"
+#include "../metrics.h"
+#include "thread_poll.h"
 
 class Plugin;
 using PluginPtr = std::shared_ptr<Plugin>;
 
-using ExecutionState = bool;
-constexpr bool kBusying = true;
-constexpr bool kIdle = false;
+// 单条链路的水位线，超过高水位后上游停止产出，降到低水位以下才恢复
+struct QueueLimits
+{
+    size_t high_packets{768};
+    size_t low_packets{256};
+    size_t high_bytes{32 * 1024 * 1024};
+    size_t low_bytes{8 * 1024 * 1024};
+};
+
+// 单个插件的运行统计，压测时打开，只由插件所在的任务写
+struct StageStats
+{
+    std::vector<int64_t> wait_ns;   // 数据单元在本插件队列中的等待时长
+    std::vector<int64_t> run_ns;    // 每次Run的耗时
+    uint64_t packets{0};
+    uint64_t frames{0};
+    uint64_t bytes{0};
+
+    void Clear()
+    {
+        wait_ns.clear();
+        run_ns.clear();
+        packets = frames = bytes = 0;
+    }
+};
 
 class Plugin
 {
 public:
+    static constexpr size_t kDefaultQueueCapacity = 1024;
+
     virtual ~Plugin()
     {
         Deinit();
@@ -38,44 +70,302 @@ public:
     virtual bool Init(Plugin *next = nullptr)
     {
         next_ = next;
+        if (next_)
+            next_->prev_ = this;
+        finished_.store(false);
+        stop_requested_.store(false);
+        buf_queue_.Reset(queue_capacity_);
+        queued_bytes_.store(0, std::memory_order_relaxed);
+        congested_.store(false, std::memory_order_relaxed);
         return true;
     }
 
     virtual void Deinit()
     {
         next_ = nullptr;
-        buf_list_.clear();
+        pending_.clear();
+        MediaBuffer buf;
+        while (buf_queue_.Pop(buf))
+            buf.Reset();
+        queued_bytes_.store(0, std::memory_order_relaxed);
     }
 
     virtual ExecutionState Run() = 0;
 
-    void Enqueue(ByteBuffer &&buf)
+    // 调度器调用的入口，打开统计时记录Run的耗时，指标只记真正处理了数据的Run
+    ExecutionState Step()
+    {
+        if (!stats_enabled_ && !metrics_)
+            return Run();
+        const int64_t begin = NowNs();
+        ExecutionState ret = Run();
+        const int64_t cost = NowNs() - begin;
+        if (stats_enabled_)
+            stats_.run_ns.push_back(cost);
+        if (metrics_ && ret == kBusying)
+            metrics_->run_ns.Record(cost);
+        return ret;
+    }
+
+    // 阶段名，导出指标时使用
+    virtual const char *StageName() const
+    {
+        return "plugin";
+    }
+
+    // 需在插件开始运行之前设置，metrics由MetricsRegistry持有，要比插件活得久
+    void SetMetrics(StageMetrics *metrics)
+    {
+        metrics_ = metrics;
+    }
+
+    // 需在插件开始运行之前设置
+    void EnableStats(bool enable)
+    {
+        stats_enabled_ = enable;
+        stats_.Clear();
+    }
+
+    // 插件结束或者从调度器摘下之后读取
+    const StageStats &Stats() const
+    {
+        return stats_;
+    }
+
+    // 需在Init之前设置，容量会向上取整为2的幂
+    void SetQueueCapacity(size_t capacity)
+    {
+        queue_capacity_ = capacity;
+    }
+
+    // 需在Init之前设置，高水位不会超过队列容量
+    void SetQueueLimits(const QueueLimits &limits)
     {
+        limits_ = limits;
+        if (limits_.low_packets > limits_.high_packets)
+            limits_.low_packets = limits_.high_packets;
+        if (limits_.low_bytes > limits_.high_bytes)
+            limits_.low_bytes = limits_.high_bytes;
+    }
+
+    // 关闭后Dequeue不再等待，队列为空时立即返回
+    void SetWaitOnEmpty(bool wait)
+    {
+        wait_on_empty_ = wait;
+    }
+
+    // 由调度器设置：有新数据或者下游拥塞解除时用来唤醒该插件
+    void SetWaker(std::function<void()> waker)
+    {
+        waker_ = std::move(waker);
+    }
+
+    void Wake()
+    {
+        if (waker_)
+            waker_();
+    }
+
+    // 没有上游的插件自己产生数据
+    bool IsSource() const
+    {
+        return prev_ == nullptr;
+    }
+
+    // 已经处理完流结束标记
+    bool Finished() const
+    {
+        return finished_.load();
+    }
+
+    void SetFinishedCallback(std::function<void()> cb)
+    {
+        on_finished_ = std::move(cb);
+    }
+
+    // 要求源插件像读到文件尾一样收尾，下游处理完已排队的数据后依次结束
+    void RequestStop()
+    {
+        stop_requested_.store(true);
+        Wake();
+    }
+
+    // 只允许上游一个线程调用，队列满时返回false且buf保持不变
+    bool Enqueue(MediaBuffer &&buf)
+    {
+        const size_t size = buf.Size();
+        if (stats_enabled_ || metrics_)
+            buf.SetEnqueueTime(NowNs());
+        queued_bytes_.fetch_add(size, std::memory_order_relaxed);
+        if (!buf_queue_.Push(std::move(buf)))
         {
-            std::lock_guard<std::mutex> lkg(mu_);
-            buf_list_.emplace_back(std::move(buf));
+            queued_bytes_.fetch_sub(size, std::memory_order_relaxed);
+            congested_.store(true);
+            return false;
         }
-        cv_.notify_one();
+        notifier_.Notify();
+        Wake();
+        return true;
     }
 
-protected:
-    bool Dequeue(ByteBuffer &buf)
+    // 由上游在产出新数据之前调用，带滞回：超过高水位进入拥塞，降到低水位以下才解除
+    // 置位后再检查一次低水位，与Dequeue中的检查配对，保证上游不会在队列已空时睡死
+    bool Congested()
     {
-        std::unique_lock<std::mutex> ulk(mu_);
-        cv_.wait_for(ulk, std::chrono::milliseconds(1), [this](){return !buf_list_.empty();});
-        if (buf_list_.empty())
+        if (!congested_.load(std::memory_order_relaxed))
+        {
+            const size_t high_packets = std::min(limits_.high_packets, buf_queue_.Capacity());
+            if (buf_queue_.Size() < high_packets &&
+                queued_bytes_.load(std::memory_order_relaxed) < limits_.high_bytes)
+                return false;
+            congested_.store(true);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (BelowLowWater())
+        {
+            congested_.store(false);
             return false;
-        buf.swap(buf_list_.front());
-        buf_list_.pop_front();
+        }
+        return true;
+    }
+
+    size_t QueueSize() const
+    {
+        return buf_queue_.Size();
+    }
+
+    size_t QueueBytes() const
+    {
+        return queued_bytes_.load(std::memory_order_relaxed);
+    }
+
+protected:
+    bool Dequeue(MediaBuffer &buf)
+    {
+        if (!buf_queue_.Pop(buf))
+        {
+            if (!wait_on_empty_)
+                return false;
+            notifier_.WaitFor([this]() { return !buf_queue_.Empty(); }, std::chrono::milliseconds(1));
+            if (!buf_queue_.Pop(buf))
+                return false;
+        }
+        queued_bytes_.fetch_sub(buf.Size(), std::memory_order_relaxed);
+        if (stats_enabled_ || metrics_)
+            Account(buf);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (prev_ && congested_.load(std::memory_order_relaxed) && BelowLowWater())
+            prev_->Wake();
         return true;
     }
 
-    std::mutex mu_;
-    std::condition_variable cv_;
-    std::deque<ByteBuffer> buf_list_;
+    // 交给下游，下游队列满或者前面还有没送出去的数据时暂存在pending_，由FlushPending按序重试
+    void Deliver(MediaBuffer &&buf)
+    {
+        // 源插件没有输入队列，按产出计数
+        if (metrics_ && !prev_)
+            Count(buf);
+        if (!next_)
+        {
+            buf.Reset();
+            return;
+        }
+        if (!pending_.empty() || !next_->Enqueue(std::move(buf)))
+            pending_.emplace_back(std::move(buf));
+    }
+
+    bool FlushPending()
+    {
+        while (!pending_.empty())
+        {
+            if (!next_->Enqueue(std::move(pending_.front())))
+                return false;
+            pending_.pop_front();
+        }
+        return true;
+    }
+
+    // 下游送不进去时的返回值：确实拥塞就睡眠等唤醒，期间已被消化就继续跑
+    ExecutionState Backoff()
+    {
+        return (next_ && next_->Congested()) ? kBlocked : kBusying;
+    }
+
+    void Finish()
+    {
+        finished_.store(true);
+        if (on_finished_)
+            on_finished_();
+    }
+
+    // 一个上游对应多个下游时(比如分叉插件)由上游为每个下游登记自己
+    static void Link(Plugin *from, Plugin *to)
+    {
+        to->prev_ = from;
+    }
+
+    void Account(const MediaBuffer &buf)
+    {
+        if (metrics_)
+        {
+            if (buf.EnqueueTime())
+                metrics_->wait_ns.Record(NowNs() - buf.EnqueueTime());
+            Count(buf);
+        }
+        if (!stats_enabled_)
+            return;
+        if (buf.EnqueueTime())
+            stats_.wait_ns.push_back(NowNs() - buf.EnqueueTime());
+        stats_.packets += buf.IsPacket();
+        stats_.frames += buf.IsFrame();
+        stats_.bytes += buf.Size();
+    }
+
+    void Count(const MediaBuffer &buf)
+    {
+        MetricsAdd(metrics_->packets, buf.IsPacket());
+        MetricsAdd(metrics_->frames, buf.IsFrame());
+        MetricsAdd(metrics_->bytes, buf.Size());
+    }
+
+    bool BelowLowWater() const
+    {
+        return buf_queue_.Size() <= limits_.low_packets &&
+               queued_bytes_.load(std::memory_order_relaxed) <= limits_.low_bytes;
+    }
+
+    SpscQueue<MediaBuffer> buf_queue_;
+    EventNotifier notifier_;
+    std::atomic<size_t> queued_bytes_{0};
+    std::atomic<bool> congested_{false};
+    QueueLimits limits_;
+    size_t queue_capacity_{kDefaultQueueCapacity};
+    bool wait_on_empty_{true};
+    std::function<void()> waker_;
+    std::function<void()> on_finished_;
+    std::atomic<bool> finished_{false};
+    std::atomic<bool> stop_requested_{false};
+    std::deque<MediaBuffer> pending_;
+    bool stats_enabled_{false};
+    StageStats stats_;
+    StageMetrics *metrics_{nullptr};
     Plugin *next_{nullptr};
+    Plugin *prev_{nullptr};
 };
 
+// 把插件挂到调度器上，任务先不运行；整条链都绑定完成后再用ThreadPoll::Wake启动
+inline TaskPtr BindTask(ThreadPoll &pool, Plugin *plugin, TaskGroupPtr group = nullptr)
+{
+    TaskPtr task = pool.CreateTask([plugin]() { return plugin->Step(); }, std::move(group));
+    std::weak_ptr<Task> weak = task;
+    plugin->SetWaitOnEmpty(false);
+    plugin->SetWaker([&pool, weak]() {
+        if (TaskPtr t = weak.lock())
+            pool.Wake(t);
+    });
+    return task;
+}
+
 class DemuxPlugin : public Plugin
 {
 private:
@@ -89,17 +379,28 @@ private:
 public:
     ~DemuxPlugin() override
     {
+        Deinit();
+    }
 
+    const char *StageName() const override
+    {
+        return "demux";
     }
     bool Init(Plugin *next, const std::string &filename)
     {
         filename_ = filename;
         state_ = kInit;
+        if (!pkt_ && !(pkt_ = av_packet_alloc()))
+            return false;
         return Plugin::Init(next);
     }
     void Deinit() override
     {
-
+        if (fmt_ctx_)
+            avformat_close_input(&fmt_ctx_);
+        if (pkt_)
+            av_packet_free(&pkt_);
+        Plugin::Deinit();
     }
     ExecutionState Run() override
     {
@@ -109,92 +410,470 @@ public:
             if (0 != avformat_open_input(&fmt_ctx_, filename_.c_str(), NULL, NULL))
             {
                 std::cerr << "Could not open input file " << filename_ << std::endl;
-                return kIdle;
+                return EndOfStream();
             }
             if (0 != avformat_find_stream_info(fmt_ctx_, NULL))
             {
                 std::cerr << "Failed to retrieve input stream information" << std::endl;
-                return kIdle;
+                return EndOfStream();
             }
             av_dump_format(fmt_ctx_, 0, filename_.c_str(), 0);
+            Deliver(MediaBuffer::Streams(DescribeStreams()));
             state_ = kRead;
         }
             return kBusying;
         case kRead:{
+            // 下游队列满时先把上次没送出去的包送出去，送不出去就不再读
+            if(!FlushPending()){
+                return Backoff();
+            }
+            if(stop_requested_){
+                return EndOfStream();
+            }
+            if(next_ && next_->Congested()){
+                return kBlocked;
+            }
             int ret = 0;
-            if((ret = av_read_frame(fmt_ctx_, &pkt_)) != 0){
+            if((ret = av_read_frame(fmt_ctx_, pkt_)) != 0){
+                if(ret == AVERROR(EAGAIN)){
+                    return kBusying;
+                }
                 if(ret == AVERROR_EOF){
-                    std::cout << "read EOF" << std::endl;
-                    state_ = kEOF;
+                    std::cerr << "read EOF" << std::endl;
                 }
-                return kIdle;
-            }
-            buf_.resize(pkt_.size);
-            memcpy(buf_.data(), pkt_.data, pkt_.size);
-            if(next_){
-                next_->Enqueue(std::move(buf_));
+                return EndOfStream();
             }
+            // 时间戳按流的time_base带给下游，负载只转移引用
+            pkt_->time_base = fmt_ctx_->streams[pkt_->stream_index]->time_base;
+            Deliver(MediaBuffer::MovePacket(pkt_));
         }
             return kBusying;
         case kEOF:
         default:
+            if(!FlushPending()){
+                return Backoff();
+            }
+            if(!Finished()){
+                Finish();
+            }
             return kIdle;
         }
     }
 private:
+    StreamInfoListPtr DescribeStreams()
+    {
+        std::shared_ptr<StreamInfoList> streams = std::make_shared<StreamInfoList>();
+        for (unsigned int i = 0; i < fmt_ctx_->nb_streams; ++i)
+        {
+            AVStream *st = fmt_ctx_->streams[i];
+            StreamInfoPtr info = std::make_shared<StreamInfo>();
+            avcodec_parameters_copy(info->codecpar, st->codecpar);
+            info->time_base = st->time_base;
+            info->frame_rate = av_guess_frame_rate(fmt_ctx_, st, nullptr);
+            streams->push_back(info);
+        }
+        return streams;
+    }
+
+    ExecutionState EndOfStream()
+    {
+        state_ = kEOF;
+        Deliver(MediaBuffer::Eof());
+        return kBusying;
+    }
+
     std::string filename_;
     AVFormatContext *fmt_ctx_{nullptr};
-    AVPacket pkt_;
-    ByteBuffer buf_;
+    AVPacket *pkt_{nullptr};
+};
+
+// 不解封装，按原样读出输入的字节流(比如直播的TS)，每次读到多少就交给下游多少
+// 缓冲取自AVBufferPool，下游释放后回到池里给下一次读用
+class ReadPlugin : public Plugin
+{
+public:
+    static constexpr int kChunkSize = 188 * 7 * 64;
+
+    ~ReadPlugin() override
+    {
+        Deinit();
+    }
+
+    const char *StageName() const override
+    {
+        return "read";
+    }
+
+    bool Init(Plugin *next, const std::string &url)
+    {
+        url_ = url;
+        eof_seen_ = false;
+        if (!pool_ && !(pool_ = av_buffer_pool_init(kChunkSize + AV_INPUT_BUFFER_PADDING_SIZE, nullptr)))
+            return false;
+        return Plugin::Init(next);
+    }
+
+    void Deinit() override
+    {
+        if (pb_)
+            avio_closep(&pb_);
+        // 还在下游的缓冲释放时才真正回收
+        av_buffer_pool_uninit(&pool_);
+        Plugin::Deinit();
+    }
+
+    ExecutionState Run() override
+    {
+        if (!FlushPending())
+            return Backoff();
+        if (eof_seen_)
+        {
+            if (!Finished())
+                Finish();
+            return kIdle;
+        }
+        if (stop_requested_)
+            return EndOfStream();
+        if (next_ && next_->Congested())
+            return kBlocked;
+        if (!pb_ && avio_open2(&pb_, url_.c_str(), AVIO_FLAG_READ, nullptr, nullptr) < 0)
+        {
+            std::cerr << "Could not open input " << url_ << std::endl;
+            return EndOfStream();
+        }
+        AVBufferRef *ref = av_buffer_pool_get(pool_);
+        if (!ref)
+            return EndOfStream();
+        int ret = avio_read_partial(pb_, ref->data, kChunkSize);
+        if (ret <= 0)
+        {
+            av_buffer_unref(&ref);
+            if (ret == AVERROR(EAGAIN))
+                return kBusying;
+            if (ret == AVERROR_EOF || ret == 0)
+                std::cerr << "read EOF" << std::endl;
+            return EndOfStream();
+        }
+        PacketPtr pkt(SharedPacketPool().Get());
+        if (!pkt)
+        {
+            av_buffer_unref(&ref);
+            return EndOfStream();
+        }
+        pkt->buf = ref;
+        pkt->data = ref->data;
+        pkt->size = ret;
+        Deliver(MediaBuffer(std::move(pkt)));
+        return kBusying;
+    }
+
+private:
+    ExecutionState EndOfStream()
+    {
+        eof_seen_ = true;
+        Deliver(MediaBuffer::Eof());
+        return kBusying;
+    }
+
+    std::string url_;
+    AVIOContext *pb_{nullptr};
+    AVBufferPool *pool_{nullptr};
+    bool eof_seen_{false};
 };
 
 class MuxPlugin : public Plugin
 {
 public:
+    static constexpr int kIOBufferSize = 256 * 1024;
+
     ~MuxPlugin() override
     {
+        Deinit();
+    }
 
+    const char *StageName() const override
+    {
+        return "mux";
     }
 
+    // mux_mode为输出封装格式名，mpegts/flv/mp4，空则为mpegts
     bool Init(Plugin *next, const std::string &mux_mode)
     {
-        mux_mode_ = mux_mode;
-        Plugin::Init(next);
-        return true;
+        mux_mode_ = mux_mode.empty() ? "mpegts" : mux_mode;
+        eof_seen_ = false;
+        if (!pool_ && !(pool_ = av_buffer_pool_init(kIOBufferSize + AV_INPUT_BUFFER_PADDING_SIZE, nullptr)))
+            return false;
+        return Plugin::Init(next);
     }
 
     void Deinit() override
     {
-        
+        CloseOutput();
+        // 还在下游的缓冲释放时才真正回收
+        av_buffer_pool_uninit(&pool_);
+        Plugin::Deinit();
     }
 
     ExecutionState Run() override
     {
-        ByteBuffer buf;
-        if(Dequeue(buf)){
-            // std::cout << "read data size = " << buf.size() << std::endl;
-            return kBusying;
+        // 先把封装好的数据交给WritePlugin，交不出去就不再封装新的包
+        if(!FlushPending()){
+            return Backoff();
+        }
+        if(eof_seen_){
+            if(!Finished()){
+                Finish();
+            }
+            return kIdle;
+        }
+        if(next_ && next_->Congested()){
+            return kBlocked;
         }
-        return kIdle;
+        MediaBuffer buf;
+        if(!Dequeue(buf)){
+            return kIdle;
+        }
+        if(buf.IsStreams()){
+            if(!OpenOutput(*buf.streams())){
+                std::cerr << "Could not open " << mux_mode_ << " muxer" << std::endl;
+                CloseOutput();
+            }
+        }
+        else if(buf.IsPacket()){
+            WritePacket(buf.packet());
+        }
+        else if(buf.IsEof()){
+            if(fmt_ctx_){
+                av_write_trailer(fmt_ctx_);
+                avio_flush(fmt_ctx_->pb);
+            }
+            Deliver(MediaBuffer::Eof());
+            eof_seen_ = true;
+        }
+        return kBusying;
+    }
+
+private:
+    bool OpenOutput(const StreamInfoList &streams)
+    {
+        CloseOutput();
+        if(avformat_alloc_output_context2(&fmt_ctx_, nullptr, mux_mode_.c_str(), nullptr) < 0){
+            return false;
+        }
+        stream_map_.assign(streams.size(), -1);
+        stream_tb_.assign(streams.size(), AVRational{0, 1});
+        for(size_t i = 0; i < streams.size(); ++i){
+            const AVCodecParameters *par = streams[i]->codecpar;
+            if(par->codec_type != AVMEDIA_TYPE_VIDEO &&
+               par->codec_type != AVMEDIA_TYPE_AUDIO &&
+               par->codec_type != AVMEDIA_TYPE_SUBTITLE){
+                continue;
+            }
+            AVStream *st = avformat_new_stream(fmt_ctx_, nullptr);
+            if(!st || avcodec_parameters_copy(st->codecpar, par) < 0){
+                return false;
+            }
+            st->codecpar->codec_tag = 0;
+            st->time_base = streams[i]->time_base;
+            stream_map_[i] = st->index;
+            stream_tb_[i] = streams[i]->time_base;
+        }
+
+        // 不写文件，封装结果经write回调交给下游
+        uint8_t *io_buf = static_cast<uint8_t *>(av_malloc(kIOBufferSize));
+        if(!io_buf){
+            return false;
+        }
+        fmt_ctx_->pb = avio_alloc_context(io_buf, kIOBufferSize, 1, this, nullptr, &MuxPlugin::WriteCallback, nullptr);
+        if(!fmt_ctx_->pb){
+            av_free(io_buf);
+            return false;
+        }
+        fmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+        AVDictionary *opts = nullptr;
+        // 输出不可seek，mp4只能写成fragmented
+        if(!strcmp(fmt_ctx_->oformat->name, "mp4") || !strcmp(fmt_ctx_->oformat->name, "mov")){
+            av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        }
+        int ret = avformat_write_header(fmt_ctx_, &opts);
+        av_dict_free(&opts);
+        return ret >= 0;
+    }
+
+    void CloseOutput()
+    {
+        if(!fmt_ctx_){
+            return;
+        }
+        if(fmt_ctx_->pb){
+            av_freep(&fmt_ctx_->pb->buffer);
+            avio_context_free(&fmt_ctx_->pb);
+        }
+        avformat_free_context(fmt_ctx_);
+        fmt_ctx_ = nullptr;
+    }
+
+    void WritePacket(AVPacket *pkt)
+    {
+        if(!fmt_ctx_ || pkt->stream_index < 0 ||
+           pkt->stream_index >= static_cast<int>(stream_map_.size()) ||
+           stream_map_[pkt->stream_index] < 0){
+            return;
+        }
+        AVRational in_tb = pkt->time_base.num ? pkt->time_base : stream_tb_[pkt->stream_index];
+        pkt->stream_index = stream_map_[pkt->stream_index];
+        av_packet_rescale_ts(pkt, in_tb, fmt_ctx_->streams[pkt->stream_index]->time_base);
+        pkt->time_base = fmt_ctx_->streams[pkt->stream_index]->time_base;
+        pkt->pos = -1;
+        if(av_interleaved_write_frame(fmt_ctx_, pkt) < 0){
+            std::cerr << "Error muxing packet" << std::endl;
+        }
+    }
+
+    // 封装器每填满一次AVIO缓冲调用一次，这里拷贝到池里的缓冲交给WritePlugin
+    static int WriteCallback(void *opaque, uint8_t *buf, int size)
+    {
+        MuxPlugin *self = static_cast<MuxPlugin *>(opaque);
+        PacketPtr pkt(SharedPacketPool().Get());
+        if(!pkt){
+            return AVERROR(ENOMEM);
+        }
+        if(size <= kIOBufferSize){
+            if(!(pkt->buf = av_buffer_pool_get(self->pool_))){
+                return AVERROR(ENOMEM);
+            }
+            pkt->data = pkt->buf->data;
+            pkt->size = size;
+        }
+        else if(av_new_packet(pkt.get(), size) < 0){
+            return AVERROR(ENOMEM);
+        }
+        memcpy(pkt->data, buf, size);
+        self->Deliver(MediaBuffer(std::move(pkt)));
+        return size;
     }
 
 private:
     std::string mux_mode_;
+    AVFormatContext *fmt_ctx_{nullptr};
+    AVBufferPool *pool_{nullptr};
+    std::vector<int> stream_map_;
+    std::vector<AVRational> stream_tb_;
+    bool eof_seen_{false};
 };
 
 class WritePlugin : public Plugin
 {
 public:
+    static constexpr int kMaxBatch = 64;
+
     ~WritePlugin() override
     {
+        Deinit();
+    }
 
+    const char *StageName() const override
+    {
+        return "write";
     }
-    void Deinit() override
+
+    // path为空时丢弃所有数据
+    bool Init(Plugin *next, const std::string &path)
     {
+        CloseFile();
+        path_ = path;
+        eof_seen_ = false;
+        if(!path_.empty()){
+            fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(fd_ < 0){
+                std::cerr << "Could not open output file " << path_ << std::endl;
+                return false;
+            }
+        }
+        return Plugin::Init(next);
+    }
 
+    void Deinit() override
+    {
+        CloseFile();
+        batch_.clear();
+        Plugin::Deinit();
     }
+
+    // 一次取出队列中已有的多个缓冲，合并成一次writev
     ExecutionState Run() override
     {
-        return kIdle;
+        if(eof_seen_){
+            return kIdle;
+        }
+        batch_.clear();
+        MediaBuffer buf;
+        while(batch_.size() < kMaxBatch && Dequeue(buf)){
+            if(buf.IsEof()){
+                eof_seen_ = true;
+                break;
+            }
+            if(buf.IsPacket() && buf.packet()->size > 0){
+                batch_.emplace_back(std::move(buf));
+            }
+        }
+        if(!batch_.empty() && fd_ >= 0){
+            struct iovec iov[kMaxBatch];
+            int cnt = 0;
+            for(auto &&item : batch_){
+                iov[cnt].iov_base = item.packet()->data;
+                iov[cnt].iov_len = item.packet()->size;
+                ++cnt;
+            }
+            if(!WriteAll(iov, cnt)){
+                std::cerr << "Error writing " << path_ << ": " << strerror(errno) << std::endl;
+            }
+        }
+        batch_.clear();
+        if(eof_seen_){
+            CloseFile();
+            Finish();
+            return kIdle;
+        }
+        return buf_queue_.Empty() ? kIdle : kBusying;
+    }
+
+private:
+    bool WriteAll(struct iovec *iov, int cnt)
+    {
+        while(cnt > 0){
+            ssize_t n = writev(fd_, iov, cnt);
+            if(n < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                return false;
+            }
+            while(cnt > 0 && n >= static_cast<ssize_t>(iov->iov_len)){
+                n -= iov->iov_len;
+                ++iov;
+                --cnt;
+            }
+            if(cnt > 0){
+                iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + n;
+                iov->iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    void CloseFile()
+    {
+        if(fd_ >= 0){
+            close(fd_);
+            fd_ = -1;
+        }
     }
-};
\ No newline at end of file
+
+private:
+    std::string path_;
+    int fd_{-1};
+    std::vector<MediaBuffer> batch_;
+    bool eof_seen_{false};
+};
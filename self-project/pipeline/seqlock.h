@@ -0,0 +1,69 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// 单写者多读者的顺序锁，写者从不等待，读者遇到正在写就重读
+// 数据按8字节拆成原子字保存，读到一半被改写也不是数据竞争，序号对不上会丢弃重读
+template <typename T>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock only holds trivially copyable types");
+    static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+public:
+    SeqLock()
+    {
+        for (auto &&word : data_)
+            word.store(0, std::memory_order_relaxed);
+    }
+
+    SeqLock(const SeqLock &) = delete;
+    SeqLock &operator=(const SeqLock &) = delete;
+
+    // 只能由一个线程调用
+    void Store(const T &value)
+    {
+        uint64_t words[kWords] = {};
+        memcpy(words, &value, sizeof(T));
+        const uint64_t seq = seq_.load(std::memory_order_relaxed);
+        seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < kWords; ++i)
+            data_[i].store(words[i], std::memory_order_relaxed);
+        seq_.store(seq + 2, std::memory_order_release);
+    }
+
+    // 任意线程调用，还没有写过时返回false
+    bool Load(T *value) const
+    {
+        uint64_t words[kWords];
+        uint64_t begin, end;
+        do
+        {
+            begin = seq_.load(std::memory_order_acquire);
+            if (begin & 1)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            for (size_t i = 0; i < kWords; ++i)
+                words[i] = data_[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            end = seq_.load(std::memory_order_relaxed);
+            if (begin == end)
+                break;
+        } while (true);
+        if (begin == 0)
+            return false;
+        memcpy(value, words, sizeof(T));
+        return true;
+    }
+
+private:
+    std::atomic<uint64_t> seq_{0};
+    std::atomic<uint64_t> data_[kWords];
+};
@@ -0,0 +1,170 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+constexpr size_t kCacheLineSize = 64;
+
+// 有界单生产者单消费者无锁环形队列，容量向上取整为2的幂
+// Push只能由一个线程调用，Pop只能由另一个线程调用
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity = 1024)
+    {
+        Reset(capacity);
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // 非线程安全，只能在生产者和消费者都未运行时调用
+    void Reset(size_t capacity)
+    {
+        size_t cap = 2;
+        while (cap < capacity)
+            cap <<= 1;
+        slots_.clear();
+        slots_.resize(cap);
+        mask_ = cap - 1;
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+        cached_head_ = 0;
+        cached_tail_ = 0;
+    }
+
+    bool Push(T &&item)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ > mask_)
+        {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ > mask_)
+                return false;
+        }
+        slots_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T &item)
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_)
+        {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head == cached_tail_)
+                return false;
+        }
+        item = std::move(slots_[head & mask_]);
+        slots_[head & mask_] = T();
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 以下查询在并发下只是近似值
+    size_t Size() const
+    {
+        const size_t head = head_.load(std::memory_order_acquire);
+        const size_t tail = tail_.load(std::memory_order_acquire);
+        return tail - head;
+    }
+
+    bool Empty() const
+    {
+        return Size() == 0;
+    }
+
+    size_t Capacity() const
+    {
+        return mask_ + 1;
+    }
+
+private:
+    // 消费者改写head_，生产者改写tail_，中间用整条cache line填充隔开避免伪共享
+    // 用填充而不是alignas，插件对象在C++11下用普通new分配也能保证隔离
+    char pad0_[kCacheLineSize];
+    std::atomic<size_t> head_{0};
+    size_t cached_tail_{0};
+    char pad1_[kCacheLineSize];
+    std::atomic<size_t> tail_{0};
+    size_t cached_head_{0};
+    char pad2_[kCacheLineSize];
+    size_t mask_{0};
+    std::vector<T> slots_;
+};
+
+// 基于eventfd的唤醒器，只有消费者真正睡眠时生产者才会付出一次write系统调用
+class EventNotifier
+{
+public:
+    EventNotifier()
+    {
+        fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~EventNotifier()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    EventNotifier(const EventNotifier &) = delete;
+    EventNotifier &operator=(const EventNotifier &) = delete;
+
+    // 生产者在数据发布之后调用
+    void Notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (fd_ >= 0 && waiting_.load(std::memory_order_relaxed))
+        {
+            uint64_t one = 1;
+            ssize_t n = write(fd_, &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    // 消费者等待ready()为真或超时
+    template <typename Pred>
+    bool WaitFor(Pred ready, std::chrono::microseconds timeout)
+    {
+        if (ready())
+            return true;
+        if (fd_ < 0)
+            return false;
+        waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!ready())
+        {
+            struct pollfd pfd = {fd_, POLLIN, 0};
+            struct timespec ts;
+            ts.tv_sec = timeout.count() / 1000000;
+            ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+            if (ppoll(&pfd, 1, &ts, nullptr) > 0)
+            {
+                uint64_t cnt;
+                ssize_t n = read(fd_, &cnt, sizeof(cnt));
+                (void)n;
+            }
+        }
+        waiting_.store(false, std::memory_order_relaxed);
+        return ready();
+    }
+
+    int fd() const
+    {
+        return fd_;
+    }
+
+private:
+    int fd_{-1};
+    std::atomic<bool> waiting_{false};
+};
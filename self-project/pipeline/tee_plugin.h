@@ -0,0 +1,91 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include "plugin.h"
+
+// 一进多出，每个下游拿到同一份数据的新引用(MediaBuffer::Ref)，像素和负载都不拷贝
+// 典型用法是解码一次，分给多路缩放+编码生成ABR各档
+class TeePlugin : public Plugin
+{
+public:
+    ~TeePlugin() override
+    {
+        Deinit();
+    }
+
+    const char *StageName() const override
+    {
+        return "tee";
+    }
+
+    bool Init(const std::vector<Plugin *> &outputs)
+    {
+        outputs_ = outputs;
+        pending_list_.clear();
+        pending_list_.resize(outputs_.size());
+        eof_seen_ = false;
+        for (auto &&out : outputs_)
+            Link(this, out);
+        return Plugin::Init(nullptr);
+    }
+
+    void Deinit() override
+    {
+        outputs_.clear();
+        pending_list_.clear();
+        Plugin::Deinit();
+    }
+
+    // 任何一路拥塞都会让所有分支一起停下来，最慢的一路决定整体速度
+    ExecutionState Run() override
+    {
+        int blocked = FlushOutputs();
+        if (blocked >= 0)
+            return outputs_[blocked]->Congested() ? kBlocked : kBusying;
+        if (eof_seen_)
+        {
+            if (!Finished())
+                Finish();
+            return kIdle;
+        }
+        for (auto &&out : outputs_)
+        {
+            if (out->Congested())
+                return kBlocked;
+        }
+        MediaBuffer buf;
+        if (!Dequeue(buf))
+            return kIdle;
+        if (buf.IsEof())
+            eof_seen_ = true;
+        for (size_t i = 0; i < outputs_.size(); ++i)
+        {
+            MediaBuffer item = (i + 1 == outputs_.size()) ? std::move(buf) : buf.Ref();
+            if (!pending_list_[i].empty() || !outputs_[i]->Enqueue(std::move(item)))
+                pending_list_[i].emplace_back(std::move(item));
+        }
+        return kBusying;
+    }
+
+private:
+    // 返回第一个还有积压的下游，都送完返回-1
+    int FlushOutputs()
+    {
+        int blocked = -1;
+        for (size_t i = 0; i < outputs_.size(); ++i)
+        {
+            std::deque<MediaBuffer> &pending = pending_list_[i];
+            while (!pending.empty() && outputs_[i]->Enqueue(std::move(pending.front())))
+                pending.pop_front();
+            if (!pending.empty() && blocked < 0)
+                blocked = static_cast<int>(i);
+        }
+        return blocked;
+    }
+
+private:
+    std::vector<Plugin *> outputs_;
+    // 外层用deque，扩容时不需要搬动(拷贝)内层的deque
+    std::deque<std::deque<MediaBuffer>> pending_list_;
+    bool eof_seen_{false};
+};
@@ -1,13 +1,91 @@
 #pragma once
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <functional>
 #include <vector>
-#include <queue>
+#include <deque>
+#include <algorithm>
 #include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
 
-using TaskFunc = std::function<bool()>;
+enum ExecutionState
+{
+    kIdle = 0,
+    kBusying,
+    kBlocked,   // 下游拥塞，等下游消化后再调度
+};
+
+using TaskFunc = std::function<ExecutionState()>;
+
+inline int64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 一组任务(一条pipeline)共享的时间预算：每个周期内在worker上运行的总时长超出预算后，
+// 该组任务推迟到下个周期再调度，防止单条pipeline挤占其他pipeline
+struct TaskGroup
+{
+    static constexpr int64_t kDefaultPeriodNs = 100 * 1000 * 1000;
+
+    explicit TaskGroup(int64_t budget = 0, int64_t period = kDefaultPeriodNs)
+        : budget_ns(budget), period_ns(period) {}
 
+    // 记账，超预算时返回本周期结束的时间点，否则返回0
+    int64_t Charge(int64_t now, int64_t cost)
+    {
+        total_ns.fetch_add(cost, std::memory_order_relaxed);
+        if (budget_ns <= 0)
+            return 0;
+        int64_t start = period_start.load(std::memory_order_relaxed);
+        if (now - start >= period_ns &&
+            period_start.compare_exchange_strong(start, now, std::memory_order_relaxed))
+        {
+            used_ns.store(0, std::memory_order_relaxed);
+            start = now;
+        }
+        if (used_ns.fetch_add(cost, std::memory_order_relaxed) + cost <= budget_ns)
+            return 0;
+        return period_start.load(std::memory_order_relaxed) + period_ns;
+    }
+
+    const int64_t budget_ns;    // <=0 表示不限制
+    const int64_t period_ns;
+    std::atomic<int64_t> period_start{0};
+    std::atomic<int64_t> used_ns{0};
+    std::atomic<int64_t> total_ns{0};
+};
+using TaskGroupPtr = std::shared_ptr<TaskGroup>;
+
+// 任务只在有事可做时进入队列：kBusying时继续排队，kIdle/kBlocked后睡眠，等Wake唤醒
+struct Task
+{
+    enum State
+    {
+        kSleeping = 0,
+        kQueued,
+        kRunning,
+        kNotified,  // 运行期间被唤醒，跑完立即重新排队
+        kCancelled
+    };
+
+    Task(TaskFunc f, TaskGroupPtr g) : func(std::move(f)), group(std::move(g)) {}
+
+    TaskFunc func;
+    TaskGroupPtr group;
+    std::atomic<int> state{kSleeping};
+    std::atomic<bool> executing{false};
+    std::atomic<int> worker{-1};    // 上次运行所在的worker，唤醒时优先投递回去
+};
+using TaskPtr = std::shared_ptr<Task>;
+
+// 每个worker一个双端队列，自己从队头取，空闲时从别的worker队尾偷
 class ThreadPoll
 {
 public:
@@ -19,55 +97,98 @@ public:
 
     ~ThreadPoll()
     {
+        Stop();
+    }
+
+    // 创建并立即调度
+    TaskPtr AddTask(TaskFunc func, TaskGroupPtr group = nullptr)
+    {
+        TaskPtr task = CreateTask(std::move(func), std::move(group));
+        Wake(task);
+        return task;
     }
 
-    void AddTask(TaskFunc func)
+    // 只创建不调度，绑定好唤醒关系后再调用Wake启动
+    TaskPtr CreateTask(TaskFunc func, TaskGroupPtr group = nullptr)
     {
+        TaskPtr task = std::make_shared<Task>(std::move(func), std::move(group));
         std::lock_guard<std::mutex> lkg(mu_);
-        tasks_.push(func);
-        cv_.notify_one();
+        tasks_.push_back(task);
+        return task;
     }
 
-    void Start(int thread_num)
+    // 通知任务有事可做，可在任意线程调用，重复调用开销只是一次CAS
+    void Wake(const TaskPtr &task)
     {
+        int state = task->state.load();
+        for (;;)
+        {
+            if (state == Task::kSleeping)
+            {
+                if (task->state.compare_exchange_weak(state, Task::kQueued))
+                {
+                    Push(task, task->worker.load(std::memory_order_relaxed));
+                    return;
+                }
+            }
+            else if (state == Task::kRunning)
+            {
+                if (task->state.compare_exchange_weak(state, Task::kNotified))
+                    return;
+            }
+            else
+            {
+                return;
+            }
+        }
+    }
+
+    // 返回后任务不会再被执行
+    void RemoveTask(const TaskPtr &task)
+    {
+        task->state.store(Task::kCancelled);
+        while (task->executing.load())
+            std::this_thread::yield();
+        std::lock_guard<std::mutex> lkg(mu_);
+        tasks_.erase(std::remove(tasks_.begin(), tasks_.end(), task), tasks_.end());
+    }
+
+    void Start(int thread_num, bool pin_cpu = false)
+    {
+        thd_exit_ = false;
+        // 上次Stop时还在排队的任务重新分配
+        for (auto &&w : workers_)
+        {
+            for (auto &&task : w->queue)
+                early_tasks_.push_back(task);
+        }
+        workers_.clear();
+        queued_.store(0);
+        for (int i = 0; i < thread_num; ++i)
+        {
+            workers_.emplace_back(new Worker);
+        }
+        // 在线程启动前把已有的待运行任务分摊到各个worker
+        {
+            std::lock_guard<std::mutex> lkg(mu_);
+            size_t i = 0;
+            for (auto &&task : early_tasks_)
+            {
+                workers_[i++ % workers_.size()]->queue.push_back(task);
+                queued_.fetch_add(1);
+            }
+            early_tasks_.clear();
+        }
         for (int i = 0; i < thread_num; ++i)
         {
-            threads_.emplace_back([this]()
+            threads_.emplace_back([this, i]() { WorkerLoop(i); });
+            if (pin_cpu)
             {
-                size_t idle = 0;
-                for(;;){
-                    TaskFunc task = nullptr;
-                    {
-                        std::unique_lock<std::mutex> ulk(mu_);
-                        cv_.wait(ulk, [this](){return this->thd_exit_ || !this->tasks_.empty();});
-                        if (this->thd_exit_)
-                            return;
-
-                        if(!this->tasks_.empty()){
-                            task = this->tasks_.front();
-                            this->tasks_.pop();
-                        }
-                    }
-                    if(!task){
-                        continue;
-                    }
-                    if(task()){
-                        idle = 0;
-                    }
-                    else{
-                        ++idle;
-                    }
-                    {
-                        std::lock_guard<std::mutex> lkg(mu_);
-                        this->tasks_.push(task);
-                    }
-                    cv_.notify_one();
-                    if(idle > 3){
-                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                    }
-                } 
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(i % std::thread::hardware_concurrency(), &set);
+                pthread_setaffinity_np(threads_.back().native_handle(), sizeof(set), &set);
             }
-            );
         }
     }
 
@@ -86,13 +207,196 @@ public:
         threads_.clear();
     }
 
+    size_t WorkerCount() const
+    {
+        return workers_.size();
+    }
+
 private:
     ThreadPoll() = default;
 
+    struct Worker
+    {
+        std::mutex mu;
+        std::deque<TaskPtr> queue;
+    };
+
+    static int &CurrentWorker()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    void Push(const TaskPtr &task, int hint)
+    {
+        if (workers_.empty())
+        {
+            std::lock_guard<std::mutex> lkg(mu_);
+            early_tasks_.push_back(task);
+            return;
+        }
+        int self = CurrentWorker();
+        size_t index;
+        if (hint >= 0 && static_cast<size_t>(hint) < workers_.size())
+            index = hint;
+        else if (self >= 0)
+            index = self;
+        else
+            index = next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+        queued_.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lkg(workers_[index]->mu);
+            workers_[index]->queue.push_back(task);
+        }
+        if (sleepers_.load() > 0)
+        {
+            std::lock_guard<std::mutex> lkg(mu_);
+            cv_.notify_one();
+        }
+    }
+
+    // 超预算的任务保持kQueued状态停放，到期后由worker重新投递
+    void Park(const TaskPtr &task, int64_t until)
+    {
+        std::lock_guard<std::mutex> lkg(mu_);
+        throttled_.emplace_back(until, task);
+        if (until < next_release_.load())
+            next_release_.store(until);
+    }
+
+    void ReleaseThrottled()
+    {
+        std::vector<TaskPtr> due;
+        {
+            std::lock_guard<std::mutex> lkg(mu_);
+            const int64_t now = NowNs();
+            int64_t next = kNever;
+            for (auto it = throttled_.begin(); it != throttled_.end();)
+            {
+                if (it->first <= now)
+                {
+                    due.push_back(std::move(it->second));
+                    it = throttled_.erase(it);
+                }
+                else
+                {
+                    next = std::min(next, it->first);
+                    ++it;
+                }
+            }
+            next_release_.store(next);
+        }
+        for (auto &&task : due)
+            Push(task, task->worker.load(std::memory_order_relaxed));
+    }
+
+    TaskPtr PopLocal(size_t index)
+    {
+        Worker &w = *workers_[index];
+        std::lock_guard<std::mutex> lkg(w.mu);
+        if (w.queue.empty())
+            return nullptr;
+        TaskPtr task = std::move(w.queue.front());
+        w.queue.pop_front();
+        queued_.fetch_sub(1);
+        return task;
+    }
+
+    TaskPtr Steal(size_t index)
+    {
+        const size_t n = workers_.size();
+        for (size_t k = 1; k < n; ++k)
+        {
+            Worker &w = *workers_[(index + k) % n];
+            std::unique_lock<std::mutex> ulk(w.mu, std::try_to_lock);
+            if (!ulk.owns_lock() || w.queue.empty())
+                continue;
+            TaskPtr task = std::move(w.queue.back());
+            w.queue.pop_back();
+            queued_.fetch_sub(1);
+            return task;
+        }
+        return nullptr;
+    }
+
+    void WorkerLoop(size_t index)
+    {
+        CurrentWorker() = static_cast<int>(index);
+        while (!thd_exit_)
+        {
+            if (next_release_.load() != kNever && NowNs() >= next_release_.load())
+                ReleaseThrottled();
+            TaskPtr task = PopLocal(index);
+            if (!task)
+                task = Steal(index);
+            if (!task)
+            {
+                std::unique_lock<std::mutex> ulk(mu_);
+                sleepers_.fetch_add(1);
+                auto ready = [this]() { return thd_exit_ || queued_.load() > 0; };
+                const int64_t release = next_release_.load();
+                if (release == kNever)
+                    cv_.wait(ulk, ready);
+                else
+                    cv_.wait_for(ulk, std::chrono::nanoseconds(std::max<int64_t>(release - NowNs(), 0)), ready);
+                sleepers_.fetch_sub(1);
+                continue;
+            }
+            RunTask(task, index);
+        }
+    }
+
+    void RunTask(const TaskPtr &task, size_t index)
+    {
+        task->executing.store(true);
+        int expected = Task::kQueued;
+        if (!task->state.compare_exchange_strong(expected, Task::kRunning))
+        {
+            task->executing.store(false);
+            return;
+        }
+        task->worker.store(static_cast<int>(index), std::memory_order_relaxed);
+        const int64_t begin = task->group ? NowNs() : 0;
+        ExecutionState ret = task->func();
+        int64_t throttle_until = 0;
+        if (task->group)
+        {
+            const int64_t now = NowNs();
+            throttle_until = task->group->Charge(now, now - begin);
+        }
+
+        int state = Task::kRunning;
+        if (ret == kBusying || !task->state.compare_exchange_strong(state, Task::kSleeping))
+        {
+            // 还有活要干，或者运行期间被唤醒过，重新排队
+            state = task->state.load();
+            while (state != Task::kCancelled &&
+                   !task->state.compare_exchange_weak(state, Task::kQueued))
+            {
+            }
+            if (state != Task::kCancelled)
+            {
+                if (throttle_until)
+                    Park(task, throttle_until);
+                else
+                    Push(task, static_cast<int>(index));
+            }
+        }
+        task->executing.store(false);
+    }
+
 private:
     std::vector<std::thread> threads_;
-    std::queue<TaskFunc> tasks_;
-    bool thd_exit_{false};
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<TaskPtr> tasks_;
+    std::vector<TaskPtr> early_tasks_;
+    static constexpr int64_t kNever = INT64_MAX;
+    std::vector<std::pair<int64_t, TaskPtr>> throttled_;
+    std::atomic<int64_t> next_release_{kNever};
+    std::atomic<size_t> queued_{0};
+    std::atomic<int> sleepers_{0};
+    std::atomic<size_t> next_worker_{0};
+    std::atomic<bool> thd_exit_{false};
     std::mutex mu_;
     std::condition_variable cv_;
-};
\ No newline at end of file
+};
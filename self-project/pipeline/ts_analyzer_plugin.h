@@ -0,0 +1,322 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "plugin.h"
+#include "seqlock.h"
+#include "../ts_parser.h"
+
+// 单个PID在最近一个统计窗口内的结果
+struct TsPidWindow
+{
+    uint16_t pid;
+    uint8_t has_pcr;
+    uint8_t reserved;
+    uint32_t cc_errors;             // 窗口内
+    uint64_t cc_errors_total;
+    uint64_t packets_total;
+    uint64_t bitrate;               // bit/s
+    uint32_t max_pcr_interval_us;   // TR 101 290要求不超过40ms
+    int32_t max_pcr_accuracy_ns;    // 绝对值最大的PCR_AC，要求在±500ns以内
+};
+
+// 分析结果快照，定长，整体经SeqLock发布
+struct TsAnalyzerSnapshot
+{
+    static constexpr int kMaxPids = 64;
+
+    int64_t stream_time_ms;    // 以PCR计的已分析时长
+    uint32_t window_ms;        // 实际覆盖的窗口，窗口没填满时小于设定值
+    int32_t pcr_pid;
+    uint64_t total_bitrate;
+    uint64_t packets;
+    uint64_t sync_losses;
+    uint64_t cc_errors;
+    uint32_t pid_count;        // 超过kMaxPids的PID不单独统计，只计入packets
+    uint32_t reserved;
+    TsPidWindow pids[kMaxPids];
+};
+
+// 直通插件：检查经过的TS字节流，数据原样交给下游，不拷贝也不重新分配
+// 以PCR为时钟，把窗口分成若干桶滚动统计，每滚过一个桶发布一次快照
+class TsAnalyzerPlugin : public Plugin
+{
+public:
+    static constexpr int kBuckets = 10;
+
+    ~TsAnalyzerPlugin() override
+    {
+        Deinit();
+    }
+
+    const char *StageName() const override
+    {
+        return "analyze";
+    }
+
+    // pcr_pid为-1时取第一个带PCR的PID作为时钟
+    bool Init(Plugin *next, int window_ms = 1000, int pcr_pid = -1)
+    {
+        bucket_ticks_ = static_cast<int64_t>(window_ms > 0 ? window_ms : 1000) * 27000 / kBuckets;
+        clock_pid_ = pcr_pid;
+        memset(slots_, -1, sizeof(slots_));
+        pids_.clear();
+        memset(buckets_, 0, sizeof(buckets_));
+        carry_size_ = 0;
+        offset_ = 0;
+        packets_ = sync_losses_ = cc_errors_ = 0;
+        clock_ = 0;
+        bucket_ = 0;
+        eof_seen_ = false;
+        return Plugin::Init(next);
+    }
+
+    void Deinit() override
+    {
+        pids_.clear();
+        Plugin::Deinit();
+    }
+
+    // 任意线程随时调用，不会阻塞数据通路
+    bool Snapshot(TsAnalyzerSnapshot *snapshot) const
+    {
+        return snapshot_.Load(snapshot);
+    }
+
+    ExecutionState Run() override
+    {
+        if (!FlushPending())
+            return Backoff();
+        if (eof_seen_)
+        {
+            if (!Finished())
+                Finish();
+            return kIdle;
+        }
+        if (next_ && next_->Congested())
+            return kBlocked;
+        MediaBuffer buf;
+        if (!Dequeue(buf))
+            return kIdle;
+        if (buf.IsPacket())
+            Analyze(buf.packet()->data, buf.packet()->size);
+        else if (buf.IsEof())
+        {
+            Publish();
+            eof_seen_ = true;
+        }
+        Deliver(std::move(buf));
+        return kBusying;
+    }
+
+private:
+    struct PidState
+    {
+        int pid{0};
+        int last_cc{-1};
+        int64_t last_pcr{-1};
+        uint64_t last_pcr_offset{0};
+        uint64_t packets{0};
+        uint64_t cc_errors{0};
+        bool has_pcr{false};
+    };
+
+    struct Bucket
+    {
+        uint32_t packets;
+        uint32_t cc_errors;
+        uint32_t max_pcr_interval;    // 27MHz
+        int32_t max_pcr_accuracy;     // ns
+    };
+
+    // 包可能跨两次输入，不满一个包的尾巴留到下次拼上
+    void Analyze(const uint8_t *data, size_t size)
+    {
+        size_t pos = 0;
+        if (carry_size_ > 0)
+        {
+            const size_t need = TS_PACKET_SIZE - carry_size_;
+            if (size < need)
+            {
+                memcpy(carry_ + carry_size_, data, size);
+                carry_size_ += size;
+                offset_ += size;
+                return;
+            }
+            memcpy(carry_ + carry_size_, data, need);
+            carry_size_ = 0;
+            pos = need;
+            if (carry_[0] == TS_SYNC_BYTE)
+                Packet(carry_, offset_ - (TS_PACKET_SIZE - need));
+            else
+                sync_losses_++;
+        }
+        while (pos + TS_PACKET_SIZE <= size)
+        {
+            if (data[pos] != TS_SYNC_BYTE)
+            {
+                sync_losses_++;
+                pos += ts_find_sync(data + pos, size - pos);
+                continue;
+            }
+            Packet(data + pos, offset_ + pos);
+            pos += TS_PACKET_SIZE;
+        }
+        if (pos < size)
+        {
+            carry_size_ = size - pos;
+            memcpy(carry_, data + pos, carry_size_);
+        }
+        offset_ += size;
+    }
+
+    void Packet(const uint8_t *packet, uint64_t offset)
+    {
+        const int pid = ts_pid(packet);
+        const int slot = Slot(pid);
+        PidState *st = slot >= 0 ? &pids_[slot] : nullptr;
+        Bucket *bucket = slot >= 0 ? &buckets_[bucket_ % (kBuckets + 1)][slot] : nullptr;
+        packets_++;
+        if (st)
+        {
+            st->packets++;
+            bucket->packets++;
+        }
+        if (!st || pid == TS_NULL_PID || ts_transport_error(packet))
+            return;
+        if (ts_check_cc(&st->last_cc, packet))
+        {
+            st->cc_errors++;
+            bucket->cc_errors++;
+            cc_errors_++;
+        }
+
+        const int64_t pcr = (ts_af_flags(packet) & 0x10) ? ts_pcr(packet) : -1;
+        if (pcr < 0)
+            return;
+        st->has_pcr = true;
+        if (clock_pid_ < 0)
+            clock_pid_ = pid;
+        if (st->last_pcr >= 0 && !ts_discontinuity(packet))
+        {
+            const int64_t interval = (pcr - st->last_pcr + kPcrWrap) % kPcrWrap;
+            bucket->max_pcr_interval = std::max<uint32_t>(bucket->max_pcr_interval, static_cast<uint32_t>(std::min<int64_t>(interval, UINT32_MAX)));
+            const int32_t accuracy = PcrAccuracy(interval, offset - st->last_pcr_offset);
+            if (std::abs(accuracy) > std::abs(bucket->max_pcr_accuracy))
+                bucket->max_pcr_accuracy = accuracy;
+            if (pid == clock_pid_)
+                Advance(interval);
+        }
+        st->last_pcr = pcr;
+        st->last_pcr_offset = offset;
+    }
+
+    // 按上一个完整窗口的平均码率，两个PCR之间的字节数应对应的时长与实际PCR差值之差
+    int32_t PcrAccuracy(int64_t interval, uint64_t bytes) const
+    {
+        const uint64_t rate = window_bitrate_;
+        if (rate == 0)
+            return 0;
+        const double expected = bytes * 8.0 * 27000000.0 / rate;
+        const double ns = (interval - expected) * 1000.0 / 27.0;
+        return static_cast<int32_t>(std::max(std::min(ns, 2e9), -2e9));
+    }
+
+    // 时钟前进，每跨过一个桶发布一次
+    void Advance(int64_t ticks)
+    {
+        clock_ += ticks;
+        const int64_t bucket = clock_ / bucket_ticks_;
+        if (bucket == bucket_)
+            return;
+        // 跳过太多桶(比如输入断了很久)时只需要把所有桶清一遍
+        const int64_t steps = std::min<int64_t>(bucket - bucket_, kBuckets + 1);
+        for (int64_t i = 1; i <= steps; ++i)
+            memset(buckets_[(bucket_ + i) % (kBuckets + 1)], 0, sizeof(buckets_[0]));
+        bucket_ = bucket;
+        Publish();
+    }
+
+    // 用当前桶之前的kBuckets个已完成的桶汇总，当前桶还在累积不计入
+    void Publish()
+    {
+        const int64_t full = std::min<int64_t>(bucket_, kBuckets);
+        const int64_t window_ticks = full * bucket_ticks_;
+        TsAnalyzerSnapshot &snap = publishing_;
+        memset(&snap, 0, sizeof(snap));
+        snap.stream_time_ms = clock_ / 27000;
+        snap.window_ms = static_cast<uint32_t>(window_ticks / 27000);
+        snap.pcr_pid = clock_pid_;
+        snap.packets = packets_;
+        snap.sync_losses = sync_losses_;
+        snap.cc_errors = cc_errors_;
+        snap.pid_count = static_cast<uint32_t>(pids_.size());
+
+        uint64_t total_packets = 0;
+        for (size_t slot = 0; slot < pids_.size(); ++slot)
+        {
+            const PidState &st = pids_[slot];
+            TsPidWindow &out = snap.pids[slot];
+            uint64_t packets = 0;
+            uint32_t max_interval = 0;
+            int32_t max_accuracy = 0;
+            for (int64_t i = 1; i <= full; ++i)
+            {
+                const Bucket &b = buckets_[(bucket_ - i) % (kBuckets + 1)][slot];
+                packets += b.packets;
+                out.cc_errors += b.cc_errors;
+                max_interval = std::max(max_interval, b.max_pcr_interval);
+                if (std::abs(b.max_pcr_accuracy) > std::abs(max_accuracy))
+                    max_accuracy = b.max_pcr_accuracy;
+            }
+            total_packets += packets;
+            out.pid = static_cast<uint16_t>(st.pid);
+            out.has_pcr = st.has_pcr;
+            out.cc_errors_total = st.cc_errors;
+            out.packets_total = st.packets;
+            out.bitrate = window_ticks ? packets * TS_PACKET_SIZE * 8 * 27000000 / window_ticks : 0;
+            out.max_pcr_interval_us = max_interval / 27;
+            out.max_pcr_accuracy_ns = max_accuracy;
+        }
+        snap.total_bitrate = window_ticks ? total_packets * TS_PACKET_SIZE * 8 * 27000000 / window_ticks : 0;
+        if (full == kBuckets)
+            window_bitrate_ = snap.total_bitrate;
+        snapshot_.Store(snap);
+    }
+
+    // PID到统计槽位，槽位用完后返回-1
+    int Slot(int pid)
+    {
+        int16_t &slot = slots_[pid];
+        if (slot >= 0)
+            return slot;
+        if (pids_.size() >= TsAnalyzerSnapshot::kMaxPids)
+            return -1;
+        slot = static_cast<int16_t>(pids_.size());
+        pids_.emplace_back();
+        pids_.back().pid = pid;
+        return slot;
+    }
+
+    static constexpr int64_t kPcrWrap = (INT64_C(1) << 33) * 300;
+
+    int64_t bucket_ticks_{0};
+    int clock_pid_{-1};
+    int16_t slots_[TS_MAX_PID];
+    std::vector<PidState> pids_;
+    // 多一个桶给正在累积的当前桶
+    Bucket buckets_[kBuckets + 1][TsAnalyzerSnapshot::kMaxPids];
+    uint8_t carry_[TS_PACKET_SIZE];
+    size_t carry_size_{0};
+    uint64_t offset_{0};
+    uint64_t packets_{0};
+    uint64_t sync_losses_{0};
+    uint64_t cc_errors_{0};
+    uint64_t window_bitrate_{0};
+    int64_t clock_{0};
+    int64_t bucket_{0};
+    bool eof_seen_{false};
+    TsAnalyzerSnapshot publishing_;
+    SeqLock<TsAnalyzerSnapshot> snapshot_;
+};
@@ -1,7 +1,16 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <unistd.h>
+#include <getopt.h>
 #include <algorithm>
 #include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #ifdef __cplusplus
 extern "C"
 {
@@ -10,81 +19,205 @@ extern "C"
 #include "libavformat/avformat.h"
 #include "libavformat/avio.h"
 #include "libavutil/frame.h"
+#include "libavutil/crc.h"
+#include "libavutil/parseutils.h"
 #ifdef __cplusplus
 }
 #endif
+#include "stream_cache.h"
+#include "keyframe_index.h"
 
-int main(int argc, char **argv)
+static constexpr char usage_string[] = "usage:\n"
+                                       "    remuxer -i [url] -o [url] [-c stream_cache] [-ss start] [-to end] [-seek_index index]\n"
+                                       "    remuxer -l manifest [-j jobs]\n"
+                                       "-l manifest with one \"input output\" pair per line, lines starting with # are ignored\n"
+                                       "-j number of files remuxed at the same time, default number of cores\n"
+                                       "-c stream info saved by a previous run, used instead of probing when it matches the input\n"
+                                       "-ss/-to copy only this time range, seconds or [hh:]mm:ss[.xxx] from the start of the input,\n"
+                                       "    output starts at the keyframe before -ss\n"
+                                       "-seek_index keyframe index built by kf_index, -ss jumps straight to the keyframe instead of searching\n";
+
+// 一次完整探测得到的流参数，打开之后就已经知道的参数相同的文件直接复用，不再探测
+struct StreamLayout
 {
-    int ret;
-    const char *optstring = "i:o:h";
-    std::string in_filename;
-    std::string out_filename;
-    while ((ret = getopt(argc, argv, optstring)) != -1)
+    StreamLayout() = default;
+    StreamLayout(const StreamLayout &) = delete;
+    StreamLayout &operator=(const StreamLayout &) = delete;
+    ~StreamLayout()
     {
-        switch (ret)
+        for (auto &&par : codecpars)
+            avcodec_parameters_free(&par);
+    }
+
+    std::vector<AVCodecParameters *> codecpars;
+    std::vector<AVRational> avg_frame_rates;
+    std::vector<AVRational> r_frame_rates;
+};
+using StreamLayoutPtr = std::shared_ptr<const StreamLayout>;
+
+class LayoutCache
+{
+public:
+    StreamLayoutPtr Find(const std::string &signature)
+    {
+        std::lock_guard<std::mutex> lkg(mu_);
+        auto it = layouts_.find(signature);
+        return it == layouts_.end() ? nullptr : it->second;
+    }
+
+    void Save(const std::string &signature, AVFormatContext *fmt_ctx)
+    {
+        std::shared_ptr<StreamLayout> layout = std::make_shared<StreamLayout>();
+        for (uint32_t i = 0; i < fmt_ctx->nb_streams; i++)
         {
-        case 'i':
-            in_filename = optarg;
-            break;
-        case 'o':
-            out_filename = optarg;
-            break;
-        case 'h':
-            printf("usage:\n remuxer -i [url] -o [url]\n");
-            return 0;
-        case '?':
-            printf("error optopt: %c\n", optopt);
-            printf("error opterr: %d\n", opterr);
-            break;
-        default:
-            break;
+            AVCodecParameters *par = avcodec_parameters_alloc();
+            if (!par || avcodec_parameters_copy(par, fmt_ctx->streams[i]->codecpar) < 0)
+            {
+                avcodec_parameters_free(&par);
+                return;
+            }
+            layout->codecpars.push_back(par);
+            layout->avg_frame_rates.push_back(fmt_ctx->streams[i]->avg_frame_rate);
+            layout->r_frame_rates.push_back(fmt_ctx->streams[i]->r_frame_rate);
         }
+        std::lock_guard<std::mutex> lkg(mu_);
+        layouts_.emplace(signature, layout);
     }
-    if (!in_filename.size() || !out_filename.size())
+
+    // 打开文件后就能拿到的参数：编码类型、分辨率、采样率、extradata等，全部一致才认为是同一种布局
+    // 有流既没有extradata也没有基本参数(比如TS在探测之前)时返回空串，这种文件每次都要探测
+    static std::string Signature(AVFormatContext *fmt_ctx)
     {
-        printf("please give a input url and a output url\n");
-        return -1;
+        std::ostringstream sig;
+        sig << fmt_ctx->iformat->name << "/" << fmt_ctx->nb_streams;
+        for (uint32_t i = 0; i < fmt_ctx->nb_streams; i++)
+        {
+            const AVCodecParameters *par = fmt_ctx->streams[i]->codecpar;
+            if (par->codec_id == AV_CODEC_ID_NONE)
+                return "";
+            // 视频的分辨率在extradata(SPS/VOL)里，有extradata就足以区分
+            if (par->codec_type == AVMEDIA_TYPE_VIDEO && par->extradata_size <= 0 && (par->width <= 0 || par->height <= 0))
+                return "";
+            if (par->codec_type == AVMEDIA_TYPE_AUDIO && par->extradata_size <= 0 &&
+                (par->sample_rate <= 0 || par->ch_layout.nb_channels <= 0))
+                return "";
+            uint32_t crc = par->extradata_size > 0
+                               ? av_crc(av_crc_get_table(AV_CRC_32_IEEE), 0, par->extradata, par->extradata_size)
+                               : 0;
+            sig << "|" << par->codec_type << ":" << par->codec_id << ":" << par->codec_tag << ":"
+                << par->width << "x" << par->height << ":" << par->format << ":"
+                << par->sample_rate << ":" << par->ch_layout.nb_channels << ":"
+                << par->extradata_size << ":" << crc;
+        }
+        return sig.str();
     }
 
+private:
+    std::mutex mu_;
+    std::map<std::string, StreamLayoutPtr> layouts_;
+};
+
+// -ss/-to，AV_TIME_BASE，从输入开头算起
+struct TimeRange
+{
+    int64_t start{AV_NOPTS_VALUE};
+    int64_t end{AV_NOPTS_VALUE};
+    std::string index;    // kf_index生成的关键帧索引
+};
+
+struct RemuxResult
+{
+    bool ok{false};
+    bool layout_reused{false};
+    uint64_t bytes{0};
+};
+
+// 打开输入并取得流参数，reused表示没有调用avformat_find_stream_info
+// stream_cache是跨进程的缓存文件，cache是批量模式下进程内按布局共享的探测结果
+static int OpenInput(AVFormatContext **fmt_ctx, const std::string &in_filename, LayoutCache *cache,
+                     const std::string &stream_cache, bool *reused)
+{
+    if (!stream_cache.empty())
+        return OpenInputWithCache(fmt_ctx, in_filename.c_str(), stream_cache, reused);
+
+    int ret = avformat_open_input(fmt_ctx, in_filename.c_str(), NULL, NULL);
+    if (ret < 0)
+        return ret;
+    // 同样布局的文件已经完整探测过，直接套用探测结果
+    std::string signature = cache ? LayoutCache::Signature(*fmt_ctx) : "";
+    StreamLayoutPtr layout = signature.empty() ? nullptr : cache->Find(signature);
+    if (layout)
+    {
+        for (uint32_t i = 0; i < (*fmt_ctx)->nb_streams; i++)
+        {
+            AVStream *st = (*fmt_ctx)->streams[i];
+            avcodec_parameters_copy(st->codecpar, layout->codecpars[i]);
+            st->avg_frame_rate = layout->avg_frame_rates[i];
+            st->r_frame_rate = layout->r_frame_rates[i];
+        }
+        *reused = true;
+        return 0;
+    }
+    if ((ret = avformat_find_stream_info(*fmt_ctx, NULL)) < 0)
+    {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        return ret;
+    }
+    if (!signature.empty())
+        cache->Save(signature, *fmt_ctx);
+    return 0;
+}
+
+static RemuxResult Remux(const std::string &in_filename, const std::string &out_filename, LayoutCache *cache,
+                         const std::string &stream_cache, bool verbose, const TimeRange &range = TimeRange())
+{
+    RemuxResult result;
+    int ret;
     AVFormatContext *input_format_context = nullptr;
     AVFormatContext *output_format_context = nullptr;
-    
+    std::vector<int> streams_list;
+    int index = 0;
+    AVPacket *packet = nullptr;
+    int64_t origin = 0;    // 输出时间戳从这里开始，AV_TIME_BASE
+    int64_t end_ts = AV_NOPTS_VALUE;
+    int primary = -1;      // 从它的关键帧开始，其他流丢掉关键帧之前的包
+    std::vector<bool> done;
+    int done_count = 0;
+
     // 建立输入上下文
-    if ((ret = avformat_open_input(&input_format_context, in_filename.c_str(), NULL, NULL)) < 0)
+    if ((ret = OpenInput(&input_format_context, in_filename, cache, stream_cache, &result.layout_reused)) < 0)
     {
-        fprintf(stderr, "Could not open input file '%s'", in_filename.c_str());
-        return -1;
+        fprintf(stderr, "Could not open input file '%s'\n", in_filename.c_str());
+        goto end;
     }
-    if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0)
+    if (verbose)
+        av_dump_format(input_format_context, 0, in_filename.c_str(), 0);
+    if (range.start != AV_NOPTS_VALUE)
     {
-        fprintf(stderr, "Failed to retrieve input stream information");
-        return -1;
+        bool indexed = false;
+        if ((origin = SeekInput(input_format_context, range.start, range.index, &indexed)) == AV_NOPTS_VALUE)
+        {
+            fprintf(stderr, "Could not seek to %.3f s in '%s'\n", range.start / 1e6, in_filename.c_str());
+            goto end;
+        }
+        if (verbose)
+            printf("start at %.3f s, located by %s\n", origin / 1e6, indexed ? "keyframe index" : "demuxer");
+        primary = std::max(-1, av_find_best_stream(input_format_context, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0));
     }
-    av_dump_format(input_format_context, 0, in_filename.c_str(), 0);
+    if (range.end != AV_NOPTS_VALUE)
+        end_ts = (input_format_context->start_time == AV_NOPTS_VALUE ? 0 : input_format_context->start_time) + range.end;
 
     // 根据输入上下文建立输出上下文
     avformat_alloc_output_context2(&output_format_context, NULL, NULL, out_filename.c_str());
     if (!output_format_context)
     {
         fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
-        return -1;
+        goto end;
     }
-    int number_of_streams = input_format_context->nb_streams;
-    std::vector<int> streams_list(number_of_streams);
-    int index = 0;
+    streams_list.resize(input_format_context->nb_streams);
     for (uint32_t i = 0; i < input_format_context->nb_streams; i++)
     {
         AVStream *in_stream = input_format_context->streams[i];
-        AVStream *out_stream = avformat_new_stream(output_format_context, NULL);
-        if (!out_stream)
-        {
-            fprintf(stderr, "Failed allocating output stream\n");
-            ret = AVERROR_UNKNOWN;
-            return -1;
-        }
-
         AVCodecParameters *in_codecpar = in_stream->codecpar;
         if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&
             in_codecpar->codec_type != AVMEDIA_TYPE_VIDEO &&
@@ -93,74 +226,247 @@ int main(int argc, char **argv)
             streams_list[i] = -1;
             continue;
         }
+        AVStream *out_stream = avformat_new_stream(output_format_context, NULL);
+        if (!out_stream)
+        {
+            fprintf(stderr, "Failed allocating output stream\n");
+            goto end;
+        }
         streams_list[i] = index++;
-        
+
         ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
         if (ret < 0)
         {
             fprintf(stderr, "Failed to copy codec parameters\n");
-            return -1;
+            goto end;
         }
         // 必须要把这个flag设为0，不然会判断codec_id不兼容
         out_stream->codecpar->codec_tag = 0;
     }
-    av_dump_format(output_format_context, 0, out_filename.c_str(), 1);
-    
+    if (verbose)
+        av_dump_format(output_format_context, 0, out_filename.c_str(), 1);
+
     // 创建一个输出文件
     if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
     {
         ret = avio_open(&output_format_context->pb, out_filename.c_str(), AVIO_FLAG_WRITE);
         if (ret < 0)
         {
-            fprintf(stderr, "Could not open output file '%s'", out_filename.c_str());
-            return -1;
+            fprintf(stderr, "Could not open output file '%s'\n", out_filename.c_str());
+            goto end;
         }
     }
-    
+
     // 正式读写
     ret = avformat_write_header(output_format_context, nullptr);
     if (ret < 0)
     {
         fprintf(stderr, "Error occurred when opening output file\n");
-        return -1;
+        goto end;
     }
 
-    AVPacket packet;
+    packet = av_packet_alloc();
+    done.assign(input_format_context->nb_streams, false);
     while (1)
     {
         AVStream *in_stream, *out_stream;
-        ret = av_read_frame(input_format_context, &packet);
+        ret = av_read_frame(input_format_context, packet);
         if (ret < 0)
             break;
-        in_stream = input_format_context->streams[packet.stream_index];
-        if (packet.stream_index >= number_of_streams || streams_list[packet.stream_index] < 0)
+        in_stream = input_format_context->streams[packet->stream_index];
+        if (packet->stream_index >= static_cast<int>(streams_list.size()) || streams_list[packet->stream_index] < 0)
         {
-            av_packet_unref(&packet);
+            av_packet_unref(packet);
             continue;
         }
-        packet.stream_index = streams_list[packet.stream_index];
-        out_stream = output_format_context->streams[packet.stream_index];
+        if (end_ts != AV_NOPTS_VALUE && packet->dts != AV_NOPTS_VALUE &&
+            av_compare_ts(packet->dts, in_stream->time_base, end_ts, AV_TIME_BASE_Q) >= 0)
+        {
+            // 每个流都过了结束点就不再读
+            if (!done[packet->stream_index])
+            {
+                done[packet->stream_index] = true;
+                done_count++;
+            }
+            av_packet_unref(packet);
+            if (done_count == index)
+                break;
+            continue;
+        }
+        if (range.start != AV_NOPTS_VALUE)
+        {
+            if (packet->stream_index != primary && packet->pts != AV_NOPTS_VALUE &&
+                av_compare_ts(packet->pts, in_stream->time_base, origin, AV_TIME_BASE_Q) < 0)
+            {
+                av_packet_unref(packet);
+                continue;
+            }
+            const int64_t offset = av_rescale_q(origin, AV_TIME_BASE_Q, in_stream->time_base);
+            if (packet->pts != AV_NOPTS_VALUE)
+                packet->pts -= offset;
+            if (packet->dts != AV_NOPTS_VALUE)
+                packet->dts -= offset;
+        }
+        result.bytes += packet->size;
+        packet->stream_index = streams_list[packet->stream_index];
+        out_stream = output_format_context->streams[packet->stream_index];
         /* copy packet */
-        packet.pts = av_rescale_q_rnd(packet.pts, in_stream->time_base, out_stream->time_base, static_cast<AVRounding>(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-        packet.dts = av_rescale_q_rnd(packet.dts, in_stream->time_base, out_stream->time_base, static_cast<AVRounding>(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-        packet.duration = av_rescale_q(packet.duration, in_stream->time_base, out_stream->time_base);
-
-        packet.pos = -1;
+        av_packet_rescale_ts(packet, in_stream->time_base, out_stream->time_base);
+        packet->pos = -1;
 
-        ret = av_interleaved_write_frame(output_format_context, &packet);
+        ret = av_interleaved_write_frame(output_format_context, packet);
         if (ret < 0)
         {
             fprintf(stderr, "Error muxing packet\n");
             break;
         }
-        av_packet_unref(&packet);
     }
-    av_write_trailer(output_format_context);
+    result.ok = av_write_trailer(output_format_context) >= 0 && (ret == AVERROR_EOF || ret >= 0);
 
+end:
     // 关闭
+    av_packet_free(&packet);
     avformat_close_input(&input_format_context);
     if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
         avio_closep(&output_format_context->pb);
     avformat_free_context(output_format_context);
-    return 0;
-}
\ No newline at end of file
+    return result;
+}
+
+static bool LoadManifest(const std::string &manifest, std::vector<std::pair<std::string, std::string>> &jobs)
+{
+    std::ifstream file(manifest);
+    if (!file)
+        return false;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string in, out;
+        if (!(fields >> in) || in[0] == '#')
+            continue;
+        if (!(fields >> out))
+        {
+            fprintf(stderr, "missing output for '%s'\n", in.c_str());
+            continue;
+        }
+        jobs.emplace_back(in, out);
+    }
+    return true;
+}
+
+// 固定数量的工作线程依次领取任务，一个进程处理整个清单，省掉每个文件的进程启动开销
+static int RemuxBatch(const std::string &manifest, int workers)
+{
+    std::vector<std::pair<std::string, std::string>> jobs;
+    if (!LoadManifest(manifest, jobs))
+    {
+        fprintf(stderr, "Could not open manifest '%s'\n", manifest.c_str());
+        return -1;
+    }
+    av_log_set_level(AV_LOG_ERROR);
+
+    LayoutCache cache;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> succeeded{0};
+    std::atomic<size_t> reused{0};
+    std::atomic<uint64_t> bytes{0};
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    workers = std::max(1, std::min<int>(workers, jobs.size()));
+    for (int i = 0; i < workers; i++)
+    {
+        threads.emplace_back([&]() {
+            for (size_t k = next++; k < jobs.size(); k = next++)
+            {
+                RemuxResult result = Remux(jobs[k].first, jobs[k].second, &cache, "", false);
+                if (!result.ok)
+                {
+                    fprintf(stderr, "failed to remux '%s' -> '%s'\n", jobs[k].first.c_str(), jobs[k].second.c_str());
+                    continue;
+                }
+                succeeded++;
+                reused += result.layout_reused;
+                bytes += result.bytes;
+            }
+        });
+    }
+    for (auto &&thd : threads)
+        thd.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    printf("files: %zu, succeeded: %zu, failed: %zu, probe skipped: %zu\n",
+           jobs.size(), succeeded.load(), jobs.size() - succeeded.load(), reused.load());
+    printf("payload: %.2f MB in %.3f s, %.2f MB/s, %.1f files/s\n",
+           bytes / 1e6, seconds, seconds > 0 ? bytes / 1e6 / seconds : 0.0, seconds > 0 ? jobs.size() / seconds : 0.0);
+    return succeeded == jobs.size() ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+    const char *optstring = "i:o:l:j:c:h";
+    std::string in_filename;
+    std::string out_filename;
+    std::string manifest;
+    std::string stream_cache;
+    int workers = std::max(1u, std::thread::hardware_concurrency());
+    TimeRange range;
+    const option long_opts[] = {
+        {"ss", required_argument, nullptr, 's'},
+        {"to", required_argument, nullptr, 't'},
+        {"seek_index", required_argument, nullptr, 'x'},
+        {0, 0, 0, 0}};
+    // 长选项也可以只写一个-，和ffmpeg的-ss/-to一样
+    while ((ret = getopt_long_only(argc, argv, optstring, long_opts, nullptr)) != -1)
+    {
+        switch (ret)
+        {
+        case 's':
+        case 't':
+            if (av_parse_time(ret == 's' ? &range.start : &range.end, optarg, 1) < 0)
+            {
+                fprintf(stderr, "invalid time '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'x':
+            range.index = optarg;
+            break;
+        case 'i':
+            in_filename = optarg;
+            break;
+        case 'o':
+            out_filename = optarg;
+            break;
+        case 'l':
+            manifest = optarg;
+            break;
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case 'c':
+            stream_cache = optarg;
+            break;
+        case 'h':
+            printf(usage_string);
+            return 0;
+        case '?':
+            printf("error optopt: %c\n", optopt);
+            printf("error opterr: %d\n", opterr);
+            break;
+        default:
+            break;
+        }
+    }
+    if (!manifest.empty())
+    {
+        return RemuxBatch(manifest, workers);
+    }
+    if (!in_filename.size() || !out_filename.size())
+    {
+        printf("please give a input url and a output url\n");
+        return -1;
+    }
+    return Remux(in_filename, out_filename, nullptr, stream_cache, true, range).ok ? 0 : -1;
+}
@@ -0,0 +1,314 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <sstream>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#ifdef __cplusplus
+}
+#endif
+
+/*
+    探测结果缓存：第一次打开时照常avformat_find_stream_info，把每个流的codecpar、时间基和extradata
+    写成文本文件；之后再打开同一个源(比如直播频道重启)时，只要解封装器给出的流和缓存对得上，
+    就直接套用缓存跳过探测，TS输入不必再先解码几秒数据才能出第一个包
+*/
+
+// 都是整数(或者枚举)的codecpar字段
+#define STREAM_CACHE_PAR_FIELDS(X) \
+    X(codec_type)                  \
+    X(codec_id)                    \
+    X(codec_tag)                   \
+    X(format)                      \
+    X(bit_rate)                    \
+    X(bits_per_coded_sample)       \
+    X(bits_per_raw_sample)         \
+    X(profile)                     \
+    X(level)                       \
+    X(width)                       \
+    X(height)                      \
+    X(field_order)                 \
+    X(color_range)                 \
+    X(color_primaries)             \
+    X(color_trc)                   \
+    X(color_space)                 \
+    X(chroma_location)             \
+    X(video_delay)                 \
+    X(sample_rate)                 \
+    X(block_align)                 \
+    X(frame_size)                  \
+    X(initial_padding)             \
+    X(trailing_padding)            \
+    X(seek_preroll)
+
+struct CachedStream
+{
+    CachedStream() : codecpar(avcodec_parameters_alloc()) {}
+    ~CachedStream()
+    {
+        avcodec_parameters_free(&codecpar);
+    }
+    CachedStream(const CachedStream &) = delete;
+    CachedStream &operator=(const CachedStream &) = delete;
+
+    int id{0};
+    int demuxer_codec_id{AV_CODEC_ID_NONE};    // 探测之前解封装器给出的编码类型，用来判断缓存是否还对得上
+    AVCodecParameters *codecpar;
+    AVRational time_base{0, 1};
+    AVRational avg_frame_rate{0, 1};
+    AVRational r_frame_rate{0, 1};
+};
+
+struct StreamCache
+{
+    static constexpr int kVersion = 1;
+
+    std::string format;
+    std::vector<std::unique_ptr<CachedStream>> streams;
+
+    // demuxer_codec_ids是avformat_open_input之后、探测之前各流的codec_id
+    bool Save(const std::string &path, const AVFormatContext *fmt_ctx, const std::vector<int> &demuxer_codec_ids);
+    bool Load(const std::string &path);
+    // 流的个数、id、编码类型都一致才套用，返回false时fmt_ctx保持原样
+    bool Apply(AVFormatContext *fmt_ctx) const;
+};
+
+inline bool StreamCache::Save(const std::string &path, const AVFormatContext *fmt_ctx,
+                              const std::vector<int> &demuxer_codec_ids)
+{
+    std::ostringstream out;
+    out << "stream_cache " << kVersion << "\n";
+    out << "input_format " << fmt_ctx->iformat->name << "\n";
+    out << "streams " << fmt_ctx->nb_streams << "\n";
+    for (uint32_t i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        const AVStream *st = fmt_ctx->streams[i];
+        const AVCodecParameters *par = st->codecpar;
+        out << "stream " << i << "\n";
+        out << "id " << st->id << "\n";
+        out << "demuxer_codec_id " << (i < demuxer_codec_ids.size() ? demuxer_codec_ids[i] : AV_CODEC_ID_NONE) << "\n";
+        out << "time_base " << st->time_base.num << " " << st->time_base.den << "\n";
+        out << "avg_frame_rate " << st->avg_frame_rate.num << " " << st->avg_frame_rate.den << "\n";
+        out << "r_frame_rate " << st->r_frame_rate.num << " " << st->r_frame_rate.den << "\n";
+#define X(field) out << #field " " << static_cast<int64_t>(par->field) << "\n";
+        STREAM_CACHE_PAR_FIELDS(X)
+#undef X
+        out << "sample_aspect_ratio " << par->sample_aspect_ratio.num << " " << par->sample_aspect_ratio.den << "\n";
+        out << "ch_layout " << par->ch_layout.order << " " << par->ch_layout.nb_channels << " "
+            << (par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0) << "\n";
+        out << "extradata ";
+        char hex[3];
+        for (int k = 0; k < par->extradata_size; k++)
+        {
+            snprintf(hex, sizeof(hex), "%02x", par->extradata[k]);
+            out << hex;
+        }
+        out << "\n";
+    }
+
+    // 先写临时文件再改名，另一个进程同时读也不会读到半个文件
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        if (!file || !(file << out.str()) || !file.flush())
+            return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// 十六进制数字的值，不是十六进制数字时返回-1
+inline int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+inline bool StreamCache::Load(const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+    format.clear();
+    streams.clear();
+    std::string line;
+    int version = 0;
+    CachedStream *cur = nullptr;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string key;
+        if (!(fields >> key))
+            continue;
+        if (key == "stream_cache")
+        {
+            fields >> version;
+            continue;
+        }
+        if (key == "input_format")
+        {
+            fields >> format;
+            continue;
+        }
+        if (key == "stream")
+        {
+            streams.emplace_back(new CachedStream);
+            cur = streams.back().get();
+            continue;
+        }
+        if (!cur || !cur->codecpar)
+            continue;
+        AVCodecParameters *par = cur->codecpar;
+        if (key == "id")
+            fields >> cur->id;
+        else if (key == "demuxer_codec_id")
+            fields >> cur->demuxer_codec_id;
+        else if (key == "time_base")
+            fields >> cur->time_base.num >> cur->time_base.den;
+        else if (key == "avg_frame_rate")
+            fields >> cur->avg_frame_rate.num >> cur->avg_frame_rate.den;
+        else if (key == "r_frame_rate")
+            fields >> cur->r_frame_rate.num >> cur->r_frame_rate.den;
+        else if (key == "sample_aspect_ratio")
+            fields >> par->sample_aspect_ratio.num >> par->sample_aspect_ratio.den;
+        else if (key == "ch_layout")
+        {
+            int order = 0, nb_channels = 0;
+            uint64_t mask = 0;
+            fields >> order >> nb_channels >> mask;
+            av_channel_layout_uninit(&par->ch_layout);
+            if (order == AV_CHANNEL_ORDER_NATIVE)
+                av_channel_layout_from_mask(&par->ch_layout, mask);
+            else if (nb_channels > 0)
+                av_channel_layout_default(&par->ch_layout, nb_channels);
+        }
+        else if (key == "extradata")
+        {
+            std::string hex;
+            fields >> hex;
+            av_freep(&par->extradata);
+            par->extradata_size = 0;
+            if (hex.empty())
+                continue;
+            // 文件损坏或者被改过时放弃缓存，回到探测
+            if (hex.size() % 2)
+                return false;
+            const int size = hex.size() / 2;
+            par->extradata = static_cast<uint8_t *>(av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE));
+            if (!par->extradata)
+                return false;
+            for (int k = 0; k < size; k++)
+            {
+                const int hi = HexDigit(hex[k * 2]), lo = HexDigit(hex[k * 2 + 1]);
+                if (hi < 0 || lo < 0)
+                    return false;
+                par->extradata[k] = static_cast<uint8_t>(hi << 4 | lo);
+            }
+            par->extradata_size = size;
+        }
+#define X(field)                                                   \
+        else if (key == #field)                                    \
+        {                                                          \
+            int64_t value = 0;                                     \
+            fields >> value;                                       \
+            par->field = static_cast<decltype(par->field)>(value); \
+        }
+        STREAM_CACHE_PAR_FIELDS(X)
+#undef X
+    }
+    return version == kVersion && !format.empty() && !streams.empty();
+}
+
+inline bool StreamCache::Apply(AVFormatContext *fmt_ctx) const
+{
+    if (format != fmt_ctx->iformat->name || streams.size() != fmt_ctx->nb_streams)
+        return false;
+    for (uint32_t i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        const AVStream *st = fmt_ctx->streams[i];
+        const CachedStream &cached = *streams[i];
+        if (st->id != cached.id || st->codecpar->codec_type != cached.codecpar->codec_type ||
+            st->codecpar->codec_id != cached.demuxer_codec_id)
+            return false;
+    }
+    for (uint32_t i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        AVStream *st = fmt_ctx->streams[i];
+        const CachedStream &cached = *streams[i];
+        if (avcodec_parameters_copy(st->codecpar, cached.codecpar) < 0)
+            return false;
+        // 时间基以解封装器为准，缓存只补探测才能得到的帧率
+        st->avg_frame_rate = cached.avg_frame_rate;
+        st->r_frame_rate = cached.r_frame_rate;
+    }
+    return true;
+}
+
+// 打开输入并取得流参数，返回值和avformat_open_input一样
+// cache_path为空时等同于avformat_open_input+avformat_find_stream_info；
+// 缓存可用时跳过探测，fast置为true；缓存不存在或者和实际流对不上时照常探测并重写缓存
+// options原样交给avformat_open_input，比如直播输入的协议选项
+inline int OpenInputWithCache(AVFormatContext **fmt_ctx, const char *url, const std::string &cache_path,
+                              bool *fast = nullptr, AVDictionary **options = nullptr)
+{
+    if (fast)
+        *fast = false;
+    StreamCache cache;
+    bool cached = !cache_path.empty() && cache.Load(cache_path);
+    // 封装格式已知，不再读数据猜格式
+    // iformat->name可能是逗号分隔的一组名字(比如mov,mp4,...)，按第一个名字查找
+    const AVInputFormat *iformat = cached ? av_find_input_format(cache.format.substr(0, cache.format.find(',')).c_str()) : nullptr;
+    // 失败时avformat_open_input会释放调用者预先分配的上下文，不用缓存的格式重试前按原来的设置重新分配
+    const AVFormatContext *pre = *fmt_ctx;
+    const AVIOInterruptCB interrupt_callback = pre ? pre->interrupt_callback : AVIOInterruptCB{nullptr, nullptr};
+    const int64_t probesize = pre ? pre->probesize : 0;
+    const int64_t max_analyze_duration = pre ? pre->max_analyze_duration : 0;
+    const int flags = pre ? pre->flags : 0;
+    int ret = avformat_open_input(fmt_ctx, url, iformat, options);
+    if (ret < 0 && iformat)
+    {
+        // 缓存过时(比如文件换了封装格式)，照常猜格式，下面重新探测并重写缓存
+        cached = false;
+        if (pre)
+        {
+            if (!(*fmt_ctx = avformat_alloc_context()))
+                return AVERROR(ENOMEM);
+            (*fmt_ctx)->interrupt_callback = interrupt_callback;
+            (*fmt_ctx)->probesize = probesize;
+            (*fmt_ctx)->max_analyze_duration = max_analyze_duration;
+            (*fmt_ctx)->flags = flags;
+        }
+        ret = avformat_open_input(fmt_ctx, url, nullptr, options);
+    }
+    if (ret < 0)
+        return ret;
+    if (cached && cache.Apply(*fmt_ctx))
+    {
+        if (fast)
+            *fast = true;
+        return 0;
+    }
+    std::vector<int> demuxer_codec_ids;
+    for (uint32_t i = 0; i < (*fmt_ctx)->nb_streams; i++)
+        demuxer_codec_ids.push_back((*fmt_ctx)->streams[i]->codecpar->codec_id);
+    ret = avformat_find_stream_info(*fmt_ctx, nullptr);
+    if (ret < 0)
+        return ret;
+    // 探测期间新出现的流下次打开时对不上，会回到探测的路径
+    if (!cache_path.empty())
+        cache.Save(cache_path, *fmt_ctx, demuxer_codec_ids);
+    return 0;
+}
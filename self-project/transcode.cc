@@ -2,36 +2,55 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <execinfo.h>
 #include <thread>
 #include <semaphore.h>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 #include "libavutil/rational.h"
+#include "libavutil/parseutils.h"
+#include "libavutil/time.h"
 #ifdef __cplusplus
 }
 #endif
 #include "transcode.h"
 
-#define logging(fmt, ...) fprintf(stderr, "[%s %d]" fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__);
-
 static constexpr char usage_string[] = "usage:\n"
                                        "    ./transcode [-i input] {[codec options] -o output}\n"
+                                       "every -o takes the codec options given before it, all outputs share one demux and decode\n"
                                        "-vcodec video_codec_type\n"
                                        "-acodec audio_codec_type\n"
                                        "-codec av_codec_type\tif output code type is the same as input codec type, please set -codec copy\n"
+                                       "-threads decoder_threads\tframe threads for decoding, 0 means auto\n"
+                                       "-vthreads encoder_threads\tvideo encoder threads (x264 threads), 0 means auto\n"
+                                       "-cache stream_cache\treuse stream info saved by a previous run instead of probing\n"
+                                       "-ss start -to end\tonly transcode this time range, seconds or [hh:]mm:ss[.xxx] from the start of the input\n"
+                                       "-seek_index index\tkeyframe index built by kf_index, -ss jumps straight to the keyframe instead of searching\n"
+                                       "-segments count\tsplit the video at keyframes into this many segments and encode them in parallel,\n"
+                                       "\t\tsplit points come from -seek_index or a scan of the input\n"
+                                       "-jobs count\tsegments encoded at the same time, 0 means number of cores\n"
+                                       "-metrics file\twrite per-stage counters and latency histograms (demux/decode/encode/mux) to this file,\n"
+                                       "\t\tPrometheus text format if it ends with .prom, JSON otherwise\n"
+                                       "-metrics_interval ms\thow often the metrics file is rewritten, default 1000\n"
+                                       "-live latency_ms\tlive input (udp/tcp/pipe...): short probing, zero-latency encoding, no mux buffering,\n"
+                                       "\t\tvideo frames are dropped while processing is more than latency_ms behind the input\n"
+                                       "Ctrl+C stops reading, flushes the encoders and finishes the output\n"
                                        "\n";
 
-char av_error[AV_ERROR_MAX_STRING_SIZE] = { 0 };
-#define err2str(errnum) av_make_error_string(av_error, AV_ERROR_MAX_STRING_SIZE, errnum)
-
 static sem_t sem;
+// Ctrl+C时置位，Transcoder::Interrupt读它，打开输入、探测时阻塞的读也能返回
+static std::atomic<bool> sigint_received{false};
 static void int_handler(int signum)
 {
     signal(SIGINT, SIG_DFL);
+    sigint_received = true;
     sem_post(&sem);
 }
 
@@ -50,177 +69,24 @@ static void segv_handler(int signum)
     exit(1);
 }
 
-bool CodecLayer::FillDecoder(AVStream *in_stream)
+// 解码、编码的指标按视频0、音频1存放
+static int MediaSlot(const CodecLayer &layer)
 {
-    index = in_stream->index;
-    stream = in_stream;
-    codec = avcodec_find_decoder(in_stream->codecpar->codec_id);
-    if (!codec)
-    {
-        logging("failed to find video decoder!");
-        return false;
-    }
-    if(codec_ctx){
-        avcodec_free_context(&codec_ctx);
-    }
-    codec_ctx = avcodec_alloc_context3(codec);
-    if (!codec_ctx)
-    {
-        logging("failed to alloc memory for codec context!");
-        return false;
-    }
-    if (avcodec_parameters_to_context(codec_ctx, in_stream->codecpar) < 0)
-    {
-        logging("failed to fill codec context!");
-        return false;
-    }
-
-    return true;
+    return layer.codec_ctx && layer.codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO ? 1 : 0;
 }
 
-bool CodecLayer::FillEncoderCopyFrom(AVCodecParameters *in_codecpar)
+static void CountPacket(StageMetrics *metrics, const AVPacket *pkt)
 {
-    if(avcodec_parameters_copy(stream->codecpar, in_codecpar) < 0)
-    {
-        return false;
-    }
-    return true;
-}
-
-bool CodecLayer::FillVideoEncoder(AVCodecContext *dec_ctx, const std::string& id, AVRational frame_rate)
-{
-    codec = avcodec_find_encoder_by_name(id.c_str());
-    if(!codec) {
-        logging("failed to find video encoder codec");
-        return false;
-    }
-    codec_ctx = avcodec_alloc_context3(codec);
-    if(!codec_ctx){
-        logging("failed to alloc context");
-        return false;
-    }
-
-    codec_ctx->height = dec_ctx->height;
-    codec_ctx->width = dec_ctx->width;
-    codec_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
-    if(codec->pix_fmts){
-        codec_ctx->pix_fmt = codec->pix_fmts[0];
+    if(metrics){
+        MetricsAdd(metrics->packets);
+        MetricsAdd(metrics->bytes, pkt->size);
     }
-    else{
-        codec_ctx->pix_fmt = dec_ctx->pix_fmt;
-    }
-
-    codec_ctx->bit_rate = 2 * 1000 * 1000;
-    codec_ctx->rc_buffer_size = 4 * 1000 * 1000;
-    codec_ctx->rc_max_rate = 2 * 1000 * 1000;
-    codec_ctx->rc_min_rate = 2.5 * 1000 * 1000;
-
-    stream->time_base = codec_ctx->time_base = av_inv_q(frame_rate);
-
-    avcodec_parameters_from_context(stream->codecpar, codec_ctx);
-
-    return true;
 }
 
-
-bool CodecLayer::FillAudioEncoder(AVCodecContext *dec_ctx, const std::string& id)
+static void CountError(StageMetrics *metrics)
 {
-    codec = avcodec_find_encoder_by_name(id.c_str());
-    if(!codec) {
-        logging("failed to find audio encoder codec");
-        return false;
-    }
-    codec_ctx = avcodec_alloc_context3(codec);
-    if(!codec_ctx){
-        logging("failed to alloc context");
-        return false;
-    }
-
-    codec_ctx->channels = 2;
-    codec_ctx->channel_layout = av_get_default_channel_layout(2);
-    codec_ctx->sample_rate = dec_ctx->sample_rate;
-    codec_ctx->sample_fmt = codec->sample_fmts[0];
-    codec_ctx->bit_rate = dec_ctx->bit_rate;
-
-    codec_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
-
-    stream->time_base = codec_ctx->time_base = (AVRational){1, dec_ctx->sample_rate};
-
-    avcodec_parameters_from_context(stream->codecpar, codec_ctx);
-
-    return true;
-}
-
-bool CodecLayer::OpenCodec()
-{
-    if (index != -1 && codec && codec_ctx && (avcodec_open2(codec_ctx, codec, NULL) >= 0))
-    {
-        return true;
-    }
-    else
-    {
-        logging("failed to open codec!");
-        return false;
-    }
-}
-
-bool CodecLayer::CodecExist() const
-{
-    if (index != -1 && stream && codec && codec_ctx)
-    {
-        return true;
-    }
-    else
-    {
-        return false;
-    }
-}
-
-bool CodecLayer::Decode(AVPacket *in_pkt, AVFrame *out_frame)
-{
-    if(!in_pkt || !out_frame){
-        return false;
-    }
-    int res = avcodec_send_packet(codec_ctx, in_pkt);
-    if(res < 0){
-        logging("error while sending packet to decoder: [%s]", err2str(res));
-        return false;
-    }
-    res = avcodec_receive_frame(codec_ctx, out_frame);
-    if(res >= 0){
-        return true;
-    }
-    else if(res == AVERROR(EAGAIN) || res == AVERROR_EOF){
-        logging("cannot receive frame from decoder this time, try again");
-        return false;
-    }
-    else{ // <0
-        logging("error while receive frame from decoder: [%s]", err2str(res));
-        return false;
-    }
-}
-
-bool CodecLayer::Encode(AVFrame *in_frame, AVPacket *out_pkt)
-{
-    if(!in_frame || !out_pkt){
-        return false;
-    }
-    int res = avcodec_send_frame(codec_ctx, in_frame);
-    if(res < 0){
-        logging("error while sending frame to encoder: [%s]", err2str(res));
-        return false;
-    }
-    res = avcodec_receive_packet(codec_ctx, out_pkt);
-    if(res >= 0){
-        return true;
-    }
-    else if(res == AVERROR(EAGAIN) || res == AVERROR_EOF){
-        logging("cannot receive packet frame encoder this time, try again");
-        return false;
-    }
-    else{
-        logging("error while receive frame frome encoder: [%s]", err2str(res));
-        return false;
+    if(metrics){
+        MetricsAdd(metrics->errors);
     }
 }
 
@@ -269,16 +135,16 @@ bool PackageLayer::FillEncoderSetby(const CodecLayer &in_stream_ctx, const std::
     bool ret = true;
     if (in_stream_ctx.stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
     {
-        v_codec_layer_.index = 0;
         v_codec_layer_.stream = avformat_new_stream(avfmt, nullptr);
+        v_codec_layer_.index = v_codec_layer_.stream->index;
         AVRational input_framerate = av_guess_frame_rate(nullptr, in_stream_ctx.stream, nullptr);
         ret = v_codec_layer_.FillVideoEncoder(in_stream_ctx.codec_ctx, id, input_framerate);
         if(!ret) logging("failed to fill video encoder!");
     }
     else if (in_stream_ctx.stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
     {
-        a_codec_layer_.index = 1;
         a_codec_layer_.stream = avformat_new_stream(avfmt, nullptr);
+        a_codec_layer_.index = a_codec_layer_.stream->index;
         ret = a_codec_layer_.FillAudioEncoder(in_stream_ctx.codec_ctx, id);
         if(!ret) logging("failed to fill audio encoder!");
     }
@@ -295,15 +161,15 @@ bool PackageLayer::OpenFileAndInit()
     if(!avfmt->oformat){
         return false;
     }
-    if(avfmt->oformat->flags & AVFMT_GLOBALHEADER){
-        avfmt->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    }
     if(!(avfmt->oformat->flags & AVFMT_NOFILE)){
         if(avio_open(&avfmt->pb, file_name.c_str(), AVIO_FLAG_WRITE) < 0){
             logging("failed to open output file!");
             return false; 
         }
     }
+    if(low_delay){
+        avfmt->flush_packets = 1;
+    }
     if(avformat_write_header(avfmt, nullptr) < 0){
         logging("failed to write output header!");
         return false;
@@ -316,9 +182,13 @@ void PackageLayer::WirteTailAndClose()
     av_write_trailer(avfmt);
 }
 
-bool PackageLayer::ReadPacket(AVPacket *in_pkt)
+bool PackageLayer::ReadPacket(AVPacket *in_pkt, int *err)
 {
-    if(av_read_frame(avfmt, in_pkt) >= 0){
+    int ret = av_read_frame(avfmt, in_pkt);
+    if(err){
+        *err = ret;
+    }
+    if(ret >= 0){
         return true;
     }
     else{
@@ -328,8 +198,9 @@ bool PackageLayer::ReadPacket(AVPacket *in_pkt)
 
 bool PackageLayer::WritePacket(AVPacket *out_pkt)
 {   
-
-    if(av_interleaved_write_frame(avfmt, out_pkt) >= 0){
+    // 交织要等所有流都有包才写，直播时音视频的间隔直接变成延迟
+    int ret = low_delay ? av_write_frame(avfmt, out_pkt) : av_interleaved_write_frame(avfmt, out_pkt);
+    if(ret >= 0){
         return true;
     }
     else{
@@ -337,23 +208,115 @@ bool PackageLayer::WritePacket(AVPacket *out_pkt)
     }
 }
 
+void OutputLayer::StartWriter()
+{
+    writer_ = std::thread(&OutputLayer::WriteLoop, this);
+}
+
+void OutputLayer::Push(AVPacket *pkt, bool live)
+{
+    const AVStream *video = package.v_codec_layer_.stream;
+    const bool is_video = video && pkt->stream_index == video->index;
+    AVPacket *queued = SharedPacketPool().Get();
+    {
+        std::unique_lock<std::mutex> ulk(mutex_);
+        if(live){
+            // 丢过视频包之后要从关键帧接上，不然后面的帧参考不到
+            if(!queued || queue_.size() >= kQueueLimit || (is_video && wait_key_ && !(pkt->flags & AV_PKT_FLAG_KEY))){
+                wait_key_ |= is_video;
+                dropped++;
+                av_packet_unref(pkt);
+                ulk.unlock();
+                SharedPacketPool().Put(queued);
+                return;
+            }
+            wait_key_ &= !is_video;
+        }
+        else{
+            cv_.wait(ulk, [this]() { return queue_.size() < kQueueLimit; });
+        }
+        if(queued){
+            av_packet_move_ref(queued, pkt);
+            queue_.push_back(queued);
+        }
+    }
+    cv_.notify_all();
+}
+
+size_t OutputLayer::Queued()
+{
+    std::lock_guard<std::mutex> lkg(mutex_);
+    return queue_.size();
+}
+
+void OutputLayer::WriteLoop()
+{
+    while(true){
+        AVPacket *pkt = nullptr;
+        {
+            std::unique_lock<std::mutex> ulk(mutex_);
+            cv_.wait(ulk, [this]() { return finished_ || !queue_.empty(); });
+            if(queue_.empty()){
+                return;
+            }
+            pkt = queue_.front();
+            queue_.pop_front();
+        }
+        cv_.notify_all();
+        {
+            StageTimer timer(mux_metrics);
+            CountPacket(mux_metrics, pkt);
+            if(!package.WritePacket(pkt)){
+                CountError(mux_metrics);
+                logging("failed to write packet of stream %d to %s", pkt->stream_index, package.file_name.c_str());
+            }
+        }
+        SharedPacketPool().Put(pkt);
+    }
+}
+
+void OutputLayer::Finish()
+{
+    {
+        std::lock_guard<std::mutex> lkg(mutex_);
+        finished_ = true;
+    }
+    cv_.notify_all();
+    if(writer_.joinable()){
+        writer_.join();
+    }
+    package.WirteTailAndClose();
+}
+
 bool Transcoder::ParseParam(int argc, char **argv)
 {
     int lopt;
     option long_opts[] = {
         {"vcodec", required_argument, &lopt, 1},
         {"acodec", required_argument, &lopt, 2},
+        {"threads", required_argument, &lopt, 3},
+        {"vthreads", required_argument, &lopt, 4},
+        {"cache", required_argument, &lopt, 5},
+        {"ss", required_argument, &lopt, 6},
+        {"to", required_argument, &lopt, 7},
+        {"seek_index", required_argument, &lopt, 8},
+        {"segments", required_argument, &lopt, 9},
+        {"jobs", required_argument, &lopt, 10},
+        {"metrics", required_argument, &lopt, 11},
+        {"metrics_interval", required_argument, &lopt, 12},
+        {"live", required_argument, &lopt, 13},
         {0, 0, 0, 0}};
     int ret;
     int opt_index;
     const char *optstring = "i:o:h";
 
     std::string &in_filename = input_package_layer_.file_name;
-    std::string &out_filename = output_package_layer_.file_name;
-    v_encode_type_.clear();
-    a_encode_type_.clear();
+    // 编码选项先攒着，遇到-o交给这一路输出
+    std::string v_encode_type;
+    std::string a_encode_type;
 
-    while ((ret = getopt_long(argc, argv, optstring, long_opts, &opt_index)) != -1)
+    // 长选项可以只写一个-，和用法里的-vcodec、-ss一样
+    while ((ret = getopt_long_only(argc, argv, optstring, long_opts, &opt_index)) != -1)
     {
         if (ret == 'h')
         {
@@ -366,16 +329,56 @@ bool Transcoder::ParseParam(int argc, char **argv)
             in_filename = optarg;
             break;
         case 'o':
-            out_filename = optarg;
+            outputs_.emplace_back(new OutputLayer);
+            outputs_.back()->package.file_name = optarg;
+            outputs_.back()->v_encode_type = v_encode_type;
+            outputs_.back()->a_encode_type = a_encode_type;
+            v_encode_type.clear();
+            a_encode_type.clear();
             break;
         case 0:
             switch (lopt)
             {
             case 1:
-                v_encode_type_ = optarg;
+                v_encode_type = optarg;
                 break;
             case 2:
-                a_encode_type_ = optarg;
+                a_encode_type = optarg;
+                break;
+            case 3:
+                decode_threads_ = atoi(optarg);
+                break;
+            case 4:
+                encode_threads_ = atoi(optarg);
+                break;
+            case 5:
+                stream_cache_ = optarg;
+                break;
+            case 6:
+            case 7:
+                if (av_parse_time(lopt == 6 ? &start_ : &end_, optarg, 1) < 0)
+                {
+                    logging("invalid time %s", optarg);
+                    return false;
+                }
+                break;
+            case 8:
+                seek_index_ = optarg;
+                break;
+            case 9:
+                segments_ = atoi(optarg);
+                break;
+            case 10:
+                jobs_ = atoi(optarg);
+                break;
+            case 11:
+                metrics_file_ = optarg;
+                break;
+            case 12:
+                metrics_interval_ = atoi(optarg);
+                break;
+            case 13:
+                live_ms_ = atoi(optarg);
                 break;
             }
             break;
@@ -385,16 +388,22 @@ bool Transcoder::ParseParam(int argc, char **argv)
             break;
         }
     }
-    if (in_filename.empty() || out_filename.empty())
+    if (in_filename.empty() || outputs_.empty())
     {
         logging("input and output is neccessary!");
         return false;
     }
-    if(v_encode_type_.empty() || v_encode_type_ == "copy"){
-        v_copy_ = true;
+    // 写在最后一个-o后面的编码选项也给它，只有一路输出时选项放在-o前后都一样
+    OutputLayer &last = *outputs_.back();
+    if(last.v_encode_type.empty()){
+        last.v_encode_type = v_encode_type;
+    }
+    if(last.a_encode_type.empty()){
+        last.a_encode_type = a_encode_type;
     }
-    if(a_encode_type_.empty() || a_encode_type_ == "copy"){
-        a_copy_ = true;
+    for(auto &&out : outputs_){
+        out->v_copy = out->v_encode_type.empty() || out->v_encode_type == "copy";
+        out->a_copy = out->a_encode_type.empty() || out->a_encode_type == "copy";
     }
     return true;
 }
@@ -406,13 +415,23 @@ bool Transcoder::Open()
         logging("failed to open input!");
         return false;
     }
-    if(!OpenOutput())
+    if(!SeekInput())
     {
-        logging("failed to open output!");
+        logging("failed to seek input!");
         return false;
     }
-    if(!output_package_layer_.OpenFileAndInit()){
-        return false;
+    for(auto &&out : outputs_)
+    {
+        // 直播输出不等交织，编出来就写
+        out->package.low_delay = live_ms_ > 0;
+        if(!OpenOutput(*out))
+        {
+            logging("failed to open output %s!", out->package.file_name.c_str());
+            return false;
+        }
+        if(!out->package.OpenFileAndInit()){
+            return false;
+        }
     }
     return true;
 }
@@ -420,29 +439,49 @@ bool Transcoder::Open()
 void Transcoder::Close()
 {
     avformat_close_input(&input_package_layer_.avfmt);
-    if (output_package_layer_.avfmt && !(output_package_layer_.avfmt->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&output_package_layer_.avfmt->pb);
-
     if(input_package_layer_.avfmt) avformat_free_context(input_package_layer_.avfmt);
-    if(output_package_layer_.avfmt) avformat_free_context(output_package_layer_.avfmt);
     if(input_package_layer_.v_codec_layer_.codec_ctx) avcodec_free_context(&input_package_layer_.v_codec_layer_.codec_ctx);
     if(input_package_layer_.a_codec_layer_.codec_ctx) avcodec_free_context(&input_package_layer_.a_codec_layer_.codec_ctx); 
-    if(output_package_layer_.v_codec_layer_.codec_ctx) avcodec_free_context(&output_package_layer_.v_codec_layer_.codec_ctx);
-    if(output_package_layer_.a_codec_layer_.codec_ctx) avcodec_free_context(&output_package_layer_.a_codec_layer_.codec_ctx);
+    for(auto &&out : outputs_){
+        PackageLayer &output = out->package;
+        if (output.avfmt && !(output.avfmt->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&output.avfmt->pb);
+        if(output.avfmt) avformat_free_context(output.avfmt);
+        if(output.v_codec_layer_.codec_ctx) avcodec_free_context(&output.v_codec_layer_.codec_ctx);
+        if(output.a_codec_layer_.codec_ctx) avcodec_free_context(&output.a_codec_layer_.codec_ctx);
+    }
 }
 
 bool Transcoder::OpenInput()
 {
     // open media
-    input_package_layer_.avfmt = avformat_alloc_context();
-    if (avformat_open_input(&input_package_layer_.avfmt, input_package_layer_.file_name.c_str(), 0, 0) < 0)
+    AVFormatContext *avfmt = avformat_alloc_context();
+    input_package_layer_.avfmt = avfmt;
+    // Stop之后阻塞在网络读上的av_read_frame也能返回
+    avfmt->interrupt_callback.callback = &Transcoder::Interrupt;
+    avfmt->interrupt_callback.opaque = this;
+    AVDictionary *opts = nullptr;
+    if (live_ms_ > 0)
     {
-        return false;
+        // 探测不超过延迟预算，探测时读到的包不留，解码从最新的数据开始
+        avfmt->probesize = 500 * 1000;
+        avfmt->max_analyze_duration = live_ms_ * 1000LL;
+        avfmt->flags |= AVFMT_FLAG_NOBUFFER | AVFMT_FLAG_DISCARD_CORRUPT;
+        // udp接收缓冲溢出时丢包继续收，而不是报错
+        av_dict_set(&opts, "overrun_nonfatal", "1", 0);
     }
-    if (avformat_find_stream_info(input_package_layer_.avfmt, 0) < 0)
+    bool fast = false;
+    int ret = OpenInputWithCache(&input_package_layer_.avfmt, input_package_layer_.file_name.c_str(), stream_cache_, &fast, &opts);
+    av_dict_free(&opts);
+    if (ret < 0)
     {
+        logging("failed to open %s: [%s]", input_package_layer_.file_name.c_str(), err2str(ret));
         return false;
     }
+    if (fast)
+    {
+        logging("stream info loaded from %s", stream_cache_.c_str());
+    }
     av_dump_format(input_package_layer_.avfmt, 0, input_package_layer_.file_name.c_str(), 0);
 
     // set decoder
@@ -451,122 +490,731 @@ bool Transcoder::OpenInput()
         AVStream *stream = input_package_layer_.avfmt->streams[i];
         input_package_layer_.FillDecoder(stream);
     }
-    if (!input_package_layer_.v_codec_layer_.OpenCodec() || !input_package_layer_.a_codec_layer_.OpenCodec())
+    // 没有的流不打开，纯视频或纯音频的输入也能转
+    for (CodecLayer *layer : {&input_package_layer_.v_codec_layer_, &input_package_layer_.a_codec_layer_})
+    {
+        if (layer->index == -1)
+        {
+            continue;
+        }
+        layer->codec_ctx->pkt_timebase = layer->stream->time_base;
+        if (live_ms_ > 0)
+        {
+            // 帧线程每多一个线程就多缓存一帧，直播只用切片线程
+            layer->codec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+            layer->SetThreads(decode_threads_, false);
+        }
+        else
+        {
+            layer->SetThreads(decode_threads_);
+        }
+        if (layer == &input_package_layer_.v_codec_layer_)
+        {
+            v_buffers_.Attach(layer->codec_ctx);
+        }
+        if (!layer->OpenCodec())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// 有-ss时定位到之前最近的关键帧；解码的流从-ss处精确开始，copy的流从关键帧开始
+bool Transcoder::SeekInput()
+{
+    AVFormatContext *avfmt = input_package_layer_.avfmt;
+    const int64_t start_time = avfmt->start_time == AV_NOPTS_VALUE ? 0 : avfmt->start_time;
+    if (end_ != AV_NOPTS_VALUE)
+    {
+        end_ts_ = start_time + end_;
+    }
+    if (start_ == AV_NOPTS_VALUE)
+    {
+        return true;
+    }
+    bool indexed = false;
+    keyframe_ = ::SeekInput(avfmt, start_, seek_index_, &indexed);
+    if (keyframe_ == AV_NOPTS_VALUE)
     {
         return false;
     }
+    origin_ = start_time + start_;
+    logging("seek to %.3f s, keyframe at %.3f s located by %s", origin_ / 1e6, keyframe_ / 1e6,
+            indexed ? "keyframe index" : "demuxer");
+    return true;
+}
 
+// copy的包按-ss平移时间戳，返回false表示这个包不要
+// 视频从关键帧开始整组保留，其他流丢掉关键帧之前的包
+bool Transcoder::Trim(CodecLayer &dec, AVPacket *pkt, bool copy)
+{
+    if (!copy || start_ == AV_NOPTS_VALUE)
+    {
+        return true;
+    }
+    if (dec.stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO && pkt->pts != AV_NOPTS_VALUE &&
+        av_compare_ts(pkt->pts, dec.stream->time_base, keyframe_, AV_TIME_BASE_Q) < 0)
+    {
+        return false;
+    }
+    const int64_t offset = av_rescale_q(origin_, AV_TIME_BASE_Q, dec.stream->time_base);
+    if (pkt->pts != AV_NOPTS_VALUE)
+    {
+        pkt->pts -= offset;
+    }
+    if (pkt->dts != AV_NOPTS_VALUE)
+    {
+        pkt->dts -= offset;
+    }
     return true;
 }
 
-bool Transcoder::OpenOutput()
+bool Transcoder::OpenOutput(OutputLayer &out)
 {
-    avformat_alloc_output_context2(&output_package_layer_.avfmt, nullptr, nullptr, output_package_layer_.file_name.c_str());
-    if (!output_package_layer_.avfmt)
+    PackageLayer &output = out.package;
+    avformat_alloc_output_context2(&output.avfmt, nullptr, nullptr, output.file_name.c_str());
+    if (!output.avfmt)
     {
         logging("failed to alloce output format context!");
         return false;
     }
     if (input_package_layer_.v_codec_layer_.CodecExist())
     {
-        if (v_copy_)
+        if (out.v_copy)
         {
-            output_package_layer_.FillEncoderCopyFrom(input_package_layer_.v_codec_layer_);
+            output.FillEncoderCopyFrom(input_package_layer_.v_codec_layer_);
         }
         else
         {   
-            output_package_layer_.FillEncoderSetby(input_package_layer_.v_codec_layer_, v_encode_type_);
+            output.FillEncoderSetby(input_package_layer_.v_codec_layer_, out.v_encode_type);
         }
     }
     if (input_package_layer_.a_codec_layer_.CodecExist())
     {
-        if (a_copy_)
+        if (out.a_copy)
         {
-            output_package_layer_.FillEncoderCopyFrom(input_package_layer_.a_codec_layer_);
+            output.FillEncoderCopyFrom(input_package_layer_.a_codec_layer_);
         }
         else
         {
-            output_package_layer_.FillEncoderSetby(input_package_layer_.a_codec_layer_, a_encode_type_);
+            output.FillEncoderSetby(input_package_layer_.a_codec_layer_, out.a_encode_type);
         }
     }
 
-    if(!v_copy_ && !output_package_layer_.v_codec_layer_.OpenCodec()){
+    if(!out.v_copy && input_package_layer_.v_codec_layer_.CodecExist() &&
+       !OpenEncoder(out, output.v_codec_layer_, encode_threads_)){
         logging("failed to open video encoder!");
         return false;
     }
-    if(!a_copy_ && !output_package_layer_.a_codec_layer_.OpenCodec()){
+    if(!out.a_copy && input_package_layer_.a_codec_layer_.CodecExist() &&
+       !OpenEncoder(out, output.a_codec_layer_, 0)){
         logging("failed to open audio encoder!");
         return false;
     }
 
-    av_dump_format(output_package_layer_.avfmt, 0, output_package_layer_.file_name.c_str(), 1);
+    av_dump_format(output.avfmt, 0, output.file_name.c_str(), 1);
 
     return true;
 }
 
-void Transcoder::Work()
+bool Transcoder::OpenEncoder(OutputLayer &out, CodecLayer &layer, int threads)
 {
-    work_running_ = true;
+    // 全局头要在打开编码器之前设置，extradata在打开之后才有
+    if(out.package.avfmt->oformat->flags & AVFMT_GLOBALHEADER){
+        layer.codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    layer.SetThreads(threads);
+    if(live_ms_ > 0 && layer.codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO){
+        // 编码器不攒帧：没有B帧和前瞻，多线程按切片分，x264/x265用zerolatency
+        layer.codec_ctx->max_b_frames = 0;
+        layer.codec_ctx->thread_type = FF_THREAD_SLICE;
+        av_opt_set(layer.codec_ctx->priv_data, "tune", "zerolatency", 0);
+    }
+    if(!layer.OpenCodec()){
+        return false;
+    }
+    return avcodec_parameters_from_context(layer.stream->codecpar, layer.codec_ctx) >= 0;
+}
+
+// 编码输出的时间戳是编码器时间基，写之前转成输出流的时间基(写头之后可能被muxer改过)
+// 包交给这一路的写线程，写失败在写线程里记
+bool Transcoder::WriteEncoded(OutputLayer &out, CodecLayer &enc, AVPacket *pkt)
+{
+    pkt->stream_index = enc.stream->index;
+    av_packet_rescale_ts(pkt, enc.codec_ctx->time_base, enc.stream->time_base);
+    out.Push(pkt, live_ms_ > 0);
+    return true;
+}
+
+// 解码出的帧依次送给每一路输出的编码器，-ss/-to和直播丢帧对所有输出一样
+bool Transcoder::EncodeFrame(CodecLayer &dec, AVFrame *frame)
+{
+    const int slot = MediaSlot(dec);
+    int64_t pts = AV_NOPTS_VALUE;
+    if(frame){
+        const int64_t ts = frame->best_effort_timestamp;
+        // 定位到的关键帧和-ss之间、-to之后的帧只解码不编码
+        if(ts != AV_NOPTS_VALUE &&
+           ((start_ != AV_NOPTS_VALUE && av_compare_ts(ts, dec.stream->time_base, origin_, AV_TIME_BASE_Q) < 0) ||
+            (end_ts_ != AV_NOPTS_VALUE && av_compare_ts(ts, dec.stream->time_base, end_ts_, AV_TIME_BASE_Q) >= 0))){
+            return true;
+        }
+        if(live_ms_ > 0 && slot == 0 && LiveOverloaded(dec, frame)){
+            live_dropped_++;
+            return true;
+        }
+        pts = ts - av_rescale_q(origin_, AV_TIME_BASE_Q, dec.stream->time_base);
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+    }
+    bool ok = true;
+    for(auto &&out : outputs_){
+        CodecLayer &enc = slot ? out->package.a_codec_layer_ : out->package.v_codec_layer_;
+        if((slot ? out->a_copy : out->v_copy) || !enc.codec_ctx){
+            continue;
+        }
+        // 编码器送帧时会复制帧的属性，同一帧可以改了pts再送下一路
+        if(frame){
+            frame->pts = av_rescale_q(pts, dec.stream->time_base, enc.codec_ctx->time_base);
+        }
+        OutputLayer &output = *out;
+        StageMetrics *metrics = output.encode_metrics[slot];
+        StageTimer timer(metrics);
+        if(frame && metrics){
+            MetricsAdd(metrics->frames);
+        }
+        if(!enc.Encode(frame, enc_pkt_, [this, &output, &enc, metrics](AVPacket *pkt) {
+               CountPacket(metrics, pkt);
+               return WriteEncoded(output, enc, pkt);
+           })){
+            CountError(metrics);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int Transcoder::Interrupt(void *opaque)
+{
+    return static_cast<Transcoder *>(opaque)->interrupted_.load() || sigint_received.load();
+}
+
+// 直播时用墙钟对比输入时间戳估计积压：对齐基准取处理得最及时的那一帧，之后每帧比基准多出来的延迟就是积压
+// 积压超过预算后不再编码视频，解码器也跳过非参考帧，降到预算一半以下再恢复
+bool Transcoder::LiveOverloaded(CodecLayer &dec, const AVFrame *frame)
+{
+    static constexpr int64_t kResync = 10 * AV_TIME_BASE;
+    const int64_t ts = frame->best_effort_timestamp;
+    if(ts == AV_NOPTS_VALUE){
+        return live_lagging_;
+    }
+    const int64_t now = av_gettime_relative();
+    const int64_t media = av_rescale_q(ts, dec.stream->time_base, AV_TIME_BASE_Q);
+    int64_t lag = live_wall_ == AV_NOPTS_VALUE ? 0 : (now - live_wall_) - (media - live_media_);
+    // 第一帧，或者时间戳跳变(输入重启、回绕)时重新对齐
+    if(live_wall_ == AV_NOPTS_VALUE || lag > kResync || lag < -kResync){
+        live_wall_ = now;
+        live_media_ = media;
+        lag = 0;
+    }
+    else if(lag < 0){
+        live_wall_ += lag;
+        lag = 0;
+    }
+    const int64_t budget = live_ms_ * 1000LL;
+    if(!live_lagging_ && lag > budget){
+        live_lagging_ = true;
+        dec.codec_ctx->skip_frame = AVDISCARD_NONREF;
+        logging("%.0f ms behind the input, dropping video frames", lag / 1000.0);
+    }
+    else if(live_lagging_ && lag < budget / 2){
+        live_lagging_ = false;
+        dec.codec_ctx->skip_frame = AVDISCARD_DEFAULT;
+        logging("caught up with the input, %lu video frames dropped so far", static_cast<unsigned long>(live_dropped_));
+    }
+    return live_lagging_;
+}
+
+bool Transcoder::ReadInput(AVPacket *pkt, int *err)
+{
+    StageTimer timer(demux_metrics_);
+    if(!input_package_layer_.ReadPacket(pkt, err)){
+        return false;
+    }
+    CountPacket(demux_metrics_, pkt);
+    return true;
+}
+
+// 帧回调里的编码、封装各自计时，不算在解码里
+bool Transcoder::Decode(CodecLayer &dec, const AVPacket *pkt, const FrameSink &sink)
+{
+    StageMetrics *metrics = decode_metrics_[MediaSlot(dec)];
+    StageTimer timer(metrics);
+    if(pkt){
+        CountPacket(metrics, pkt);
+    }
+    bool ok = dec.Decode(pkt, frame_, [metrics, &sink](AVFrame *frame) {
+        if(metrics){
+            MetricsAdd(metrics->frames);
+        }
+        return sink(frame);
+    });
+    if(!ok){
+        CountError(metrics);
+    }
+    return ok;
+}
+
+// copy的输出各取一个包的引用，-ss平移和时间基转换都在自己的引用上做
+bool Transcoder::CopyPacket(OutputLayer &out, CodecLayer &dec, CodecLayer &enc, const AVPacket *pkt)
+{
+    AVPacket *copy = SharedPacketPool().Get();
+    if(!copy || av_packet_ref(copy, pkt) < 0){
+        SharedPacketPool().Put(copy);
+        return false;
+    }
+    if(Trim(dec, copy, true)){
+        av_packet_rescale_ts(copy, dec.stream->time_base, enc.stream->time_base);
+        copy->stream_index = enc.stream->index;
+        copy->pos = -1;
+        out.Push(copy, live_ms_ > 0);
+    }
+    SharedPacketPool().Put(copy);
+    return true;
+}
+
+// 有一路要转码就解码一次，解出的帧给所有转码的输出
+bool Transcoder::TranscodePacket(CodecLayer &dec, AVPacket *pkt)
+{
+    const int slot = MediaSlot(dec);
+    bool decode = false;
+    bool ok = true;
+    for(auto &&out : outputs_){
+        CodecLayer &enc = slot ? out->package.a_codec_layer_ : out->package.v_codec_layer_;
+        if(!enc.stream){
+            continue;
+        }
+        if(slot ? out->a_copy : out->v_copy){
+            ok &= CopyPacket(*out, dec, enc, pkt);
+        }
+        else{
+            decode = true;
+        }
+    }
+    if(!decode){
+        return ok;
+    }
+    // 一个包可能解出零到多帧，每帧又可能编出零到多个包
+    return Decode(dec, pkt, [this, &dec](AVFrame *frame) {
+        return EncodeFrame(dec, frame);
+    }) && ok;
+}
+
+// 输入读完后先冲刷解码器，解出来的帧照常编码，再冲刷编码器
+void Transcoder::FlushCodec(CodecLayer &dec)
+{
+    const int slot = MediaSlot(dec);
+    bool encoded = false;
+    for(auto &&out : outputs_){
+        encoded |= !(slot ? out->a_copy : out->v_copy) && (slot ? out->package.a_codec_layer_ : out->package.v_codec_layer_).codec_ctx;
+    }
+    if(!encoded || !dec.CodecExist()){
+        return;
+    }
+    Decode(dec, nullptr, [this, &dec](AVFrame *frame) {
+        return EncodeFrame(dec, frame);
+    });
+    EncodeFrame(dec, nullptr);
+}
+
+// 切点取自关键帧索引，-seek_index对不上时现场扫一遍输入
+bool Transcoder::PlanSegments(std::vector<VideoSegment> &segments)
+{
+    AVFormatContext *avfmt = input_package_layer_.avfmt;
+    KeyframeIndex index;
+    if(seek_index_.empty() || !index.Load(seek_index_) || !IndexMatches(index, avfmt)){
+        if(!index.Build(input_package_layer_.file_name)){
+            logging("failed to build keyframe index!");
+            return false;
+        }
+    }
+    const IndexedStream *primary = index.Primary();
+    if(!primary || primary->index != input_package_layer_.v_codec_layer_.index){
+        logging("keyframe index has no entries for the video stream!");
+        return false;
+    }
+    std::vector<KeyframeEntry> points = index.Split(segments_);
+    segments.resize(points.size());
+    for(size_t i = 0; i < points.size(); i++){
+        segments[i].start = points[i];
+        segments[i].end = i + 1 < points.size() ? points[i + 1].pts : AV_NOPTS_VALUE;
+    }
+    logging("video split into %zu segments", segments.size());
+    return true;
+}
+
+// 编码结果只增加一个引用，包结构体取自共享池
+static bool KeepPacket(VideoSegment &seg, const AVPacket *pkt)
+{
+    AVPacket *copy = SharedPacketPool().Get();
+    if(!copy || av_packet_ref(copy, pkt) < 0){
+        SharedPacketPool().Put(copy);
+        return false;
+    }
+    seg.packets.push_back(copy);
+    return true;
+}
+
+// 每段独立打开输入、解码器和编码器，编码器从一个新的闭合GOP开始，段与段之间没有参考关系
+void Transcoder::EncodeSegment(VideoSegment &seg, StageMetrics *metrics)
+{
+    AVFormatContext *avfmt = nullptr;
+    AVStream *in_stream = input_package_layer_.v_codec_layer_.stream;
+    CodecLayer dec;
+    CodecLayer enc;
     AVPacket *pkt = av_packet_alloc();
+    AVPacket *out_pkt = av_packet_alloc();
     AVFrame *frame = av_frame_alloc();
+    FrameBufferPool buffers;
+    AVStream *st = nullptr;
+    bool reached_end = false;
 
-    while(work_running_){
-        av_packet_unref(pkt);
-        av_frame_unref(frame);
-        if(input_package_layer_.ReadPacket(pkt)){
-            if(AVMEDIA_TYPE_VIDEO == input_package_layer_.avfmt->streams[pkt->stream_index]->codecpar->codec_type){;
-                if(!v_copy_){
-                    if(!input_package_layer_.v_codec_layer_.Decode(pkt, frame)){
-                        continue;
-                    }
-                    av_packet_unref(pkt);
-                    if(output_package_layer_.v_codec_layer_.Encode(frame, pkt)){
-                        continue;
-                    }
-                    av_frame_unref(frame);
-                    pkt->stream_index = output_package_layer_.v_codec_layer_.index;
-                    pkt->duration = output_package_layer_.v_codec_layer_.stream->time_base.den / 
-                    output_package_layer_.v_codec_layer_.stream->time_base.num / 
-                    input_package_layer_.v_codec_layer_.stream->avg_frame_rate.num * 
-                    input_package_layer_.v_codec_layer_.stream->avg_frame_rate.den;
-                }
+    // 流参数用主输入探测好的，不再每段探测一次，按流id找到同一个流
+    if(!pkt || !out_pkt || !frame || avformat_open_input(&avfmt, input_package_layer_.file_name.c_str(), nullptr, nullptr) < 0){
+        goto end;
+    }
+    for(uint32_t i = 0; i < avfmt->nb_streams; i++){
+        if(avfmt->streams[i]->id == in_stream->id && avfmt->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
+            st = avfmt->streams[i];
+        }
+        else{
+            avfmt->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    if(!st || !dec.FillDecoder(in_stream->codecpar, st->index)){
+        goto end;
+    }
+    dec.codec_ctx->pkt_timebase = st->time_base;
+    dec.SetThreads(1);
+    buffers.Attach(dec.codec_ctx);
+    enc.index = 0;
+    if(!dec.OpenCodec() ||
+       !enc.FillVideoEncoder(dec.codec_ctx, outputs_[0]->v_encode_type, av_guess_frame_rate(nullptr, in_stream, nullptr))){
+        goto end;
+    }
+    enc.codec_ctx->time_base = outputs_[0]->package.v_codec_layer_.codec_ctx->time_base;
+    // 新的编码器第一帧必然是I帧，也不会引用上一段，不需要额外的闭合GOP
+    enc.codec_ctx->flags |= outputs_[0]->package.v_codec_layer_.codec_ctx->flags;
+    // 段之间已经并行了，每个编码器默认只用一个线程
+    enc.SetThreads(encode_threads_ > 0 ? encode_threads_ : 1);
+    if(!enc.OpenCodec() || !SeekToEntry(avfmt, st->index, seg.start)){
+        goto end;
+    }
 
-                av_packet_rescale_ts(pkt, input_package_layer_.v_codec_layer_.stream->time_base,
-                    output_package_layer_.v_codec_layer_.stream->time_base);
+    {
+        auto encode = [&](AVFrame *f) {
+            if(f){
+                const int64_t ts = f->best_effort_timestamp;
+                // 开放GOP里关键帧后面、pts在关键帧之前的帧属于上一段
+                if(ts == AV_NOPTS_VALUE || ts < seg.start.pts){
+                    return true;
+                }
+                if(seg.end != AV_NOPTS_VALUE && ts >= seg.end){
+                    reached_end = true;
+                    return true;
+                }
+                f->pts = av_rescale_q(ts, st->time_base, enc.codec_ctx->time_base);
+                f->pict_type = AV_PICTURE_TYPE_NONE;
+                if(metrics){
+                    MetricsAdd(metrics->frames);
+                }
             }
-            else if(AVMEDIA_TYPE_AUDIO == input_package_layer_.avfmt->streams[pkt->stream_index]->codecpar->codec_type){
-                if(!a_copy_){
-                    if(!input_package_layer_.a_codec_layer_.Decode(pkt, frame)){
-                        continue;
-                    }
-                    av_packet_unref(pkt);
-                    if(!output_package_layer_.a_codec_layer_.Encode(frame, pkt)){
-                        continue;
+            return enc.Encode(f, out_pkt, [&seg](AVPacket *p) {
+                return KeepPacket(seg, p);
+            });
+        };
+        while(work_running_ && !reached_end && av_read_frame(avfmt, pkt) >= 0){
+            // pts在段尾之前的帧解码顺序一定在段尾之前，读到dts过了段尾就够了
+            if(pkt->stream_index != st->index){
+                av_packet_unref(pkt);
+                continue;
+            }
+            if(seg.end != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE && pkt->dts >= seg.end){
+                av_packet_unref(pkt);
+                break;
+            }
+            // 解码和编码在同一个线程里，记在一起
+            StageTimer timer(metrics);
+            CountPacket(metrics, pkt);
+            if(!dec.Decode(pkt, frame, encode)){
+                CountError(metrics);
+            }
+            av_packet_unref(pkt);
+        }
+        StageTimer timer(metrics);
+        dec.Decode(nullptr, frame, encode);
+        seg.ok = enc.Encode(nullptr, out_pkt, [&seg](AVPacket *p) {
+            return KeepPacket(seg, p);
+        });
+    }
+
+end:
+    if(!seg.ok){
+        logging("failed to encode segment at pts %ld", static_cast<long>(seg.start.pts));
+    }
+    av_frame_free(&frame);
+    av_packet_free(&out_pkt);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec.codec_ctx);
+    avcodec_free_context(&enc.codec_ctx);
+    avformat_close_input(&avfmt);
+}
+
+// 各段并行编码，这里按顺序取编好的段，和顺序读出的音频按时间交错写出
+// 只有一路输出时才分段；没能分段时返回false，由调用的一方按顺序转码
+// 编码最多领先写出jobs段，前面的段慢时后面编好的包不会都堆在内存里
+bool Transcoder::WorkSegmented()
+{
+    OutputLayer &output = *outputs_[0];
+    CodecLayer &v_dec = input_package_layer_.v_codec_layer_;
+    CodecLayer &a_dec = input_package_layer_.a_codec_layer_;
+    CodecLayer &v_enc = output.package.v_codec_layer_;
+    CodecLayer &a_enc = output.package.a_codec_layer_;
+    std::vector<VideoSegment> segments;
+    if(!PlanSegments(segments)){
+        logging("failed to plan segments, encoding sequentially");
+        return false;
+    }
+
+    std::mutex mu;
+    std::condition_variable cv;
+    std::atomic<size_t> next{0};
+    size_t written = 0;     // 已经写出的段数
+    bool aborted = false;   // 有一段编码失败，不再编后面的段
+    int jobs = jobs_ > 0 ? jobs_ : std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::min<int>(jobs, segments.size());
+    std::vector<std::thread> workers;
+    for(int i = 0; i < jobs; i++){
+        // 每个编码线程一组指标，保持单写者
+        StageMetrics *metrics = metrics_file_.empty() ? nullptr : metrics_.Stage(output.package.file_name, "segment");
+        workers.emplace_back([&, metrics]() {
+            for(size_t k = next++; k < segments.size(); k = next++){
+                {
+                    std::unique_lock<std::mutex> ulk(mu);
+                    cv.wait(ulk, [&]() { return k < written + jobs || aborted; });
+                    if(aborted){
+                        break;
                     }
-                    av_frame_unref(frame);
-                    pkt->stream_index = output_package_layer_.a_codec_layer_.index;
                 }
+                EncodeSegment(segments[k], metrics);
+                std::lock_guard<std::mutex> lkg(mu);
+                segments[k].done = true;
+                cv.notify_all();
+            }
+        });
+    }
 
-                av_packet_rescale_ts(pkt, input_package_layer_.a_codec_layer_.stream->time_base,
-                    output_package_layer_.a_codec_layer_.stream->time_base);
+    // 主输入只读音频
+    AVFormatContext *avfmt = input_package_layer_.avfmt;
+    avfmt->streams[v_dec.index]->discard = AVDISCARD_ALL;
+    AVPacket *pkt = av_packet_alloc();
+    bool audio_pending = false;
+    bool audio_eof = !a_enc.stream;
+    // 把dts不晚于until(AV_TIME_BASE)的音频写出去
+    auto write_audio = [&](int64_t until) {
+        while(true){
+            if(!audio_pending){
+                if(audio_eof){
+                    return;
+                }
+                av_packet_unref(pkt);
+                if(!ReadInput(pkt)){
+                    audio_eof = true;
+                    return;
+                }
+                if(pkt->stream_index != a_dec.index){
+                    continue;
+                }
+                audio_pending = true;
             }
-            else{
-                logging("not the type we need!");
-                continue;
+            if(pkt->dts != AV_NOPTS_VALUE && av_compare_ts(pkt->dts, a_dec.stream->time_base, until, AV_TIME_BASE_Q) > 0){
+                return;
             }
+            TranscodePacket(a_dec, pkt);
+            audio_pending = false;
+        }
+    };
 
-            output_package_layer_.WritePacket(pkt);
+    int64_t last_dts = AV_NOPTS_VALUE;
+    int adjusted = 0;
+    for(auto &&seg : segments){
+        {
+            std::unique_lock<std::mutex> ulk(mu);
+            cv.wait(ulk, [&seg]() { return seg.done; });
         }
-        else{
+        // 失败的段不写，否则视频中间会缺一段；到此为止，已经写出的部分照常写文件尾
+        if(!seg.ok){
+            logging("segment %zu of %zu failed, stopping", written + 1, segments.size());
+            failed_ = true;
+            std::lock_guard<std::mutex> lkg(mu);
+            aborted = true;
+            cv.notify_all();
+            break;
+        }
+        for(AVPacket *out : seg.packets){
+            // 前一段的尾巴和后一段开头的B帧延迟可能让dts重叠，拼接处保证单调递增
+            if(last_dts != AV_NOPTS_VALUE && out->dts <= last_dts){
+                out->dts = last_dts + 1;
+                out->pts = std::max(out->pts, out->dts);
+                adjusted++;
+            }
+            last_dts = out->dts;
+            write_audio(av_rescale_q(out->dts, v_enc.codec_ctx->time_base, AV_TIME_BASE_Q));
+            WriteEncoded(output, v_enc, out);
+            SharedPacketPool().Put(out);
+        }
+        seg.packets.clear();
+        std::lock_guard<std::mutex> lkg(mu);
+        written++;
+        cv.notify_all();
+    }
+    for(auto &&thd : workers){
+        thd.join();
+    }
+    // 中止时没写出的段也要把包还回去
+    for(auto &&seg : segments){
+        for(AVPacket *out : seg.packets){
+            SharedPacketPool().Put(out);
+        }
+        seg.packets.clear();
+    }
+    if(!failed_){
+        write_audio(INT64_MAX);
+    }
+    av_packet_free(&pkt);
+    if(adjusted){
+        logging("adjusted %d dts at segment boundaries", adjusted);
+    }
+    return true;
+}
+
+// 各路共享的解封装、解码以输入文件名作为通道名，编码、封装以各自的输出文件名作为通道名
+void Transcoder::StartMetrics()
+{
+    if(metrics_file_.empty()){
+        return;
+    }
+    const std::string &input = input_package_layer_.file_name;
+    const bool has_video = input_package_layer_.v_codec_layer_.index != -1;
+    const bool has_audio = input_package_layer_.a_codec_layer_.index != -1;
+    demux_metrics_ = metrics_.Stage(input, "demux");
+    for(auto &&out : outputs_){
+        const std::string &name = out->package.file_name;
+        if(has_video && !out->v_copy){
+            if(!decode_metrics_[0]){
+                decode_metrics_[0] = metrics_.Stage(input, "decode_video");
+            }
+            out->encode_metrics[0] = metrics_.Stage(name, "encode_video");
+        }
+        if(has_audio && !out->a_copy){
+            if(!decode_metrics_[1]){
+                decode_metrics_[1] = metrics_.Stage(input, "decode_audio");
+            }
+            out->encode_metrics[1] = metrics_.Stage(name, "encode_audio");
+        }
+        OutputLayer *output = out.get();
+        out->mux_metrics = metrics_.Stage(name, "mux", [output]() { return output->Queued(); });
+    }
+    exporter_.Start(metrics_, metrics_file_, metrics_interval_);
+}
+
+void Transcoder::Work()
+{
+    StartMetrics();
+    AVPacket *pkt = av_packet_alloc();
+    frame_ = av_frame_alloc();
+    enc_pkt_ = av_packet_alloc();
+
+    CodecLayer &v_dec = input_package_layer_.v_codec_layer_;
+    CodecLayer &a_dec = input_package_layer_.a_codec_layer_;
+    bool v_done = true;
+    bool a_done = true;
+    for(auto &&out : outputs_){
+        v_done &= !out->package.v_codec_layer_.stream;
+        a_done &= !out->package.a_codec_layer_.stream;
+        out->StartWriter();
+    }
+    // 分段并行只管视频编码，音频照常在这里顺序处理；-ss/-to的时候、多路输出的时候不分段
+    const OutputLayer &first = *outputs_[0];
+    bool segmented = segments_ > 1 && outputs_.size() == 1 && !first.v_copy && first.package.v_codec_layer_.stream &&
+                     start_ == AV_NOPTS_VALUE && end_ == AV_NOPTS_VALUE;
+    if(segments_ > 1 && outputs_.size() > 1){
+        logging("-segments is ignored with %zu outputs, decoding once for all of them", outputs_.size());
+    }
+    if(segmented){
+        segmented = WorkSegmented();
+    }
+    while(work_running_ && !segmented){
+        av_packet_unref(pkt);
+        int err = 0;
+        if(!ReadInput(pkt, &err)){
+            // 直播输入读出错(网络抖动、接收超时)时接着读，只有读到结尾或者被Stop打断才结束
+            if(err == AVERROR(EAGAIN) || (live_ms_ > 0 && err != AVERROR_EOF && err != AVERROR_EXIT && work_running_)){
+                if(err != AVERROR(EAGAIN)){
+                    logging("error while reading input: [%s]", err2str(err));
+                    av_usleep(10 * 1000);
+                }
+                continue;
+            }
             break;
         }
-    }   
+        // 过了-to的流不再送包，都过了就不再读
+        if(end_ts_ != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE && pkt->stream_index < (int)input_package_layer_.avfmt->nb_streams &&
+           av_compare_ts(pkt->dts, input_package_layer_.avfmt->streams[pkt->stream_index]->time_base, end_ts_, AV_TIME_BASE_Q) >= 0){
+            v_done |= pkt->stream_index == v_dec.index;
+            a_done |= pkt->stream_index == a_dec.index;
+            if(v_done && a_done){
+                break;
+            }
+            continue;
+        }
+        if(pkt->stream_index == v_dec.index && !v_done){
+            TranscodePacket(v_dec, pkt);
+        }
+        else if(pkt->stream_index == a_dec.index && !a_done){
+            TranscodePacket(a_dec, pkt);
+        }
+    }
+
+    FlushCodec(v_dec);
+    FlushCodec(a_dec);
 
-    if(pkt) av_packet_free(&pkt);
-    if(frame) av_frame_free(&frame);
+    av_packet_free(&pkt);
+    av_packet_free(&enc_pkt_);
+    av_frame_free(&frame_);
 
-    output_package_layer_.WirteTailAndClose();
-    logging("write packet finished!");
+    // 等每一路把队列里的包写完再写文件尾
+    for(auto &&out : outputs_){
+        out->Finish();
+        if(out->dropped){
+            logging("%lu packets dropped while %s could not keep up", static_cast<unsigned long>(out->dropped),
+                    out->package.file_name.c_str());
+        }
+    }
+    exporter_.Stop();
+    if(live_dropped_){
+        logging("%lu video frames dropped to stay within %d ms", static_cast<unsigned long>(live_dropped_), live_ms_);
+    }
+    if(failed_){
+        logging("transcoding failed, output is incomplete");
+    }
+    else{
+        logging("write packet finished!");
+    }
+    if(on_finished_){
+        on_finished_();
+    }
 }
 
 void Transcoder::Start()
@@ -575,8 +1223,19 @@ void Transcoder::Start()
     work_thread_ = std::thread(&Transcoder::Work, this);
 }
 
+void Transcoder::SetFinishedCallback(std::function<void()> cb)
+{
+    on_finished_ = std::move(cb);
+}
+
+bool Transcoder::Failed() const
+{
+    return failed_;
+}
+
 void Transcoder::Stop()
 {
+    interrupted_ = true;
     work_running_ = false;
     if(work_thread_.joinable()){
         work_thread_.join();
@@ -585,18 +1244,29 @@ void Transcoder::Stop()
 
 int main(int argc, char **argv)
 {
+    // 转完或者Ctrl+C都会唤醒；Ctrl+C时停止读输入，照常冲刷编码器、写文件尾，再按一次直接退出
+    // 先初始化信号量再装信号处理，打开输入期间的Ctrl+C不会被sem_init冲掉
+    sem_init(&sem, 0, 0);
     signal(SIGINT, int_handler);
     signal(SIGSEGV, segv_handler);
     Transcoder transcoder;
     if (!transcoder.ParseParam(argc, argv))
     {
         logging("param is not valid!");
+        sem_destroy(&sem);
         return -1;
     }
     if(!transcoder.Open()){
+        sem_destroy(&sem);
         return -1;
     }
-    transcoder.Work();
+    transcoder.SetFinishedCallback([]() { sem_post(&sem); });
+    transcoder.Start();
+    while(sem_wait(&sem) < 0 && errno == EINTR){
+    }
+    transcoder.Stop();
+    const bool failed = transcoder.Failed();
     transcoder.Close();
-    return 0;
+    sem_destroy(&sem);
+    return failed ? -1 : 0;
 }
\ No newline at end of file
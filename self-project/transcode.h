@@ -3,6 +3,13 @@
 #include <string>
 #include <getopt.h>
 #include <thread>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #ifdef __cplusplus
 extern "C"
@@ -17,30 +24,16 @@ extern "C"
 #ifdef __cplusplus
 }
 #endif
+#include "codec_layer.h"
+#include "stream_cache.h"
+#include "keyframe_index.h"
+#include "media_pool.h"
+#include "metrics.h"
 
 /*
     in --> demuxer --av_packet--> decoder --av_frame--> coder --av_packet--> muxer --> out
 */
 
-// 把codec部分从avformat中提取出来自己掌控
-struct CodecLayer
-{
-    bool FillDecoder(AVStream *);
-    bool FillEncoderCopyFrom(AVCodecParameters *);
-    bool FillVideoEncoder(AVCodecContext *, const std::string &, AVRational);
-    bool FillAudioEncoder(AVCodecContext *, const std::string &);
-    bool OpenCodec();
-    bool CodecExist() const;
-
-    bool Decode(AVPacket *, AVFrame *);
-    bool Encode(AVFrame *, AVPacket *);
-
-    int index{-1};
-    AVStream *stream{nullptr};
-    const AVCodec *codec{nullptr};
-    AVCodecContext *codec_ctx{nullptr};
-};
-
 struct PackageLayer
 {
     bool FillDecoder(AVStream *);
@@ -50,15 +43,60 @@ struct PackageLayer
     bool OpenFileAndInit();
     void WirteTailAndClose();
 
-    bool ReadPacket(AVPacket *);
+    bool ReadPacket(AVPacket *, int *err = nullptr);
     bool WritePacket(AVPacket *);
 
     std::string file_name;
+    bool low_delay{false};      // 输出不做交织缓存，每个包写完就刷出去
     AVFormatContext *avfmt{nullptr};
     CodecLayer v_codec_layer_;
     CodecLayer a_codec_layer_;
 };
 
+// 一路输出：自己的编码器和封装，解码出的帧由各路共享
+// 封装在这一路自己的写线程里做，编好的包经队列交过去，一个目的地写得慢不会拖住其他输出
+struct OutputLayer
+{
+    static constexpr size_t kQueueLimit = 512;  // 队列里最多的包数
+
+    void StartWriter();
+    // 取走包的引用；队列满时直播丢包(视频一直丢到下一个关键帧)，不是直播就等写线程腾出位置
+    void Push(AVPacket *, bool live);
+    // 队列写完后写线程退出，再写文件尾
+    void Finish();
+    size_t Queued();
+
+    PackageLayer package;
+    std::string v_encode_type;
+    std::string a_encode_type;
+    bool v_copy{false};
+    bool a_copy{false};
+    // 没有打开指标时为nullptr；编码在工作线程里记，封装在写线程里记
+    StageMetrics *encode_metrics[2]{};
+    StageMetrics *mux_metrics{nullptr};
+    uint64_t dropped{0};                // 直播时队列满丢掉的包
+
+private:
+    void WriteLoop();
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<AVPacket *> queue_;
+    bool finished_{false};
+    bool wait_key_{false};
+    std::thread writer_;
+};
+
+// 并行编码的一段视频，按输入视频流的pts取[start.pts, end)，end为AV_NOPTS_VALUE表示到结尾
+struct VideoSegment
+{
+    KeyframeEntry start{-1, AV_NOPTS_VALUE};
+    int64_t end{AV_NOPTS_VALUE};
+    std::vector<AVPacket *> packets;    // 编码结果，编码器时间基
+    bool ok{false};
+    bool done{false};
+};
+
 class Transcoder
 {
 public:
@@ -68,20 +106,71 @@ public:
     void Work();
     void Start();
     void Stop();
+    // Work结束时在工作线程里调用，不管是转完还是被Stop
+    void SetFinishedCallback(std::function<void()>);
+    // Work结束后查询，分段编码有一段失败时为true
+    bool Failed() const;
 
 private:
     bool OpenInput();
-    bool OpenOutput();
+    bool OpenOutput(OutputLayer &);
+    bool OpenEncoder(OutputLayer &, CodecLayer &, int);
+    bool SeekInput();
+    bool Trim(CodecLayer &, AVPacket *, bool);
+
+    bool ReadInput(AVPacket *, int *err = nullptr);
+    bool LiveOverloaded(CodecLayer &, const AVFrame *);
+    static int Interrupt(void *);
+    bool Decode(CodecLayer &, const AVPacket *, const FrameSink &);
+    // 按流的类型取各路输出对应的编码器
+    bool TranscodePacket(CodecLayer &, AVPacket *);
+    bool CopyPacket(OutputLayer &, CodecLayer &, CodecLayer &, const AVPacket *);
+    bool EncodeFrame(CodecLayer &, AVFrame *);
+    bool WriteEncoded(OutputLayer &, CodecLayer &, AVPacket *);
+    void FlushCodec(CodecLayer &);
+
+    bool WorkSegmented();
+    bool PlanSegments(std::vector<VideoSegment> &);
+    void EncodeSegment(VideoSegment &, StageMetrics *);
+    void StartMetrics();
 
 private:
-    std::string v_encode_type_;
-    std::string a_encode_type_;
-    bool v_copy_{false};
-    bool a_copy_{false};
+    int decode_threads_{0};     // 0为自动，按核数开帧线程
+    int encode_threads_{0};     // 视频编码线程数，libx264的threads
+    std::string stream_cache_;  // 探测结果缓存文件，可用时跳过avformat_find_stream_info
+    int64_t start_{AV_NOPTS_VALUE};     // -ss，AV_TIME_BASE，从输入开头算起
+    int64_t end_{AV_NOPTS_VALUE};       // -to
+    std::string seek_index_;            // kf_index生成的关键帧索引，-ss直接查表定位
+    int64_t origin_{0};                 // 输出时间戳从这个输入时间开始，AV_TIME_BASE
+    int64_t keyframe_{AV_NOPTS_VALUE};  // 实际定位到的关键帧，copy的流从这里开始
+    int64_t end_ts_{AV_NOPTS_VALUE};
+    int segments_{0};                   // 大于1时在关键帧处切成这么多段，多个编码器并行编视频
+    int jobs_{0};                       // 同时编码的段数，0为核数
+
+    AVFrame *frame_{nullptr};
+    AVPacket *enc_pkt_{nullptr};
+    FrameBufferPool v_buffers_;         // 输入视频解码出的帧缓冲，编码完释放引用后回到池里
+
+    std::string metrics_file_;          // 各阶段的计数和耗时定期写到这个文件，.prom结尾为Prometheus格式
+    int metrics_interval_{1000};        // ms
+    MetricsRegistry metrics_;
+    MetricsExporter exporter_;
+    // 没有打开指标时都是nullptr，计时和计数都跳过；解码、编码按视频0、音频1区分
+    StageMetrics *demux_metrics_{nullptr};
+    StageMetrics *decode_metrics_[2]{};
+
+    int live_ms_{0};                    // 大于0为直播模式，端到端延迟预算
+    int64_t live_wall_{AV_NOPTS_VALUE}; // 直播对齐基准：这一墙钟时刻(us)处理到了输入的live_media_
+    int64_t live_media_{AV_NOPTS_VALUE};
+    bool live_lagging_{false};          // 积压超过预算，正在丢帧
+    uint64_t live_dropped_{0};
 
     PackageLayer input_package_layer_;
-    PackageLayer output_package_layer_;
+    std::vector<std::unique_ptr<OutputLayer>> outputs_;   // 按命令行里-o的顺序
 
-    bool work_running_{false};
+    std::atomic<bool> work_running_{false};
+    std::atomic<bool> interrupted_{false};  // Stop之后打断阻塞在输入上的读
+    std::atomic<bool> failed_{false};       // 转码没有完整做完，输出不完整
     std::thread work_thread_;
+    std::function<void()> on_finished_;
 };
\ No newline at end of file
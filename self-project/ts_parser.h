@@ -0,0 +1,208 @@
+#ifndef TS_PARSER_H
+#define TS_PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+    MPEG-TS单个包的解析，只看包头、自适应字段和PES头，不做解复用
+    C和C++都可以直接包含
+*/
+
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+#define TS_NULL_PID 0x1fff
+#define TS_MAX_PID 8192
+#define TS_NOPTS_VALUE ((int64_t)UINT64_C(0x8000000000000000))
+
+static inline int ts_pid(const uint8_t *packet)
+{
+    return ((packet[1] & 0x1f) << 8) | packet[2];
+}
+
+// payload_unit_start_indicator，PES或者PSI在本包开始
+static inline int ts_pusi(const uint8_t *packet)
+{
+    return (packet[1] >> 6) & 1;
+}
+
+static inline int ts_transport_error(const uint8_t *packet)
+{
+    return packet[1] >> 7;
+}
+
+// adaptation_field_control: 1只有负载，2只有自适应字段，3两者都有
+static inline int ts_afc(const uint8_t *packet)
+{
+    return (packet[3] >> 4) & 3;
+}
+
+static inline int ts_cc(const uint8_t *packet)
+{
+    return packet[3] & 0x0f;
+}
+
+static inline int ts_has_payload(const uint8_t *packet)
+{
+    return ts_afc(packet) & 1;
+}
+
+// 自适应字段的flags字节，没有自适应字段或者长度为0时返回0
+static inline int ts_af_flags(const uint8_t *packet)
+{
+    if (ts_afc(packet) <= 1 || packet[4] == 0)
+        return 0;
+    return packet[5];
+}
+
+static inline int ts_discontinuity(const uint8_t *packet)
+{
+    return (ts_af_flags(packet) >> 7) & 1;
+}
+
+static inline int ts_random_access(const uint8_t *packet)
+{
+    return (ts_af_flags(packet) >> 6) & 1;
+}
+
+// 连续计数器检查，*last_cc为该PID上一个带负载的包的计数器(初始为-1)，不连续返回1
+// 没有负载的包计数器不加一；允许重复发送一次，计数器不变；discontinuity_indicator置位时重新开始
+static inline int ts_check_cc(int *last_cc, const uint8_t *packet)
+{
+    int cc = ts_cc(packet);
+    int error = 0;
+    if (!ts_has_payload(packet))
+        return 0;
+    if (*last_cc >= 0 && !ts_discontinuity(packet))
+        error = cc != *last_cc && cc != ((*last_cc + 1) & 0x0f);
+    *last_cc = cc;
+    return error;
+}
+
+// 负载起始位置，没有负载或者自适应字段长度非法时返回NULL
+static inline const uint8_t *ts_payload(const uint8_t *packet)
+{
+    int afc = ts_afc(packet);
+    const uint8_t *p = packet + 4;
+    if (!(afc & 1))
+        return NULL;
+    if (afc == 3)
+    {
+        p += 1 + p[0];
+        if (p >= packet + TS_PACKET_SIZE)
+            return NULL;
+    }
+    return p;
+}
+
+static inline int ts_parse_pcr(int64_t *ppcr_high, int *ppcr_low, const uint8_t *packet)
+{
+    int afc, len, flags;
+    const uint8_t *p;
+    uint32_t v;
+
+    afc = (packet[3] >> 4) & 3;
+    if (afc <= 1)
+        return -1;
+    p   = packet + 4;
+    len = p[0];
+    p++;
+    if (len == 0)
+        return -1;
+    flags = *p++;
+    len--;
+    if (!(flags & 0x10))
+        return -1;
+    if (len < 6)
+        return -1;
+    v          = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    *ppcr_high = ((int64_t) v << 1) | (p[4] >> 7);
+    *ppcr_low  = ((p[4] & 1) << 8) | p[5];
+    return 0;
+}
+
+// 27MHz的完整PCR，没有PCR时返回-1
+static inline int64_t ts_pcr(const uint8_t *packet)
+{
+    int64_t high;
+    int low;
+    if (ts_parse_pcr(&high, &low, packet) < 0)
+        return -1;
+    return high * 300 + low;
+}
+
+static inline int64_t ts_parse_timestamp(const uint8_t *p)
+{
+    return ((int64_t)(p[0] & 0x0e) << 29) | (p[1] << 22) | ((p[2] >> 1) << 15) | (p[3] << 7) | (p[4] >> 1);
+}
+
+// 本包起始的PES头中的PTS/DTS(90kHz)，没有的字段置为TS_NOPTS_VALUE
+// 不是PES起始包或者PES头不在本包内时返回-1
+static inline int ts_parse_pes_timestamps(const uint8_t *packet, int64_t *pts, int64_t *dts)
+{
+    const uint8_t *p = ts_payload(packet);
+    int flags;
+    *pts = *dts = TS_NOPTS_VALUE;
+    if (!p || !ts_pusi(packet) || p + 14 > packet + TS_PACKET_SIZE)
+        return -1;
+    if (p[0] != 0x00 || p[1] != 0x00 || p[2] != 0x01)
+        return -1;
+    // program_stream_map、padding、private_stream_2等没有可选PES头
+    if (p[3] == 0xbc || p[3] == 0xbe || p[3] == 0xbf || p[3] == 0xf0 || p[3] == 0xf1 || p[3] == 0xff ||
+        p[3] == 0xf2 || p[3] == 0xf8)
+        return -1;
+    if ((p[6] & 0xc0) != 0x80)
+        return -1;
+    flags = p[7] >> 6;
+    if (flags & 2)
+        *pts = ts_parse_timestamp(p + 9);
+    if (flags == 3 && p + 19 <= packet + TS_PACKET_SIZE)
+        *dts = ts_parse_timestamp(p + 14);
+    return 0;
+}
+
+// 找第一个同步位置：连续三个包(剩余数据不够时取剩余的包)的首字节都是0x47
+// 返回相对buf的偏移，找不到返回size
+static inline size_t ts_find_sync(const uint8_t *buf, size_t size)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i sync = _mm256_set1_epi8(TS_SYNC_BYTE);
+    for (; i + 2 * TS_PACKET_SIZE + 32 <= size; i += 32)
+    {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), sync);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + TS_PACKET_SIZE)), sync);
+        __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 2 * TS_PACKET_SIZE)), sync);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), c));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i sync = _mm_set1_epi8(TS_SYNC_BYTE);
+    for (; i + 2 * TS_PACKET_SIZE + 16 <= size; i += 16)
+    {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), sync);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + TS_PACKET_SIZE)), sync);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 2 * TS_PACKET_SIZE)), sync);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < size; i++)
+    {
+        if (buf[i] != TS_SYNC_BYTE)
+            continue;
+        if (i + TS_PACKET_SIZE < size && buf[i + TS_PACKET_SIZE] != TS_SYNC_BYTE)
+            continue;
+        if (i + 2 * TS_PACKET_SIZE < size && buf[i + 2 * TS_PACKET_SIZE] != TS_SYNC_BYTE)
+            continue;
+        return i;
+    }
+    return size;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <chrono>
+#include "ts_scanner.h"
+
+static constexpr char usage_string[] = "usage:\n"
+                                       "    ts_scan -i [file.ts] [-x index] [-f bin|csv] [-p]\n"
+                                       "-x write the PCR/PES timeline index to this file\n"
+                                       "-f index format, bin (24 bytes per entry after an 8 byte \"TSINDEX1\" header) or csv, default bin\n"
+                                       "-p only index PCR, skip PES timestamps\n";
+
+static bool WriteIndex(const std::string &path, const std::string &format, const std::vector<TsIndexEntry> &index)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        perror("fopen");
+        return false;
+    }
+    bool ok = true;
+    if (format == "csv")
+    {
+        fprintf(file, "offset,pid,type,value,pts_dts_delta,flags\n");
+        for (auto &&entry : index)
+        {
+            fprintf(file, "%lu,%u,%s,%ld,%d,%u\n", static_cast<unsigned long>(entry.offset), entry.pid,
+                    entry.type == TsIndexEntry::kPcr ? "pcr" : "pes", static_cast<long>(entry.value),
+                    entry.pts_dts_delta, entry.flags);
+        }
+    }
+    else
+    {
+        ok = fwrite("TSINDEX1", 8, 1, file) == 1 &&
+             (index.empty() || fwrite(index.data(), sizeof(TsIndexEntry), index.size(), file) == index.size());
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        fprintf(stderr, "write %s failed\n", path.c_str());
+    return ok;
+}
+
+static void PrintSummary(const TsScanner &scanner, uint64_t size, double seconds)
+{
+    const TsPidStats *pcr_pid = scanner.PcrPid();
+    // 整个流的时长按PCR算，没有PCR就不给码率
+    const double duration = pcr_pid ? pcr_pid->pcr_span / 27000000.0 : 0;
+    printf("%lu packets, %lu sync losses, %.3f MB in %.3f ms, %.2f GB/s\n",
+           static_cast<unsigned long>(scanner.Packets()), static_cast<unsigned long>(scanner.SyncLosses()),
+           size / 1e6, seconds * 1e3, seconds > 0 ? size / seconds / 1e9 : 0);
+    if (duration > 0)
+        printf("duration %.3f s (PCR of pid %d), total %.1f kbit/s\n", duration, pcr_pid->pid,
+               scanner.Packets() * TS_PACKET_SIZE * 8 / duration / 1e3);
+    printf("%6s %10s %10s %8s %8s %12s %12s %8s %8s %12s %12s\n", "pid", "packets", "kbit/s", "cc_err",
+           "pcr", "pcr_max_ms", "jitter_us", "pes", "rai", "first_pts", "last_pts");
+    for (auto &&st : scanner.PidStats())
+    {
+        printf("%6d %10lu %10.1f %8lu %8lu %12.3f %12.3f %8lu %8lu %12ld %12ld\n", st.pid,
+               static_cast<unsigned long>(st.packets),
+               duration > 0 ? st.packets * TS_PACKET_SIZE * 8 / duration / 1e3 : 0.0,
+               static_cast<unsigned long>(st.cc_errors), static_cast<unsigned long>(st.pcr_count),
+               st.max_pcr_interval / 27000.0, scanner.MaxPcrJitter(st) / 27.0,
+               static_cast<unsigned long>(st.pes_count), static_cast<unsigned long>(st.random_access),
+               static_cast<long>(st.first_pts == TS_NOPTS_VALUE ? -1 : st.first_pts),
+               static_cast<long>(st.last_pts == TS_NOPTS_VALUE ? -1 : st.last_pts));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+    const char *optstring = "i:x:f:ph";
+    std::string in_filename;
+    std::string index_filename;
+    std::string index_format = "bin";
+    bool index_pes = true;
+    while ((ret = getopt(argc, argv, optstring)) != -1)
+    {
+        switch (ret)
+        {
+        case 'i':
+            in_filename = optarg;
+            break;
+        case 'x':
+            index_filename = optarg;
+            break;
+        case 'f':
+            index_format = optarg;
+            break;
+        case 'p':
+            index_pes = false;
+            break;
+        case 'h':
+            printf(usage_string);
+            return 0;
+        case '?':
+            printf("error optopt: %c\n", optopt);
+            printf("error opterr: %d\n", opterr);
+            break;
+        default:
+            break;
+        }
+    }
+    if (in_filename.empty())
+    {
+        printf(usage_string);
+        return -1;
+    }
+
+    int fd = open(in_filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        perror("open");
+        return -1;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size == 0)
+    {
+        fprintf(stderr, "empty or unreadable input %s\n", in_filename.c_str());
+        close(fd);
+        return -1;
+    }
+    const size_t size = sb.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    // 顺序扫一遍，让内核加大预读
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    TsScanner scanner(index_pes);
+    auto start = std::chrono::steady_clock::now();
+    scanner.Scan(static_cast<const uint8_t *>(addr), size);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    munmap(addr, size);
+
+    PrintSummary(scanner, size, elapsed.count());
+    if (!index_filename.empty() && !WriteIndex(index_filename, index_format, scanner.Index()))
+        return -1;
+    return 0;
+}
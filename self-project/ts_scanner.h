@@ -0,0 +1,255 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "ts_parser.h"
+
+/*
+    不经过mpegts.c解复用，直接按188字节跨步扫TS包头，统计每个PID的PCR、PTS/DTS和连续计数器
+    每个包只碰包头和自适应字段，负载只在PES起始包里看一下PES头
+*/
+
+// PCR是33位90kHz加9位扩展，按27MHz算的回绕周期
+static constexpr int64_t kPcrWrap = (INT64_C(1) << 33) * 300;
+static constexpr int64_t kPtsWrap = INT64_C(1) << 33;
+
+// 时间轴索引的一条记录，固定24字节，直接按数组写文件
+struct TsIndexEntry
+{
+    enum Type : uint8_t
+    {
+        kPcr = 1,
+        kPes = 2,
+    };
+    enum Flags : uint8_t
+    {
+        kRandomAccess = 1,
+        kDiscontinuity = 2,
+        kHasDts = 4,
+    };
+
+    uint64_t offset;    // 包在文件中的字节偏移
+    int64_t value;      // kPcr: 27MHz的PCR；kPes: 90kHz的PTS(没有PTS时为TS_NOPTS_VALUE)
+    uint16_t pid;
+    uint8_t type;
+    uint8_t flags;
+    int32_t pts_dts_delta;    // PTS-DTS，没有DTS时为0
+};
+static_assert(sizeof(TsIndexEntry) == 24, "TsIndexEntry is written to disk as is");
+
+struct TsPidStats
+{
+    int pid{0};
+    uint64_t packets{0};
+    uint64_t cc_errors{0};
+    uint64_t transport_errors{0};
+    uint64_t discontinuities{0};
+    uint64_t pes_count{0};
+    uint64_t random_access{0};
+    uint64_t pcr_count{0};
+    int64_t first_pcr{-1};
+    int64_t last_pcr{-1};
+    uint64_t first_pcr_offset{0};
+    uint64_t last_pcr_offset{0};
+    int64_t pcr_span{0};    // 所有PCR间隔之和(跳过不连续点)，27MHz
+    int64_t max_pcr_interval{0};
+    int64_t first_pts{TS_NOPTS_VALUE};
+    int64_t last_pts{TS_NOPTS_VALUE};
+    int last_cc{-1};
+};
+
+class TsScanner
+{
+public:
+    explicit TsScanner(bool index_pes = true)
+        : index_pes_(index_pes)
+    {
+        memset(slots_, -1, sizeof(slots_));
+    }
+
+    // data不要求从包边界开始，offset是data[0]在整个流里的偏移
+    void Scan(const uint8_t *data, size_t size, uint64_t offset = 0)
+    {
+        size_t pos = ts_find_sync(data, size);
+        while (pos + TS_PACKET_SIZE <= size)
+        {
+            if (data[pos] != TS_SYNC_BYTE)
+            {
+                sync_losses_++;
+                pos += ts_find_sync(data + pos, size - pos);
+                continue;
+            }
+            Feed(data + pos, offset + pos);
+            pos += TS_PACKET_SIZE;
+        }
+    }
+
+    // 已经对齐好的单个包
+    void Feed(const uint8_t *packet, uint64_t offset)
+    {
+        const int pid = ts_pid(packet);
+        TsPidStats &st = Stats(pid);
+        packets_++;
+        st.packets++;
+        if (ts_transport_error(packet))
+        {
+            st.transport_errors++;
+            return;
+        }
+        if (pid == TS_NULL_PID)
+            return;
+
+        const int afc = ts_afc(packet);
+        const int af_flags = ts_af_flags(packet);
+        const bool discontinuity = af_flags & 0x80;
+        if (discontinuity)
+            st.discontinuities++;
+        st.cc_errors += ts_check_cc(&st.last_cc, packet);
+
+        if (af_flags & 0x10)
+        {
+            const int64_t pcr = ts_pcr(packet);
+            if (pcr >= 0)
+                OnPcr(st, pcr, offset, discontinuity);
+        }
+        if ((afc & 1) && ts_pusi(packet))
+        {
+            int64_t pts, dts;
+            if (ts_parse_pes_timestamps(packet, &pts, &dts) == 0)
+                OnPes(st, pts, dts, offset, af_flags);
+        }
+    }
+
+    uint64_t Packets() const
+    {
+        return packets_;
+    }
+
+    uint64_t SyncLosses() const
+    {
+        return sync_losses_;
+    }
+
+    // 按PID出现的顺序
+    const std::vector<TsPidStats> &PidStats() const
+    {
+        return pids_;
+    }
+
+    const std::vector<TsIndexEntry> &Index() const
+    {
+        return index_;
+    }
+
+    // 包数最多的带PCR的PID的位置和时间，用来换算整个流的码率
+    const TsPidStats *PcrPid() const
+    {
+        const TsPidStats *best = nullptr;
+        for (auto &&st : pids_)
+        {
+            if (st.pcr_count >= 2 && (!best || st.pcr_count > best->pcr_count))
+                best = &st;
+        }
+        return best;
+    }
+
+    // PCR抖动：以整段的平均码率把字节位置换算成理想PCR，返回实际PCR偏离的最大绝对值(27MHz)
+    // 只对CBR复用的流有意义，VBR的流得到的是码率起伏
+    int64_t MaxPcrJitter(const TsPidStats &st) const
+    {
+        if (st.pcr_count < 2 || st.last_pcr_offset == st.first_pcr_offset)
+            return 0;
+        const double ticks_per_byte = static_cast<double>(st.pcr_span) / (st.last_pcr_offset - st.first_pcr_offset);
+        int64_t max_jitter = 0, elapsed = 0, prev = -1;
+        for (auto &&entry : index_)
+        {
+            if (entry.type != TsIndexEntry::kPcr || entry.pid != st.pid)
+                continue;
+            if (prev >= 0 && !(entry.flags & TsIndexEntry::kDiscontinuity))
+                elapsed += (entry.value - prev + kPcrWrap) % kPcrWrap;
+            prev = entry.value;
+            const int64_t expected = static_cast<int64_t>((entry.offset - st.first_pcr_offset) * ticks_per_byte);
+            const int64_t jitter = elapsed > expected ? elapsed - expected : expected - elapsed;
+            if (jitter > max_jitter)
+                max_jitter = jitter;
+        }
+        return max_jitter;
+    }
+
+private:
+    TsPidStats &Stats(int pid)
+    {
+        int16_t &slot = slots_[pid];
+        if (slot < 0)
+        {
+            slot = static_cast<int16_t>(pids_.size());
+            pids_.emplace_back();
+            pids_.back().pid = pid;
+        }
+        return pids_[slot];
+    }
+
+    void OnPcr(TsPidStats &st, int64_t pcr, uint64_t offset, bool discontinuity)
+    {
+        if (st.pcr_count == 0)
+        {
+            st.first_pcr = pcr;
+            st.first_pcr_offset = offset;
+        }
+        else if (!discontinuity)
+        {
+            const int64_t interval = (pcr - st.last_pcr + kPcrWrap) % kPcrWrap;
+            st.pcr_span += interval;
+            if (interval > st.max_pcr_interval)
+                st.max_pcr_interval = interval;
+        }
+        st.last_pcr = pcr;
+        st.last_pcr_offset = offset;
+        st.pcr_count++;
+
+        TsIndexEntry entry{};
+        entry.offset = offset;
+        entry.value = pcr;
+        entry.pid = static_cast<uint16_t>(st.pid);
+        entry.type = TsIndexEntry::kPcr;
+        entry.flags = discontinuity ? TsIndexEntry::kDiscontinuity : 0;
+        index_.push_back(entry);
+    }
+
+    void OnPes(TsPidStats &st, int64_t pts, int64_t dts, uint64_t offset, int af_flags)
+    {
+        st.pes_count++;
+        if (af_flags & 0x40)
+            st.random_access++;
+        if (pts != TS_NOPTS_VALUE)
+        {
+            if (st.first_pts == TS_NOPTS_VALUE)
+                st.first_pts = pts;
+            st.last_pts = pts;
+        }
+        if (!index_pes_)
+            return;
+
+        TsIndexEntry entry{};
+        entry.offset = offset;
+        entry.value = pts;
+        entry.pid = static_cast<uint16_t>(st.pid);
+        entry.type = TsIndexEntry::kPes;
+        entry.flags = ((af_flags & 0x40) ? TsIndexEntry::kRandomAccess : 0) |
+                      ((af_flags & 0x80) ? TsIndexEntry::kDiscontinuity : 0);
+        if (pts != TS_NOPTS_VALUE && dts != TS_NOPTS_VALUE)
+        {
+            entry.flags |= TsIndexEntry::kHasDts;
+            entry.pts_dts_delta = static_cast<int32_t>((pts - dts + kPtsWrap) % kPtsWrap);
+        }
+        index_.push_back(entry);
+    }
+
+private:
+    bool index_pes_;
+    int16_t slots_[TS_MAX_PID];    // PID到pids_下标，-1表示还没出现过
+    std::vector<TsPidStats> pids_;
+    std::vector<TsIndexEntry> index_;
+    uint64_t packets_{0};
+    uint64_t sync_losses_{0};
+};